@@ -25,6 +25,11 @@
 #include "airspy_component.h"
 #include "console_display.h"
 #include "fft_component.h"
+#include "pfb_component.h"
+#include "ddc_component.h"
+#include "recorder_component.h"
+#include "iq_replay_component.h"
+#include "sweep_component.h"
 #include "matrix/Keymaster.h"
 #include "matrix/yaml_util.h"
 #include "matrix/log_t.h"
@@ -64,6 +69,11 @@ namespace sdrm
 
         add_component_factory("AirspyComponent", &AirspyComponent::factory);
         add_component_factory("FFTComponent", &FFTComponent::factory);
+        add_component_factory("PFBComponent", &PFBComponent::factory);
+        add_component_factory("DDCComponent", &DDCComponent::factory);
+        add_component_factory("RecorderComponent", &RecorderComponent::factory);
+        add_component_factory("IQReplayComponent", &IQReplayComponent::factory);
+        add_component_factory("SweepComponent", &SweepComponent::factory);
         add_component_factory("ConsoleDisplay", &ConsoleDisplay::factory);
 
         try
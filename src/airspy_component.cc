@@ -22,14 +22,19 @@
  *******************************************************************/
 
 #include "airspy_component.h"
+#include "sdrm_config.h"
+#include "trace.h"
 
 #include <memory>
 #include <matrix/matrix_util.h>
+#include <matrix/log_t.h>
 
 using namespace std;
 using namespace matrix;
 using namespace mxutils;
 
+static matrix::log_t logger("AirspyComponent");
+
 ostream & operator << (ostream &o,  const airspyhf_complex_float_t &v)
 {
     o << "{" << v.re << ", " << v.im << "}";
@@ -42,65 +47,147 @@ Component *AirspyComponent::factory(std::string name,std::string km_url)
     return new AirspyComponent(name, km_url);
 }
 
+device_stream_t::device_stream_t(AirspyComponent *c, uint64_t serial,
+                                 size_t pool_size,
+                                 DataSource<msgpack::sbuffer> *src) :
+    component(c),
+    sn(serial),
+    pool(pool_size),
+    ring(pool_size),
+    source(src),
+    run(false),
+    thread_started(false),
+    thread(this, &device_stream_t::publishing_task),
+    sequence(0),
+    reanchor(true),
+    samples_received(0),
+    anchor_index(0),
+    anchor_time(0),
+    transfers(stats.counter("transfers")),
+    samples(stats.counter("samples")),
+    dropped_samples(stats.counter("dropped_samples")),
+    overflows(stats.counter("overflows")),
+    callback_time(stats.histogram("callback_time")),
+    occupancy(stats.gauge("ring.occupancy")),
+    high_water(stats.gauge("ring.high_water")),
+    published(stats.counter("published")),
+    published_bytes(stats.counter("published_bytes")),
+    publish_time(stats.histogram("publish_time"))
+{
+    stats.gauge("ring.capacity").set(pool.size());
+    // The HF+'s default samplerate, until one is set.
+    tuning.update([](sdrm::tuning_t &t) {t.samplerate = 768000;});
+}
+
+void device_stream_t::publishing_task()
+{
+    component->publishing_task(this);
+}
+
 AirspyComponent::AirspyComponent(std::string name, std::string keymaster_url) :
     Component(name, keymaster_url),
-    iq_signal_source(keymaster_url, name, "iq_data")
+    iq_signal_source(keymaster_url, name, "iq_data"),
+    _run(false),
+    _stat_published(_stats.counter("published")),
+    _stat_bytes(_stats.counter("published_bytes")),
+    _stat_publish(_stats.histogram("publish_time")),
+    _stat_commands(_stats.counter("commands")),
+    _stat_command_wait(_stats.histogram("command_wait")),
+    _monitor_run(false),
+    _monitor_thread_started(false),
+    _monitor_thread(this, &AirspyComponent::monitoring_task)
 {
     handlers =
         {
             {"lib_version",
-             cb_t(new member_cb(this, &AirspyComponent::lib_version))},
+             &AirspyComponent::lib_version},
             {"list_devices",
-             cb_t(new member_cb(this, &AirspyComponent::list_devices))},
+             &AirspyComponent::list_devices},
             {"open",
-             cb_t(new member_cb(this, &AirspyComponent::open))},
+             &AirspyComponent::open},
             {"open_sn",
-             cb_t(new member_cb(this, &AirspyComponent::open_sn))},
+             &AirspyComponent::open_sn},
             {"close",
-             cb_t(new member_cb(this, &AirspyComponent::close))},
+             &AirspyComponent::close},
             {"start",
-             cb_t(new member_cb(this, &AirspyComponent::start))},
+             &AirspyComponent::start},
             {"stop",
-             cb_t(new member_cb(this, &AirspyComponent::stop))},
+             &AirspyComponent::stop},
             {"is_streaming",
-             cb_t(new member_cb(this, &AirspyComponent::is_streaming))},
+             &AirspyComponent::is_streaming},
             {"set_freq",
-             cb_t(new member_cb(this, &AirspyComponent::set_freq))},
+             &AirspyComponent::set_freq},
             {"set_lib_dsp",
-             cb_t(new member_cb(this, &AirspyComponent::set_lib_dsp))},
+             &AirspyComponent::set_lib_dsp},
             {"get_samplerates",
-             cb_t(new member_cb(this, &AirspyComponent::get_samplerates))},
+             &AirspyComponent::get_samplerates},
             {"set_samplerate",
-             cb_t(new member_cb(this, &AirspyComponent::set_samplerate))},
+             &AirspyComponent::set_samplerate},
             {"get_calibration",
-             cb_t(new member_cb(this, &AirspyComponent::get_calibration))},
+             &AirspyComponent::get_calibration},
             {"set_calibration",
-             cb_t(new member_cb(this, &AirspyComponent::set_calibration))},
+             &AirspyComponent::set_calibration},
             {"set_optimal_iq_correction_point",
-             cb_t(new member_cb(this, &AirspyComponent::set_optimal_iq_correction_point))},
+             &AirspyComponent::set_optimal_iq_correction_point},
             {"iq_balancer_configure",
-             cb_t(new member_cb(this, &AirspyComponent::iq_balancer_configure))},
+             &AirspyComponent::iq_balancer_configure},
             {"flash_calibration",
-             cb_t(new member_cb(this, &AirspyComponent::flash_calibration))},
+             &AirspyComponent::flash_calibration},
             {"board_partid_serialno_read",
-             cb_t(new member_cb(this, &AirspyComponent::board_partid_serialno_read))},
+             &AirspyComponent::board_partid_serialno_read},
             {"version_string_read",
-             cb_t(new member_cb(this, &AirspyComponent::version_string_read))},
+             &AirspyComponent::version_string_read},
             {"set_user_output",
-             cb_t(new member_cb(this, &AirspyComponent::set_user_output))},
+             &AirspyComponent::set_user_output},
             {"set_hf_agc",
-             cb_t(new member_cb(this, &AirspyComponent::set_hf_agc))},
+             &AirspyComponent::set_hf_agc},
             {"set_hf_agc_threshold",
-             cb_t(new member_cb(this, &AirspyComponent::set_hf_agc_threshold))},
+             &AirspyComponent::set_hf_agc_threshold},
             {"set_hf_att",
-             cb_t(new member_cb(this, &AirspyComponent::set_hf_att))}
+             &AirspyComponent::set_hf_att},
+            {"configure",
+             &AirspyComponent::configure}
         };
 
+    _pool_size = sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".ringbuffer_pool_size", 32);
+    _wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".wire_format", "msgpack"));
+    _sample_format = sdrm::sample_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".sample_format", "cf32"));
+
+    if (_sample_format != sdrm::SAMPLE_CF32
+        and _wire_format != sdrm::WIRE_RAW)
+    {
+        logger.warning(__PRETTY_FUNCTION__, "sample_format applies only to",
+                       "the raw wire_format; sending cf32");
+    }
+    _stats_interval = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".stats_interval_ms", 1000.0)
+        * 1000000;
+
+    // Each device listed gets a source of its own, which must be
+    // declared under Sources; the rest share "iq_data".
+    auto sns = sdrm::get_config<vector<uint64_t>>(
+        keymaster, my_full_instance_name + ".devices", vector<uint64_t>());
+
+    for (auto sn : sns)
+    {
+        string source = "iq_data_" + to_string(sn);
+        _sources[sn].reset(new DataSource<msgpack::sbuffer>(
+                               keymaster_url, name, source));
+        logger.info(__PRETTY_FUNCTION__, "device", sn, "publishes on", source);
+    }
+
+    _command_cb.reset(new member_cb(this, &AirspyComponent::command));
+
     for (auto handler: handlers)
     {
         auto key = handler.first;
-        auto ptr = handler.second;
-        keymaster->subscribe("AIRSPYCMDS." + key + ".request", ptr.get());
+        keymaster->subscribe("AIRSPYCMDS." + key + ".request",
+                             _command_cb.get());
     }
 }
 
@@ -118,23 +205,156 @@ bool AirspyComponent::_do_stop()
     return true;
 }
 
+/**
+ * Starts the publishing threads, one per device, and the monitoring
+ * thread. Devices may be started at any time, but their data will sit
+ * in their rings (and eventually overflow) until the component is
+ * Ready.
+ *
+ */
+
 bool AirspyComponent::_do_ready()
 {
+    _monitor_run = true;
+
+    if (!_monitor_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _monitor_thread.start("Airspy _monitor_thread");
+    }
+
+    bool rval = _monitor_thread_started.wait(true, 5000000);
+
+    if (rval)
+    {
+        logger.info(__PRETTY_FUNCTION__, "_monitor_thread started.");
+    }
+    else
+    {
+        logger.error(__PRETTY_FUNCTION__,
+                     "_monitor_thread failed to start!");
+        _monitor_run = false;
+        _monitor_thread.join();
+        _monitor_thread_started.set_value(false);
+        return false;
+    }
+
+    lock_guard<mutex> l(_streams_mutex);
+    _run = true;
+
+    for (auto &s : _streams)
+    {
+        start_publishing(s.second.get());
+    }
+
     return true;
 }
 
 bool AirspyComponent::_do_standby()
 {
+    {
+        lock_guard<mutex> l(_streams_mutex);
+        _run = false;
+
+        for (auto &s : _streams)
+        {
+            stop_publishing(s.second.get());
+        }
+    }
+
+    _monitor_run = false;
+    _monitor_thread.join();
+    _monitor_thread_started.set_value(false);
+    logger.info(__PRETTY_FUNCTION__, "publishing threads terminated");
     return true;
 }
 
 /**
- * Writes to the component's source. This function is called by the
+ * Returns the streaming context for device `sn`, creating it if need
+ * be, and starting its publishing thread if the component is Ready.
+ * The context lives until remove_stream() is called for it, so the
+ * pointer may be handed to airspyhf_start().
+ *
+ * @param sn: The device serial number.
+ *
+ * @return The device_stream_t for that device.
+ *
+ */
+
+device_stream_t *AirspyComponent::get_stream(uint64_t sn)
+{
+    lock_guard<mutex> l(_streams_mutex);
+    auto &ds = _streams[sn];
+
+    if (not ds)
+    {
+        auto src = _sources.find(sn);
+        ds.reset(new device_stream_t(this, sn, _pool_size,
+                                     src == _sources.end()
+                                     ? &iq_signal_source : src->second.get()));
+
+        if (_run)
+        {
+            start_publishing(ds.get());
+        }
+    }
+
+    return ds.get();
+}
+
+/**
+ * Discards the streaming context for device `sn`, once its publishing
+ * thread has published what is left in its ring. The device must no
+ * longer be streaming.
+ *
+ * @param sn: The device serial number.
+ *
+ */
+
+void AirspyComponent::remove_stream(uint64_t sn)
+{
+    lock_guard<mutex> l(_streams_mutex);
+    auto s = _streams.find(sn);
+
+    if (s != _streams.end())
+    {
+        stop_publishing(s->second.get());
+        _streams.erase(s);
+    }
+}
+
+void AirspyComponent::start_publishing(device_stream_t *ds)
+{
+    ds->run = true;
+
+    if (!ds->thread.running())
+    {
+        ds->thread.start("Airspy " + to_string(ds->sn));
+    }
+
+    if (not ds->thread_started.wait(true, 5000000))
+    {
+        logger.error(__PRETTY_FUNCTION__, "publishing thread for", ds->sn,
+                     "failed to start!");
+    }
+}
+
+void AirspyComponent::stop_publishing(device_stream_t *ds)
+{
+    ds->run = false;
+    ds->thread.join();
+    ds->thread_started.set_value(false);
+}
+
+/**
+ * Queues a transfer for publication. This function is called by the
  * callback function that is given to the airspyhf library's start()
  * call. The start() function takes a void *ctx that can be anything
- * of use. In this case it is the 'this' pointer to the
- * AirspyComponent instance that is running. When called, the callback
- * unpacks it and calls this function with it.
+ * of use. In this case it is the device_stream_t of the device being
+ * started. When called, the callback unpacks it and calls this
+ * function with it.
+ *
+ * @param ds: The device's streaming context.
  *
  * @param transfer: a pointer to the airspyhf_transfer_t object given
  * to the callback. The airspyhf_transfer_t structure is defined as
@@ -151,12 +371,205 @@ bool AirspyComponent::_do_standby()
  * of interest to us here are the samples, the sample_count, and the
  * dropped_samples count.
  *
+ * The samples are only copied into a buffer from the device's pool
+ * and pushed onto its ring; serialization and publication happen on
+ * the publishing thread. Nothing here blocks or allocates. If the
+ * pool is empty the transfer is dropped and counted in the device's
+ * `overflows`. The transfer's sequence number is consumed either way,
+ * so that subscribers can see the gap.
+ *
+ * Each transfer is also given its first sample's index in the
+ * device's stream (samples received plus the library's dropped count)
+ * and that sample's time. The time is the host clock at the first
+ * transfer after a start or samplerate change, less the transfer's
+ * duration, extrapolated by the samplerate; so it is as regular as
+ * the sample clock, with none of the callback's scheduling jitter.
+ *
+ */
+
+void AirspyComponent::queue_transfer(device_stream_t *ds,
+                                     airspyhf_transfer_t *transfer)
+{
+    sdrm::trace_span span("airspy.callback", ds->sequence);
+    uint64_t start = sdrm::stats_now();
+    uint64_t seq = ds->sequence++;
+    uint64_t index = ds->samples_received + transfer->dropped_samples;
+    // reanchor is set after a samplerate change is made, so it is
+    // checked before the tuning is read.
+    bool reanchor = ds->reanchor.exchange(false, memory_order_acquire);
+    sdrm::tuning_t tuning = ds->tuning.load();
+    uint32_t rate = tuning.samplerate;
+
+    ds->samples_received += transfer->sample_count;
+    ds->transfers.add();
+    ds->samples.add(transfer->sample_count);
+    ds->dropped_samples.set(transfer->dropped_samples);
+
+    if (reanchor)
+    {
+        ds->anchor_index = index;
+        ds->anchor_time = Time::getUTC()
+            - (uint64_t)transfer->sample_count * 1000000000ULL / rate;
+    }
+
+    uint64_t time = sdrm::sample_timestamp(ds->anchor_time,
+                                           index - ds->anchor_index, rate);
+    sdrm::iq_buffer_t *buf = ds->pool.acquire();
+
+    if (buf == NULL)
+    {
+        ds->overflows.add();
+        ds->callback_time.record(sdrm::stats_now() - start);
+        return;
+    }
+
+    buf->load(transfer, seq, index, time, tuning);
+    // The ring holds as many entries as there are pool buffers, so
+    // this can't fail.
+    ds->ring.push(buf);
+    ds->high_water.raise(ds->ring.occupancy());
+    ds->callback_time.record(sdrm::stats_now() - start);
+}
+
+/**
+ * Drains a device's ring, serializing and publishing each buffer and
+ * returning it to the pool.
+ *
+ * @param ds: The device's streaming context.
+ *
+ * @return The number of buffers published.
+ *
+ */
+
+size_t AirspyComponent::publish_stream(device_stream_t *ds)
+{
+    size_t published = 0;
+    bool shared = ds->source == &iq_signal_source;
+    sdrm::iq_buffer_t *buf;
+
+    while (ds->ring.pop(buf))
+    {
+        uint64_t start = sdrm::stats_now();
+
+        {
+            sdrm::trace_span span("airspy.pack", buf->sequence);
+            buf->pack(_wire_format, _sample_format);
+        }
+
+        {
+            sdrm::trace_span span("airspy.publish", buf->sequence);
+            unique_lock<mutex> l(_iq_signal_mutex, defer_lock);
+
+            if (shared)
+            {
+                l.lock();
+            }
+
+            ds->source->publish(buf->packed);
+        }
+
+        uint64_t elapsed = sdrm::stats_now() - start;
+        ds->publish_time.record(elapsed);
+        ds->published_bytes.add(buf->packed.size());
+        _stat_publish.record(elapsed);
+        _stat_bytes.add(buf->packed.size());
+        ds->pool.release(buf);
+        ++published;
+    }
+
+    ds->published.add(published);
+    _stat_published.add(published);
+    return published;
+}
+
+/**
+ * Writes the component's statistics to "STATS.<name>", with each
+ * device's under "devices.<sn>":
+ *
+ *   published, published_bytes: buffers published, all devices
+ *   publish_time:      time to serialize and publish a buffer
+ *   commands:          AIRSPYCMDS commands run
+ *   command_wait:      time a command waited in its device's queue
+ *   devices.<sn>:
+ *     published, published_bytes, publish_time: the device's own
+ *     transfers, samples: received from the library
+ *     dropped_samples:   the library's count of samples it dropped
+ *     overflows:         transfers lost because the pool was empty
+ *     callback_time:     time spent in the library's callback
+ *     ring:              capacity, occupancy and high water mark of
+ *                        the device's ring, for tuning
+ *                        `ringbuffer_pool_size`
+ *
+ * Counters have a total and a rate, histograms percentiles; see
+ * sdrm::stats_group::report(). How often is set by
+ *
+ *   stats_interval_ms: 1000   # 0 turns reporting off
+ *
  */
 
-void AirspyComponent::write_to_source(airspyhf_transfer_t *transfer)
+void AirspyComponent::report_stats()
 {
-    sdrm::iq_data_t data(transfer);
-    msgpack::sbuffer srcbuf;
-    msgpack::pack(srcbuf, data);
-    iq_signal_source.publish(srcbuf);
+    YAML::Node stats;
+    _stats.report(stats);
+
+    lock_guard<mutex> l(_streams_mutex);
+
+    for (auto &s : _streams)
+    {
+        auto &ds = s.second;
+        YAML::Node device;
+        ds->occupancy.set(ds->ring.occupancy());
+        ds->stats.report(device);
+        stats["devices"][to_string(s.first)] = device;
+    }
+
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
+
+/**
+ * A device's publishing thread: the consumer side of its ring.
+ * Publishes whatever the callback has queued, and sleeps briefly when
+ * there is nothing to do. Transfers arrive every few milliseconds, so
+ * a short sleep costs little latency and no samples.
+ *
+ * @param ds: The device's streaming context.
+ *
+ */
+
+void AirspyComponent::publishing_task(device_stream_t *ds)
+{
+    logger.info(__PRETTY_FUNCTION__, "running for", ds->sn);
+    ds->thread_started.signal(true);
+
+    while (ds->run.load())
+    {
+        if (publish_stream(ds) == 0)
+        {
+            Time::thread_delay(200000L);
+        }
+    }
+
+    // publish anything left behind.
+    publish_stream(ds);
+}
+
+/**
+ * Reports the statistics every `stats_interval_ms`.
+ *
+ */
+
+void AirspyComponent::monitoring_task()
+{
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _monitor_thread_started.signal(true);
+
+    while (_monitor_run.load())
+    {
+        if (_stats.due(_stats_interval))
+        {
+            report_stats();
+        }
+
+        Time::thread_delay(10000000L);
+    }
 }
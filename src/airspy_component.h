@@ -24,22 +24,97 @@
 #define _AIRSPY_COMPONENT_H_
 
 #include "sdrm_types.h"
+#include "command_queue.h"
+#include "iq_buffer_pool.h"
+#include "seqlock.h"
+#include "spsc_ring.h"
+#include "stats.h"
 
 #include "matrix/Thread.h"
 #include "matrix/Component.h"
 #include "matrix/DataSource.h"
 
 #include <iostream>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
+#include <atomic>
 #include <libairspyhf/airspyhf.h>
 
+class AirspyComponent;
+
+/**
+ * \struct device_stream_t
+ *
+ * The streaming state of one open device. The airspyhf callback
+ * (producer) copies each transfer into a buffer from `pool` and
+ * pushes it onto `ring`; the device's own publishing thread
+ * (consumer) pops it, serializes it, publishes it on `source` and
+ * returns the buffer to `pool`. A pointer to this is the `ctx` given
+ * to airspyhf_start(), so the callback needs no lookup to find it.
+ * Devices share nothing on the way from callback to socket, unless
+ * they share the component's "iq_data" source.
+ *
+ */
+
+struct device_stream_t
+{
+    device_stream_t(AirspyComponent *c, uint64_t serial, size_t pool_size,
+                    matrix::DataSource<msgpack::sbuffer> *src);
+
+    void publishing_task();
+
+    AirspyComponent *component;
+    uint64_t sn;
+    sdrm::iq_buffer_pool pool;
+    sdrm::spsc_ring<sdrm::iq_buffer_t *> ring;
+    // The device's own "iq_data_<sn>", or the shared "iq_data".
+    matrix::DataSource<msgpack::sbuffer> *source;
+    // The publishing thread; runs while the component is Ready.
+    std::atomic<bool> run;
+    matrix::TCondition<bool> thread_started;
+    matrix::Thread<device_stream_t> thread;
+    // next transfer's sequence number. Written by the callback only.
+    uint64_t sequence;
+    // The device's tuning, which tags every buffer. Changed by the
+    // handlers, through AirspyComponent::begin_retune() and
+    // update_tuning(); read by the callback, which never waits for
+    // them.
+    sdrm::seqlock<sdrm::tuning_t> tuning;
+    // The sample clock. `reanchor` is set on start and on a
+    // samplerate change, and the callback then anchors the stream to
+    // the host clock at the next transfer. The rest are the
+    // callback's only.
+    std::atomic<bool> reanchor;
+    uint64_t samples_received;
+    uint64_t anchor_index;
+    uint64_t anchor_time;
+    // The device's telemetry; see AirspyComponent::report_stats().
+    sdrm::stats_group stats;
+    sdrm::stats_counter &transfers;
+    sdrm::stats_counter &samples;
+    sdrm::stats_counter &dropped_samples;
+    // transfers lost because every pool buffer was in flight.
+    sdrm::stats_counter &overflows;
+    sdrm::stats_histogram &callback_time;
+    sdrm::stats_gauge &occupancy;
+    // highest ring occupancy seen, for sizing the pool.
+    sdrm::stats_gauge &high_water;
+    // The publishing thread's.
+    sdrm::stats_counter &published;
+    sdrm::stats_counter &published_bytes;
+    sdrm::stats_histogram &publish_time;
+};
+
 class AirspyComponent : public matrix::Component
 {
 public:
 
     virtual ~AirspyComponent();
-    void write_to_source(airspyhf_transfer_t *);
+    void queue_transfer(device_stream_t *ds, airspyhf_transfer_t *transfer);
+    void publishing_task(device_stream_t *ds);
 
     static Component *factory(std::string myname,std::string k);
 
@@ -76,14 +151,80 @@ protected:
     void set_hf_agc(std::string key, YAML::Node data);
     void set_hf_agc_threshold(std::string key, YAML::Node data);
     void set_hf_att(std::string key, YAML::Node data);
+    void configure(std::string key, YAML::Node data);
+    void command(std::string key, YAML::Node data);
+
+    sdrm::command_queue *get_queue(bool per_device, uint64_t sn);
+    bool configure_device(uint64_t sn, YAML::Node settings,
+                          YAML::Node result);
+
+    typedef std::function<void (sdrm::tuning_t &)> tuning_change_t;
+
+    bool apply_samplerate(airspyhf_device_t *dev, uint64_t samplerate,
+                          std::vector<tuning_change_t> &changes);
+    bool apply_setting(airspyhf_device_t *dev, std::string name,
+                       YAML::Node value,
+                       std::vector<tuning_change_t> &changes);
+    bool retune(airspyhf_device_t *dev, uint64_t sn, std::string name,
+                YAML::Node value);
+    sdrm::tuning_t begin_retune(uint64_t sn);
+    void update_tuning(uint64_t sn, const sdrm::tuning_t &before,
+                       const std::vector<tuning_change_t> &changes);
+
+    device_stream_t *get_stream(uint64_t sn);
+    void remove_stream(uint64_t sn);
+    void start_publishing(device_stream_t *ds);
+    void stop_publishing(device_stream_t *ds);
+    size_t publish_stream(device_stream_t *ds);
+    void report_stats();
+    void monitoring_task();
 
     using member_cb = matrix::KeymasterMemberCB<AirspyComponent>;
-    using  cb_t = std::shared_ptr<member_cb>;
+    typedef void (AirspyComponent::*handler_t)(std::string, YAML::Node);
 
-    // matrix::Thread<AirspyComponent> run_thread;
-    std::map<std::string, cb_t> handlers;
+    // The handlers, by command. Every command's request key is
+    // subscribed to command(), which queues the handler.
+    std::map<std::string, handler_t> handlers;
+    std::unique_ptr<member_cb> _command_cb;
+    // Devices without a source of their own share this one, and
+    // publish on it under _iq_signal_mutex.
     matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+    std::mutex _iq_signal_mutex;
+    // The per-device sources, "iq_data_<sn>", of the devices listed
+    // in `devices`. Made once, by the constructor.
+    std::map<uint64_t,
+             std::unique_ptr<matrix::DataSource<msgpack::sbuffer>>> _sources;
+
+    size_t _pool_size;
+    sdrm::wire_format_t _wire_format;
+    sdrm::sample_format_t _sample_format;
+    // Guards _streams, and _run, which says whether the publishing
+    // threads run.
+    std::mutex _streams_mutex;
+    std::map<uint64_t, std::shared_ptr<device_stream_t>> _streams;
+    bool _run;
+
+    // Totals over all devices.
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_published;
+    sdrm::stats_counter &_stat_bytes;
+    sdrm::stats_histogram &_stat_publish;
+    sdrm::stats_counter &_stat_commands;
+    // time commands spend queued, waiting for their device.
+    sdrm::stats_histogram &_stat_command_wait;
+    uint64_t _stats_interval;
+
+    std::atomic<bool> _monitor_run;
+    matrix::TCondition<bool> _monitor_thread_started;
+    matrix::Thread<AirspyComponent> _monitor_thread;
 
+    // The command queues: one per device commanded, made as needed,
+    // and one for commands on no device. Last, so that they go first;
+    // and the control queue before the device queues, as `configure`
+    // pushes to the device queues from it.
+    std::mutex _queues_mutex;
+    std::map<uint64_t, std::unique_ptr<sdrm::command_queue>> _queues;
+    std::unique_ptr<sdrm::command_queue> _control_queue;
 };
 
 #endif
@@ -20,6 +20,7 @@
  *******************************************************************/
 
 #include "airspy_component.h"
+#include "stats.h"
 #include <matrix/Keymaster.h>
 #include <matrix/yaml_util.h>
 #include <matrix/matrix_util.h>
@@ -27,7 +28,11 @@
 #include <yaml-cpp/yaml.h>
 #include <libairspyhf/airspyhf.h>
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <functional>
 #include <sstream>
+#include <mutex>
+#include <set>
 #include <memory.h>
 
 #define BUF_SIZE 128
@@ -36,11 +41,19 @@
 using namespace std;
 using namespace matrix;
 
-map<uint64_t, airspyhf_device_t *> devices;
-map<airspyhf_device_t *, uint64_t> streamers;
+// The open devices, by serial number, and the reverse. Handlers may
+// run on several threads, so these are only touched under
+// devices_mutex, through the functions below.
+static map<uint64_t, airspyhf_device_t *> devices;
+static map<airspyhf_device_t *, uint64_t> streamers;
+static mutex devices_mutex;
 
 static matrix::log_t logger("airspy_handler");
 
+// The caller's id for the command running on this thread, if it gave
+// one. See AirspyComponent::command().
+static thread_local const YAML::Node *request_id = NULL;
+
 int rx_callback(airspyhf_transfer_t *transfer);
 
 void do_rest(YAML::Node &)
@@ -67,6 +80,7 @@ YAML::Node airspyhf_response(bool flag, T &a, Args... args)
 
 airspyhf_device_t *get_airspyhf_device(uint64_t sn)
 {
+    lock_guard<mutex> l(devices_mutex);
     airspyhf_device_t *dev{NULL};
     auto dev_pr = devices.find(sn);
 
@@ -80,6 +94,7 @@ airspyhf_device_t *get_airspyhf_device(uint64_t sn)
 
 uint64_t get_airspyhf_streaming_device_sn(airspyhf_device_t *dev)
 {
+    lock_guard<mutex> l(devices_mutex);
     auto str_pr = streamers.find(dev);
 
     if (str_pr == streamers.end())
@@ -90,6 +105,51 @@ uint64_t get_airspyhf_streaming_device_sn(airspyhf_device_t *dev)
     return str_pr->second;
 }
 
+/**
+ * Records a newly opened device.
+ *
+ * @return false if a device is already open under `sn`, in which
+ * case `dev` is not recorded.
+ *
+ */
+
+bool add_airspyhf_device(uint64_t sn, airspyhf_device_t *dev)
+{
+    lock_guard<mutex> l(devices_mutex);
+
+    if (not devices.emplace(sn, dev).second)
+    {
+        return false;
+    }
+
+    // reverse lookup
+    streamers[dev] = sn;
+    return true;
+}
+
+/**
+ * Forgets device `sn`.
+ *
+ * @return The device, for the caller to close; NULL if there was none.
+ *
+ */
+
+airspyhf_device_t *remove_airspyhf_device(uint64_t sn)
+{
+    lock_guard<mutex> l(devices_mutex);
+    auto dev_pr = devices.find(sn);
+
+    if (dev_pr == devices.end())
+    {
+        return NULL;
+    }
+
+    airspyhf_device_t *dev = dev_pr->second;
+    devices.erase(dev_pr);
+    streamers.erase(dev);
+    return dev;
+}
+
 string get_cmd_from_key(string key)
 {
     vector<string> parts;
@@ -97,6 +157,34 @@ string get_cmd_from_key(string key)
     return parts[1];
 }
 
+/**
+ * Puts a command's reply, with the caller's request id if it gave
+ * one: {id: <id>, reply: <rval>}.
+ *
+ */
+
+void put_reply(shared_ptr<Keymaster> km, string r_key, YAML::Node rval)
+{
+    YAML::Node reply;
+
+    if (request_id)
+    {
+        reply["id"] = *request_id;
+        reply["reply"] = rval;
+    }
+    else
+    {
+        reply = rval;
+    }
+
+    if (not km->put(r_key, reply, true))
+    {
+        stringstream os;
+        os << "Keymaster::put(" << r_key << ", " << reply << ") failed.";
+        throw runtime_error(os.str());
+    }
+}
+
 template <class Fun>
 void call_handler_with_device(Fun &&func, shared_ptr<Keymaster> km,
                               string key, YAML::Node &n)
@@ -131,12 +219,7 @@ void call_handler_with_device(Fun &&func, shared_ptr<Keymaster> km,
         rval = airspyhf_response(false, cmd, "Runtime exception", e.what());
     }
 
-    if (not km->put(r_key, rval, true))
-    {
-        stringstream os;
-        os << "Keymaster::put(" << r_key << ", " << rval << ") failed.";
-        throw runtime_error(os.str());
-    }
+    put_reply(km, r_key, rval);
 }
 
 template <class Fun>
@@ -162,13 +245,125 @@ void call_handler(Fun &&func, shared_ptr<Keymaster> km, string key)
         rval = airspyhf_response(false, cmd, "Runtime exception", e.what());
     }
 
+    put_reply(km, r_key, rval);
+}
 
-    if (not km->put(r_key, rval, true))
+/**
+ * Receives every AIRSPYCMDS request, and queues its handler. Commands
+ * on a device go to that device's queue, so they run in the order
+ * received, but never wait for commands on another device; a slow
+ * flash_calibration or open_sn on one radio doesn't hold up a `stop`
+ * on another. Commands on no device in particular (lib_version,
+ * list_devices, open, configure) share a queue of their own; a
+ * `configure` then hands each device's settings to that device's
+ * queue.
+ *
+ * A request is either the command's parameters, as always, or a map
+ * of a request id, chosen by the caller, and the parameters:
+ *
+ *   AIRSPYCMDS.set_freq.request: {id: 17, params: [<sn>, 7100000]}
+ *
+ * in which case the reply echoes the id,
+ *
+ *   AIRSPYCMDS.set_freq.reply: {id: 17, reply: [AIRSPYHF_SUCCESS, ...]}
+ *
+ * so that a caller may send several commands without waiting, and
+ * match up the replies as they come.
+ *
+ * @param key: "AIRSPYCMDS.<cmd>.request"
+ *
+ * @param data: The request.
+ *
+ */
+
+void AirspyComponent::command(string key, YAML::Node data)
+{
+    static const set<string> no_device =
+        {"lib_version", "list_devices", "open", "configure"};
+
+    string cmd = get_cmd_from_key(key);
+    auto h = handlers.find(cmd);
+
+    if (h == handlers.end())
     {
-        stringstream os;
-        os << "Keymaster::put(" << r_key << ", " << rval << ") failed.";
-        throw runtime_error(os.str());
+        logger.error(__PRETTY_FUNCTION__, "no handler for", key);
+        return;
+    }
+
+    handler_t handler = h->second;
+    YAML::Node params = data;
+    YAML::Node id;
+
+    if (data.IsMap() and data["id"] and data["params"])
+    {
+        id = data["id"];
+        params = data["params"];
     }
+
+    bool per_device = false;
+    uint64_t sn = 0;
+
+    if (not no_device.count(cmd))
+    {
+        try
+        {
+            sn = params[0].as<uint64_t>();
+            per_device = true;
+        }
+        catch (YAML::Exception &e)
+        {
+            // Leave it to the handler to reply with the error.
+        }
+    }
+
+    sdrm::command_queue *queue = get_queue(per_device, sn);
+    uint64_t queued = sdrm::stats_now();
+
+    queue->push(
+        [this, handler, key, params, id, queued]()
+        {
+            _stat_commands.add();
+            _stat_command_wait.record(sdrm::stats_now() - queued);
+            request_id = id.IsNull() ? NULL : &id;
+
+            try
+            {
+                (this->*handler)(key, params);
+            }
+            catch (std::exception &e)
+            {
+                logger.error(__PRETTY_FUNCTION__, key, ":", e.what());
+            }
+
+            request_id = NULL;
+        });
+}
+
+/**
+ * Returns a command queue, making it if need be.
+ *
+ * @param per_device: true for device `sn`'s queue; false for the
+ * queue of commands on no device in particular.
+ *
+ * @param sn: The device's serial number.
+ *
+ * @return The queue, which lives as long as the component.
+ *
+ */
+
+sdrm::command_queue *AirspyComponent::get_queue(bool per_device, uint64_t sn)
+{
+    lock_guard<mutex> l(_queues_mutex);
+    auto &q = per_device ? _queues[sn] : _control_queue;
+
+    if (not q)
+    {
+        q.reset(new sdrm::command_queue(
+                    per_device ? "AIRSPYCMDS " + to_string(sn)
+                    : string("AIRSPYCMDS")));
+    }
+
+    return q.get();
 }
 
 void AirspyComponent::lib_version(string key, YAML::Node)
@@ -214,19 +409,30 @@ void AirspyComponent::open(string key, YAML::Node)
     auto the_handler =
         [](string cmd) -> YAML::Node
         {
+            // The first free device, known by DEFAULT_DEVICE. Only
+            // one can be; open others with open_sn.
             uint64_t sn = DEFAULT_DEVICE;
             airspyhf_device_t *dev;
-            bool status = false;
 
-            if (airspyhf_open(&dev) == AIRSPYHF_SUCCESS)
+            if (get_airspyhf_device(sn))
             {
-                devices[sn] = dev;
-                // reverse lookup
-                streamers[dev] = sn;
-                status = true;
+                return airspyhf_response(false, cmd, sn,
+                        "A device is already open as the default; "
+                        "use open_sn.");
             }
 
-            return airspyhf_response(status, cmd, sn);
+            if (airspyhf_open(&dev) != AIRSPYHF_SUCCESS)
+            {
+                return airspyhf_response(false, cmd, sn);
+            }
+
+            if (not add_airspyhf_device(sn, dev))
+            {
+                airspyhf_close(dev);
+                return airspyhf_response(false, cmd, sn, "already open");
+            }
+
+            return airspyhf_response(true, cmd, sn);
         };
 
     call_handler(the_handler, keymaster, key);
@@ -239,17 +445,24 @@ void AirspyComponent::open_sn(string key, YAML::Node data)
         {
             airspyhf_device_t *dev;
             auto sn = data[0].as<uint64_t>();
-            bool status = false;
 
-            if (airspyhf_open_sn(&dev, sn) == AIRSPYHF_SUCCESS)
+            if (get_airspyhf_device(sn))
             {
-                devices[sn] = dev;
-                // reverse lookup
-                streamers[dev] = sn;
-                status = true;
+                return airspyhf_response(false, cmd, sn, "already open");
             }
 
-            return airspyhf_response(status, cmd, sn);
+            if (airspyhf_open_sn(&dev, sn) != AIRSPYHF_SUCCESS)
+            {
+                return airspyhf_response(false, cmd, sn);
+            }
+
+            if (not add_airspyhf_device(sn, dev))
+            {
+                airspyhf_close(dev);
+                return airspyhf_response(false, cmd, sn, "already open");
+            }
+
+            return airspyhf_response(true, cmd, sn);
         };
 
     call_handler(the_handler, keymaster, key);
@@ -258,30 +471,20 @@ void AirspyComponent::open_sn(string key, YAML::Node data)
 void AirspyComponent::close(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](string cmd) -> YAML::Node
+        [this, data](string cmd) -> YAML::Node
         {
-            YAML::Node rval;
             uint64_t sn = data[0].as<uint64_t>();
-            airspyhf_device_t *dev;
-            auto dev_pr = devices.find(sn);
+            airspyhf_device_t *dev = remove_airspyhf_device(sn);
 
-            if (dev_pr == devices.end())
+            if (dev == NULL)
             {
                 return airspyhf_response(false, cmd, sn, "could not find the device");
             }
 
-            dev = dev_pr->second;
-            devices.erase(dev_pr);
-
-            auto str_pr = streamers.find(dev);
-
-            if (str_pr != streamers.end())
-            {
-                streamers.erase(str_pr);
-            }
-
+            // Stops the device's streaming first.
             bool status =
                 (airspyhf_close(dev) == AIRSPYHF_SUCCESS) ? true : false;
+            remove_stream(sn);
             return airspyhf_response(status, cmd, sn);
         };
 
@@ -293,8 +496,13 @@ void AirspyComponent::start(string key, YAML::Node data)
     auto the_handler =
         [this](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
+            // The callback isn't running, so its clock may be reset
+            // here; the sample index restarts at 0 with each start.
+            device_stream_t *ds = get_stream(sn);
+            ds->samples_received = 0;
+            ds->reanchor = true;
             bool status =
-                (airspyhf_start(dev, &rx_callback, this)
+                (airspyhf_start(dev, &rx_callback, ds)
                  == AIRSPYHF_SUCCESS) ? true : false;
             return airspyhf_response(status, cmd, sn);
         };
@@ -330,12 +538,10 @@ void AirspyComponent::is_streaming(string key, YAML::Node data)
 void AirspyComponent::set_freq(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
             uint64_t freq_hz = data[1].as<uint64_t>();
-            bool status =
-                (airspyhf_set_freq(dev, freq_hz)
-                 == AIRSPYHF_SUCCESS) ? true : false;
+            bool status = retune(dev, sn, "freq", data[1]);
             return airspyhf_response(status, cmd, sn, freq_hz);
         };
 
@@ -345,12 +551,10 @@ void AirspyComponent::set_freq(string key, YAML::Node data)
 void AirspyComponent::set_lib_dsp(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
             bool flag = data[1].as<bool>();
-            bool status =
-                (airspyhf_set_lib_dsp(dev, flag)
-                 == AIRSPYHF_SUCCESS) ? true : false;
+            bool status = retune(dev, sn, "lib_dsp", data[1]);
             return airspyhf_response(status, cmd, sn, flag);
         };
 
@@ -383,18 +587,170 @@ void AirspyComponent::get_samplerates(string key, YAML::Node data)
 void AirspyComponent::set_samplerate(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
             uint64_t samplerate = data[1].as<uint64_t>();
-            bool status =
-                (airspyhf_set_samplerate(dev, samplerate)
-                 == AIRSPYHF_SUCCESS) ? true : false;
+            bool status = retune(dev, sn, "samplerate", data[1]);
             return airspyhf_response(status, cmd, sn, samplerate);
         };
 
     call_handler_with_device(the_handler, keymaster, key, data);
 }
 
+/**
+ * Sets a device's samplerate.
+ *
+ * @param dev: The device.
+ *
+ * @param samplerate: The rate in S/s; or, like the library, a small
+ * value is an index into the device's list of samplerates.
+ *
+ * @param changes: On success, the change to the device's tuning is
+ * added here, for update_tuning(), which restarts the sample clock at
+ * the new rate.
+ *
+ * @return true on success.
+ *
+ */
+
+bool AirspyComponent::apply_samplerate(airspyhf_device_t *dev,
+                                       uint64_t samplerate,
+                                       vector<tuning_change_t> &changes)
+{
+    if (airspyhf_set_samplerate(dev, samplerate) != AIRSPYHF_SUCCESS)
+    {
+        return false;
+    }
+
+    uint32_t rate = samplerate;
+    uint32_t num = 0;
+
+    if (airspyhf_get_samplerates(dev, &num, 0) == AIRSPYHF_SUCCESS
+        and rate < num)
+    {
+        vector<uint32_t> rates(num);
+
+        if (airspyhf_get_samplerates(dev, rates.data(), num)
+            == AIRSPYHF_SUCCESS)
+        {
+            rate = rates[rate];
+        }
+    }
+
+    changes.push_back([rate](sdrm::tuning_t &t) {t.samplerate = rate;});
+    return true;
+}
+
+/**
+ * Applies one setting to a device, as a retune; see begin_retune().
+ *
+ * @param dev: The device.
+ *
+ * @param sn: Its serial number.
+ *
+ * @param name, value: The setting, as for apply_setting().
+ *
+ * @return true on success.
+ *
+ */
+
+bool AirspyComponent::retune(airspyhf_device_t *dev, uint64_t sn,
+                             string name, YAML::Node value)
+{
+    vector<tuning_change_t> changes;
+    sdrm::tuning_t before = begin_retune(sn);
+    bool status;
+
+    try
+    {
+        status = apply_setting(dev, name, value, changes);
+    }
+    catch (...)
+    {
+        update_tuning(sn, before, changes);
+        throw;
+    }
+
+    update_tuning(sn, before, changes);
+    return status;
+}
+
+/**
+ * Marks device `sn`'s tuning as changing, before the device itself is
+ * changed: the buffers captured from now on carry the next tune
+ * epoch, and a frequency of 0, until update_tuning() says what the
+ * tuning has become. So no buffer captured after the change is tagged
+ * as from before it.
+ *
+ * @param sn: The device's serial number.
+ *
+ * @return The tuning before, for update_tuning().
+ *
+ */
+
+sdrm::tuning_t AirspyComponent::begin_retune(uint64_t sn)
+{
+    // A closed device keeps no stream, and mustn't get one back. This
+    // runs on the device's queue, so it can't be closed meanwhile.
+    if (not get_airspyhf_device(sn))
+    {
+        return sdrm::tuning_t();
+    }
+
+    device_stream_t *ds = get_stream(sn);
+    sdrm::tuning_t before = ds->tuning.load();
+
+    ds->tuning.update([](sdrm::tuning_t &t) {++t.epoch; t.frequency = 0;});
+    return before;
+}
+
+/**
+ * Ends a change begun by begin_retune(): device `sn`'s buffers are
+ * tagged from now on with the tuning as it was, with `changes` made,
+ * and the next tune epoch. Should the samplerate change, the sample
+ * clock is restarted at the new rate.
+ *
+ * @param sn: The device's serial number.
+ *
+ * @param before: What begin_retune() returned.
+ *
+ * @param changes: The changes made to the device; none if it failed.
+ *
+ */
+
+void AirspyComponent::update_tuning(uint64_t sn, const sdrm::tuning_t &before,
+                                    const vector<tuning_change_t> &changes)
+{
+    if (not get_airspyhf_device(sn))
+    {
+        return;
+    }
+
+    device_stream_t *ds = get_stream(sn);
+    uint32_t rate = 0;
+
+    sdrm::tuning_t t = ds->tuning.update(
+        [&](sdrm::tuning_t &t)
+        {
+            uint32_t epoch = t.epoch;
+
+            rate = t.samplerate;
+            t = before;
+
+            for (auto &change : changes)
+            {
+                change(t);
+            }
+
+            t.epoch = epoch + 1;
+        });
+
+    if (t.samplerate != rate)
+    {
+        ds->reanchor.store(true, memory_order_release);
+    }
+}
+
 void AirspyComponent::get_calibration(string key, YAML::Node data)
 {
     auto the_handler =
@@ -545,12 +901,10 @@ void AirspyComponent::set_user_output(string key, YAML::Node data)
 void AirspyComponent::set_hf_agc(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
             bool flag = data[1].as<bool>();
-            bool status =
-                (airspyhf_set_hf_agc(dev, flag)
-                 == AIRSPYHF_SUCCESS) ? true : false;
+            bool status = retune(dev, sn, "hf_agc", data[1]);
             return airspyhf_response(status, cmd, sn, flag);
         };
 
@@ -560,13 +914,11 @@ void AirspyComponent::set_hf_agc(string key, YAML::Node data)
 void AirspyComponent::set_hf_agc_threshold(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
             YAML::Node rval;
             bool flag = data[1].as<bool>();
-            bool status =
-                (airspyhf_set_hf_agc_threshold(dev, flag)
-                 == AIRSPYHF_SUCCESS) ? true : false;
+            bool status = retune(dev, sn, "hf_agc_threshold", data[1]);
             return airspyhf_response(status, cmd, sn, flag);
         };
 
@@ -576,18 +928,318 @@ void AirspyComponent::set_hf_agc_threshold(string key, YAML::Node data)
 void AirspyComponent::set_hf_att(string key, YAML::Node data)
 {
     auto the_handler =
-        [data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
+        [this, data](airspyhf_device_t *dev, uint64_t sn, string cmd) -> YAML::Node
         {
-            bool flag = data[1].as<bool>();
-            bool status =
-                (airspyhf_set_hf_att(dev, flag)
-                 == AIRSPYHF_SUCCESS) ? true : false;
-            return airspyhf_response(status, cmd, sn, flag);
+            // 0 to 8, in 6 dB steps.
+            unsigned att = data[1].as<unsigned>();
+            bool status = retune(dev, sn, "hf_att", data[1]);
+            return airspyhf_response(status, cmd, sn, att);
         };
 
     call_handler_with_device(the_handler, keymaster, key, data);
 }
 
+/**
+ * Applies one setting of a `configure` request. See configure().
+ *
+ * @param changes: On success, any change to the device's tuning is
+ * added here, for update_tuning().
+ *
+ * @return true on success. Throws YAML::Exception if `value` won't
+ * convert, and std::invalid_argument if `name` is unknown.
+ *
+ */
+
+bool AirspyComponent::apply_setting(airspyhf_device_t *dev, string name,
+                                    YAML::Node value,
+                                    vector<tuning_change_t> &changes)
+{
+    int status;
+    tuning_change_t change;
+
+    if (name == "samplerate")
+    {
+        return apply_samplerate(dev, value.as<uint64_t>(), changes);
+    }
+    else if (name == "freq")
+    {
+        uint64_t freq = value.as<uint64_t>();
+        status = airspyhf_set_freq(dev, freq);
+        change = [freq](sdrm::tuning_t &t) {t.frequency = freq;};
+    }
+    else if (name == "calibration")
+    {
+        status = airspyhf_set_calibration(dev, value.as<int32_t>());
+    }
+    else if (name == "lib_dsp")
+    {
+        bool flag = value.as<bool>();
+        status = airspyhf_set_lib_dsp(dev, flag);
+        change = [flag](sdrm::tuning_t &t) {t.lib_dsp = flag;};
+    }
+    else if (name == "hf_agc")
+    {
+        bool flag = value.as<bool>();
+        status = airspyhf_set_hf_agc(dev, flag);
+        change = [flag](sdrm::tuning_t &t) {t.hf_agc = flag;};
+    }
+    else if (name == "hf_agc_threshold")
+    {
+        bool flag = value.as<bool>();
+        status = airspyhf_set_hf_agc_threshold(dev, flag);
+        change = [flag](sdrm::tuning_t &t) {t.hf_agc_threshold = flag;};
+    }
+    else if (name == "hf_att")
+    {
+        // 0 to 8, in 6 dB steps.
+        unsigned att = value.as<unsigned>();
+        status = airspyhf_set_hf_att(dev, att);
+        change = [att](sdrm::tuning_t &t) {t.hf_att = att;};
+    }
+    else
+    {
+        throw invalid_argument("unknown setting");
+    }
+
+    if (status == AIRSPYHF_SUCCESS and change)
+    {
+        changes.push_back(change);
+    }
+
+    return status == AIRSPYHF_SUCCESS;
+}
+
+/**
+ * Applies any number of settings to any number of devices, in one
+ * pass, with one reply. The request maps serial numbers to settings:
+ *
+ *   AIRSPYCMDS.configure.request:
+ *     3914166012436147519:
+ *       samplerate: 768000
+ *       freq: 7100000
+ *       hf_att: 0
+ *       hf_agc: true
+ *
+ * Each device's settings are applied in a fixed order, whatever the
+ * order given: samplerate (which restarts the sample clock), freq,
+ * calibration, lib_dsp, hf_agc, hf_agc_threshold, hf_att. The reply
+ * gives the outcome of each setting, and the time taken to apply
+ * them all:
+ *
+ *   ["AIRSPYHF_SUCCESS", "configure",
+ *    {3914166012436147519: {samplerate: AIRSPYHF_SUCCESS, ...}},
+ *    {apply_us: 1234.5}]
+ *
+ * The status is AIRSPYHF_ERROR if anything failed; the per-setting
+ * outcomes say what. A device that isn't open, an unknown setting or
+ * a bad value fails only that device or setting.
+ *
+ * Each device's settings are applied on its command queue, in turn
+ * with its other commands; the reply comes once all of them are
+ * done, without holding up commands on no device meanwhile. A
+ * device's buffers are retagged once, with all of its changes to
+ * the tuning, so the settings count as one retune.
+ *
+ */
+
+void AirspyComponent::configure(string key, YAML::Node data)
+{
+    // What the devices' parts share: the outcome so far, and how many
+    // are yet to run. The last part to finish posts the reply, so
+    // that the control queue needn't wait for the device queues.
+    struct request_t
+    {
+        mutex lock;
+        YAML::Node results;
+        bool ok;
+        size_t remaining;
+        uint64_t start;
+        YAML::Node id;
+    };
+
+    auto req = make_shared<request_t>();
+    req->results = YAML::Node(YAML::NodeType::Map);
+    req->ok = true;
+    req->start = sdrm::stats_now();
+    // The reply may be put from another thread, after this command's
+    // request has gone.
+    req->id = request_id ? YAML::Clone(*request_id) : YAML::Node();
+
+    auto reply =
+        [this, key, req]()
+        {
+            const YAML::Node *outer = request_id;
+            request_id = req->id.IsNull() ? NULL : &req->id;
+
+            try
+            {
+                call_handler(
+                    [req](string cmd) -> YAML::Node
+                    {
+                        YAML::Node timing;
+                        timing["apply_us"] =
+                            (sdrm::stats_now() - req->start) * 1e-3;
+                        return airspyhf_response(req->ok, cmd, req->results,
+                                                 timing);
+                    },
+                    keymaster, key);
+            }
+            catch (std::exception &e)
+            {
+                logger.error(__PRETTY_FUNCTION__, key, ":", e.what());
+            }
+
+            request_id = outer;
+        };
+
+    // The request is taken apart before any of it runs. Each device's
+    // queue runs its part on a thread of its own, so each gets a copy
+    // of its settings; yaml-cpp nodes of one document may not be used
+    // from several threads.
+    vector<pair<uint64_t, YAML::Node>> parts;
+
+    try
+    {
+        if (not data.IsMap())
+        {
+            throw runtime_error(
+                "Expected a map of serial numbers to settings.");
+        }
+
+        for (auto d : data)
+        {
+            parts.emplace_back(d.first.as<uint64_t>(), YAML::Clone(d.second));
+        }
+    }
+    catch (std::runtime_error &e)
+    {
+        string what = e.what();
+        call_handler(
+            [what](string cmd) -> YAML::Node
+            {
+                return airspyhf_response(false, cmd, what);
+            },
+            keymaster, key);
+        return;
+    }
+
+    if (parts.empty())
+    {
+        reply();
+        return;
+    }
+
+    req->remaining = parts.size();
+
+    // Each device's part is queued with the device's other commands,
+    // so it can't overlap, say, a `close`.
+    for (auto &part : parts)
+    {
+        uint64_t sn = part.first;
+        YAML::Node settings = part.second;
+
+        get_queue(true, sn)->push(
+            [this, req, reply, sn, settings]()
+            {
+                YAML::Node result(YAML::NodeType::Map);
+                bool ok;
+                bool last;
+
+                try
+                {
+                    ok = configure_device(sn, settings, result);
+                }
+                catch (std::exception &e)
+                {
+                    result = e.what();
+                    ok = false;
+                }
+
+                {
+                    lock_guard<mutex> l(req->lock);
+                    req->results[sn] = result;
+                    req->ok = req->ok and ok;
+                    last = --req->remaining == 0;
+                }
+
+                if (last)
+                {
+                    reply();
+                }
+            });
+    }
+}
+
+/**
+ * Applies one device's part of a `configure` request; see
+ * configure(). Runs on the device's command queue.
+ *
+ * @param sn: The device's serial number.
+ *
+ * @param settings: Its settings.
+ *
+ * @param result: A map, to which the outcome of each setting is
+ * added; or, if the device isn't open or `settings` isn't a map,
+ * which is replaced by what is wrong.
+ *
+ * @return true if every setting was applied.
+ *
+ */
+
+bool AirspyComponent::configure_device(uint64_t sn, YAML::Node settings,
+                                       YAML::Node result)
+{
+    static const vector<string> order =
+        {"samplerate", "freq", "calibration", "lib_dsp", "hf_agc",
+         "hf_agc_threshold", "hf_att"};
+
+    vector<tuning_change_t> changes;
+    auto dev = get_airspyhf_device(sn);
+    bool ok = true;
+
+    if (dev == NULL or not settings.IsMap())
+    {
+        result = dev ? "Expected a map of settings" : "Unable to find device";
+        return false;
+    }
+
+    sdrm::tuning_t before = begin_retune(sn);
+
+    for (auto &name : order)
+    {
+        if (settings[name])
+        {
+            bool status = false;
+
+            try
+            {
+                status = apply_setting(dev, name, settings[name], changes);
+                result[name] = status ? "AIRSPYHF_SUCCESS" : "AIRSPYHF_ERROR";
+            }
+            catch (YAML::Exception &e)
+            {
+                result[name] = "Bad value";
+            }
+
+            ok = ok and status;
+        }
+    }
+
+    update_tuning(sn, before, changes);
+
+    for (auto s : settings)
+    {
+        string name = s.first.as<string>();
+
+        if (find(order.begin(), order.end(), name) == order.end())
+        {
+            result[name] = "Unknown setting";
+            ok = false;
+        }
+    }
+
+    return ok;
+}
 
     // typedef struct {
     //     airspyhf_device_t* device;
@@ -602,8 +1254,8 @@ int rx_callback(airspyhf_transfer_t *transfer)
 {
     int rval{0};
 
-    AirspyComponent *airc = (AirspyComponent *)transfer->ctx;
-    airc->write_to_source(transfer);
+    device_stream_t *ds = (device_stream_t *)transfer->ctx;
+    ds->component->queue_transfer(ds, transfer);
 
     return rval;
 }
@@ -0,0 +1,602 @@
+/*******************************************************************
+ *  airspyhf_mock.cc - A stand-in for libairspyhf, for exercising the
+ *  pipeline without a radio attached.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+/*
+ * This implements the airspyhf_* API against simulated devices, and
+ * is built as libairspyhf_mock. Link sdrm against it instead of
+ * libairspyhf (cmake -DUSE_MOCK_AIRSPYHF=ON), or LD_PRELOAD it.
+ *
+ * Once started, each device runs a producer thread that calls the
+ * registered callback with a buffer of the size libairspyhf would
+ * deliver at the current samplerate, at the rate those buffers would
+ * arrive. Time is kept against absolute deadlines so the cadence does
+ * not drift. As with the real device, a callback that can't keep up
+ * costs samples: if the producer falls more than a buffer behind,
+ * the missed buffers are reported in `dropped_samples`. On stop, a
+ * summary of callback timing is written to stderr, giving the
+ * callback's headroom at that samplerate.
+ *
+ * The simulated signal is configured through the environment:
+ *
+ *   SDRM_MOCK_SERIALS       comma separated serial numbers (hex or
+ *                           decimal) of the devices to simulate.
+ *                           Default: one device, 0x3652d65d3abd8c3d.
+ *   SDRM_MOCK_TONE_HZ       tone offset from the center frequency, Hz.
+ *                           Default 10000.
+ *   SDRM_MOCK_TONE_AMPLITUDE  tone amplitude. Default 0.5.
+ *   SDRM_MOCK_NOISE         rms of the added gaussian noise. Default 0.01.
+ *   SDRM_MOCK_DROP_EVERY    if N > 0, every Nth buffer is withheld and
+ *                           reported as dropped samples. Default 0.
+ *   SDRM_MOCK_BUFFER_SIZE   override the samples per callback.
+ */
+
+#include <libairspyhf/airspyhf.h>
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    // Samplerates offered, with the number of samples libairspyhf
+    // delivers per callback at each.
+    struct rate_t
+    {
+        uint32_t samplerate;
+        int buffer_size;
+    };
+
+    const rate_t samplerates[] =
+    {
+        {912000, 2048},
+        {768000, 2048},
+        {456000, 1024},
+        {384000, 1024},
+        {256000, 512},
+        {192000, 512}
+    };
+
+    const size_t num_samplerates = sizeof(samplerates) / sizeof(rate_t);
+    const size_t NOISE_TABLE_SIZE = 1 << 16;
+
+    double env_double(const char *name, double dflt)
+    {
+        const char *v = getenv(name);
+        return v ? strtod(v, NULL) : dflt;
+    }
+
+    long env_long(const char *name, long dflt)
+    {
+        const char *v = getenv(name);
+        return v ? strtol(v, NULL, 0) : dflt;
+    }
+
+    vector<uint64_t> mock_serials()
+    {
+        vector<uint64_t> serials;
+        const char *v = getenv("SDRM_MOCK_SERIALS");
+
+        if (v == NULL)
+        {
+            serials.push_back(0x3652d65d3abd8c3dULL);
+            return serials;
+        }
+
+        stringstream ss(v);
+        string item;
+
+        while (getline(ss, item, ','))
+        {
+            serials.push_back(strtoull(item.c_str(), NULL, 0));
+        }
+
+        return serials;
+    }
+
+    mutex open_mutex;
+    map<uint64_t, airspyhf_device_t *> open_devices;
+}
+
+/**
+ * \struct airspyhf_device
+ *
+ * The simulated device. Opaque to users, as with libairspyhf.
+ *
+ */
+
+struct airspyhf_device
+{
+    airspyhf_device(uint64_t sn);
+
+    void producer();
+
+    uint64_t serial;
+    uint32_t samplerate{768000};
+    uint32_t freq_hz{10000000};
+    int32_t calibration{0};
+    uint8_t lib_dsp{1};
+    uint8_t hf_agc{1};
+    uint8_t hf_agc_threshold{0};
+    uint8_t hf_att{0};
+    uint8_t hf_lna{0};
+
+    airspyhf_sample_block_cb_fn callback{NULL};
+    void *ctx{NULL};
+    atomic<bool> streaming{false};
+    thread producer_thread;
+
+    // signal generator state
+    double tone_hz;
+    float tone_amplitude;
+    long drop_every;
+    long buffer_size_override;
+    vector<airspyhf_complex_float_t> noise;
+};
+
+airspyhf_device::airspyhf_device(uint64_t sn)
+    : serial(sn),
+      tone_hz(env_double("SDRM_MOCK_TONE_HZ", 10000.0)),
+      tone_amplitude(env_double("SDRM_MOCK_TONE_AMPLITUDE", 0.5)),
+      drop_every(env_long("SDRM_MOCK_DROP_EVERY", 0)),
+      buffer_size_override(env_long("SDRM_MOCK_BUFFER_SIZE", 0)),
+      noise(NOISE_TABLE_SIZE)
+{
+    // Gaussian noise is expensive to generate at these rates, and the
+    // point is to measure the consumer, not the mock. Generate a table
+    // once and play it back from random offsets.
+    mt19937 gen(sn);
+    normal_distribution<float> dist(0.0, env_double("SDRM_MOCK_NOISE", 0.01));
+
+    for (auto &n : noise)
+    {
+        n.re = dist(gen);
+        n.im = dist(gen);
+    }
+}
+
+/**
+ * The device's streaming thread. Fills a buffer and hands it to the
+ * callback once per buffer period, until stopped or until the callback
+ * returns non-zero (which also stops the real library).
+ *
+ */
+
+void airspyhf_device::producer()
+{
+    using clock = chrono::steady_clock;
+
+    // So that per-thread CPU use (e.g. sdrm_bench) can be attributed.
+    pthread_setname_np(pthread_self(), "airspyhf_mock");
+
+    uint32_t rate = samplerate;
+    int n = 2048;
+
+    for (size_t i = 0; i < num_samplerates; ++i)
+    {
+        if (samplerates[i].samplerate == rate)
+        {
+            n = samplerates[i].buffer_size;
+        }
+    }
+
+    if (buffer_size_override > 0)
+    {
+        n = buffer_size_override;
+    }
+
+    vector<airspyhf_complex_float_t> samples(n);
+    auto period = chrono::duration_cast<clock::duration>(
+        chrono::duration<double>((double)n / rate));
+
+    // The tone is a rotating phasor, renormalized every buffer so
+    // rounding doesn't change its amplitude.
+    double w = 2.0 * M_PI * tone_hz / rate;
+    float rot_re = cos(w), rot_im = sin(w);
+    float ph_re = 1.0, ph_im = 0.0;
+
+    mt19937 gen(serial ^ 0x5a5a5a5a);
+    uniform_int_distribution<size_t> offset(0, NOISE_TABLE_SIZE - 1);
+
+    uint64_t dropped = 0;
+    uint64_t transfers = 0;
+    uint64_t delivered = 0;
+    uint64_t late = 0;
+    double busy = 0.0, max_busy = 0.0;
+    auto deadline = clock::now() + period;
+
+    while (streaming.load())
+    {
+        this_thread::sleep_until(deadline);
+
+        // Buffers we were too late for are lost, as they would be in
+        // the device's FIFO.
+        auto now = clock::now();
+
+        if (now - deadline > period)
+        {
+            long missed = (now - deadline) / period;
+            dropped += missed * n;
+            deadline += missed * period;
+            ++late;
+        }
+
+        deadline += period;
+
+        size_t k = offset(gen);
+
+        for (int i = 0; i < n; ++i)
+        {
+            const auto &z = noise[(k + i) & (NOISE_TABLE_SIZE - 1)];
+            samples[i].re = tone_amplitude * ph_re + z.re;
+            samples[i].im = tone_amplitude * ph_im + z.im;
+            float re = ph_re * rot_re - ph_im * rot_im;
+            ph_im = ph_re * rot_im + ph_im * rot_re;
+            ph_re = re;
+        }
+
+        float mag = sqrt(ph_re * ph_re + ph_im * ph_im);
+        ph_re /= mag;
+        ph_im /= mag;
+
+        if (drop_every > 0 && (++transfers % drop_every) == 0)
+        {
+            dropped += n;
+            continue;
+        }
+
+        airspyhf_transfer_t transfer;
+        transfer.device = this;
+        transfer.ctx = ctx;
+        transfer.samples = samples.data();
+        transfer.sample_count = n;
+        transfer.dropped_samples = dropped;
+
+        auto t0 = clock::now();
+        int rval = callback(&transfer);
+        double dt = chrono::duration<double>(clock::now() - t0).count();
+        busy += dt;
+        max_busy = max(max_busy, dt);
+        ++delivered;
+
+        if (rval != 0)
+        {
+            streaming = false;
+        }
+    }
+
+    double p = chrono::duration<double>(period).count();
+    fprintf(stderr, "airspyhf_mock %016llx: %u S/s, %d samples/buffer, "
+            "%llu callbacks, %llu late wakeups, %llu samples dropped, "
+            "callback mean %.1f%% max %.1f%% of the %.3f ms period\n",
+            (unsigned long long)serial, rate, n,
+            (unsigned long long)delivered, (unsigned long long)late,
+            (unsigned long long)dropped,
+            delivered ? 100.0 * busy / delivered / p : 0.0,
+            100.0 * max_busy / p, 1000.0 * p);
+}
+
+extern "C"
+{
+
+void airspyhf_lib_version(airspyhf_lib_version_t *lib_version)
+{
+    lib_version->major_version = AIRSPYHF_VER_MAJOR;
+    lib_version->minor_version = AIRSPYHF_VER_MINOR;
+    lib_version->revision = AIRSPYHF_VER_REVISION;
+}
+
+int airspyhf_list_devices(uint64_t *serials, int count)
+{
+    auto sns = mock_serials();
+
+    if (serials == NULL || count == 0)
+    {
+        return sns.size();
+    }
+
+    int n = min((size_t)count, sns.size());
+
+    for (int i = 0; i < n; ++i)
+    {
+        serials[i] = sns[i];
+    }
+
+    return n;
+}
+
+int airspyhf_open_sn(airspyhf_device_t **device, uint64_t serial_number)
+{
+    lock_guard<mutex> l(open_mutex);
+
+    for (auto sn : mock_serials())
+    {
+        if (sn == serial_number && open_devices.find(sn) == open_devices.end())
+        {
+            *device = new airspyhf_device(sn);
+            open_devices[sn] = *device;
+            return AIRSPYHF_SUCCESS;
+        }
+    }
+
+    return AIRSPYHF_ERROR;
+}
+
+int airspyhf_open(airspyhf_device_t **device)
+{
+    for (auto sn : mock_serials())
+    {
+        if (airspyhf_open_sn(device, sn) == AIRSPYHF_SUCCESS)
+        {
+            return AIRSPYHF_SUCCESS;
+        }
+    }
+
+    return AIRSPYHF_ERROR;
+}
+
+int airspyhf_open_fd(airspyhf_device_t **, int)
+{
+    return AIRSPYHF_ERROR;
+}
+
+int airspyhf_stop(airspyhf_device_t *device)
+{
+    device->streaming = false;
+
+    if (device->producer_thread.joinable())
+    {
+        device->producer_thread.join();
+    }
+
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_close(airspyhf_device_t *device)
+{
+    airspyhf_stop(device);
+    lock_guard<mutex> l(open_mutex);
+    open_devices.erase(device->serial);
+    delete device;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_get_output_size(airspyhf_device_t *device)
+{
+    if (device->buffer_size_override > 0)
+    {
+        return device->buffer_size_override;
+    }
+
+    for (size_t i = 0; i < num_samplerates; ++i)
+    {
+        if (samplerates[i].samplerate == device->samplerate)
+        {
+            return samplerates[i].buffer_size;
+        }
+    }
+
+    return 2048;
+}
+
+int airspyhf_start(airspyhf_device_t *device,
+                   airspyhf_sample_block_cb_fn callback, void *ctx)
+{
+    if (device->streaming.load() || callback == NULL)
+    {
+        return AIRSPYHF_ERROR;
+    }
+
+    if (device->producer_thread.joinable())
+    {
+        // stopped itself via the callback's return value.
+        device->producer_thread.join();
+    }
+
+    device->callback = callback;
+    device->ctx = ctx;
+    device->streaming = true;
+    device->producer_thread = thread(&airspyhf_device::producer, device);
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_is_streaming(airspyhf_device_t *device)
+{
+    return device->streaming.load() ? 1 : 0;
+}
+
+int airspyhf_is_low_if(airspyhf_device_t *)
+{
+    return 0;
+}
+
+int airspyhf_set_freq(airspyhf_device_t *device, const uint32_t freq_hz)
+{
+    device->freq_hz = freq_hz;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_freq_double(airspyhf_device_t *device, const double freq_hz)
+{
+    device->freq_hz = (uint32_t)freq_hz;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_lib_dsp(airspyhf_device_t *device, const uint8_t flag)
+{
+    device->lib_dsp = flag;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_get_samplerates(airspyhf_device_t *, uint32_t *buffer,
+                             const uint32_t len)
+{
+    if (len == 0)
+    {
+        *buffer = num_samplerates;
+        return AIRSPYHF_SUCCESS;
+    }
+
+    if (len < num_samplerates)
+    {
+        return AIRSPYHF_ERROR;
+    }
+
+    for (size_t i = 0; i < num_samplerates; ++i)
+    {
+        buffer[i] = samplerates[i].samplerate;
+    }
+
+    return AIRSPYHF_SUCCESS;
+}
+
+/**
+ * As with the real library, the samplerate may be given either as a
+ * rate or as an index into the list from airspyhf_get_samplerates(). A
+ * change takes effect at the next airspyhf_start().
+ *
+ */
+
+int airspyhf_set_samplerate(airspyhf_device_t *device, uint32_t samplerate)
+{
+    if (samplerate < num_samplerates)
+    {
+        samplerate = samplerates[samplerate].samplerate;
+    }
+
+    for (size_t i = 0; i < num_samplerates; ++i)
+    {
+        if (samplerates[i].samplerate == samplerate)
+        {
+            device->samplerate = samplerate;
+            return AIRSPYHF_SUCCESS;
+        }
+    }
+
+    return AIRSPYHF_ERROR;
+}
+
+int airspyhf_get_calibration(airspyhf_device_t *device, int32_t *ppb)
+{
+    *ppb = device->calibration;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_calibration(airspyhf_device_t *device, int32_t ppb)
+{
+    device->calibration = ppb;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_get_vctcxo_calibration(airspyhf_device_t *, uint16_t *vc)
+{
+    *vc = 0;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_vctcxo_calibration(airspyhf_device_t *, uint16_t)
+{
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_optimal_iq_correction_point(airspyhf_device_t *, float)
+{
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_iq_balancer_configure(airspyhf_device_t *, int, int, int, int)
+{
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_flash_configuration(airspyhf_device_t *device)
+{
+    return device->streaming.load() ? AIRSPYHF_ERROR : AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_flash_calibration(airspyhf_device_t *device)
+{
+    return device->streaming.load() ? AIRSPYHF_ERROR : AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_board_partid_serialno_read(
+    airspyhf_device_t *device,
+    airspyhf_read_partid_serialno_t *read_partid_serialno)
+{
+    read_partid_serialno->part_id = 0;
+    read_partid_serialno->serial_no[0] = 0;
+    read_partid_serialno->serial_no[1] = 0;
+    read_partid_serialno->serial_no[2] = device->serial >> 32;
+    read_partid_serialno->serial_no[3] = device->serial & 0xffffffff;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_version_string_read(airspyhf_device_t *, char *version,
+                                 uint8_t length)
+{
+    snprintf(version, length, "sdrm airspyhf_mock");
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_user_output(airspyhf_device_t *, airspyhf_user_output_t,
+                             airspyhf_user_output_state_t)
+{
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_hf_agc(airspyhf_device_t *device, uint8_t flag)
+{
+    device->hf_agc = flag;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_hf_agc_threshold(airspyhf_device_t *device, uint8_t flag)
+{
+    device->hf_agc_threshold = flag;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_hf_att(airspyhf_device_t *device, uint8_t value)
+{
+    device->hf_att = value;
+    return AIRSPYHF_SUCCESS;
+}
+
+int airspyhf_set_hf_lna(airspyhf_device_t *device, uint8_t flag)
+{
+    device->hf_lna = flag;
+    return AIRSPYHF_SUCCESS;
+}
+
+}
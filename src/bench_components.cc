@@ -0,0 +1,378 @@
+/*******************************************************************
+ *  bench_components.cc - The synthetic source and measuring sink used
+ *  by sdrm_bench.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "bench_components.h"
+#include "sdrm_config.h"
+#include "matrix/log_t.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+using namespace matrix;
+
+static matrix::log_t logger("bench_components");
+
+namespace bench
+{
+    // Send times of recent frames, indexed by sequence number. The
+    // source and sink are in the same process, so this is how the sink
+    // learns when a frame it receives was sent.
+    const size_t STAMP_TABLE_SIZE = 1 << 16;
+
+    struct stamp_t
+    {
+        atomic<uint64_t> sequence;
+        atomic<uint64_t> t;
+    };
+
+    static stamp_t stamps[STAMP_TABLE_SIZE];
+
+    uint64_t now_ns()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void stamp_sent(uint64_t sequence)
+    {
+        auto &s = stamps[sequence & (STAMP_TABLE_SIZE - 1)];
+        s.t.store(now_ns(), memory_order_relaxed);
+        s.sequence.store(sequence + 1, memory_order_release);
+    }
+
+    /**
+     * Looks up when frame `sequence` was sent.
+     *
+     * @param sequence: The frame's sequence number.
+     *
+     * @param t: Receives the send time, in steady_clock nanoseconds.
+     *
+     * @return false if the entry has been overwritten by a later
+     * frame, as happens when the sink falls far behind.
+     *
+     */
+
+    bool sent_at(uint64_t sequence, uint64_t &t)
+    {
+        auto &s = stamps[sequence & (STAMP_TABLE_SIZE - 1)];
+
+        if (s.sequence.load(memory_order_acquire) != sequence + 1)
+        {
+            return false;
+        }
+
+        t = s.t.load(memory_order_relaxed);
+        return s.sequence.load(memory_order_acquire) == sequence + 1;
+    }
+}
+
+Component *BenchSourceComponent::factory(std::string name, std::string km_url)
+{
+    return new BenchSourceComponent(name, km_url);
+}
+
+BenchSourceComponent::BenchSourceComponent(std::string name,
+                                           std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &BenchSourceComponent::sending_task),
+    iq_signal_source(keymaster_url, name, "iq_data")
+{
+}
+
+BenchSourceComponent::~BenchSourceComponent()
+{
+}
+
+bool BenchSourceComponent::_do_start()
+{
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("BenchSource _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (!rval)
+    {
+        logger.error(__PRETTY_FUNCTION__, "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+    }
+
+    return rval;
+}
+
+bool BenchSourceComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    return true;
+}
+
+/**
+ * Publishes frames until stopped. When `paced`, frames go out on
+ * absolute deadlines at `samplerate`, like a radio; otherwise as fast
+ * as publish() returns.
+ *
+ */
+
+void BenchSourceComponent::sending_task()
+{
+    using clock = chrono::steady_clock;
+
+    auto samplerate = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".samplerate", 768000.0);
+    auto buffer_size = sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".buffer_size", 2048);
+    auto paced = sdrm::get_config<bool>(
+        keymaster, my_full_instance_name + ".paced", true);
+    auto tone_hz = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".tone_hz", 10000.0);
+    auto wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".wire_format", "raw"));
+    auto sample_format = sdrm::sample_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".sample_format", "cf32"));
+
+    vector<sdrm::complex_float_t> samples(buffer_size);
+
+    for (size_t i = 0; i < buffer_size; ++i)
+    {
+        double ph = 2.0 * M_PI * tone_hz * i / samplerate;
+        samples[i].re = 0.5 * cos(ph);
+        samples[i].im = 0.5 * sin(ph);
+    }
+
+    msgpack::sbuffer outbuf;
+    auto period = chrono::duration_cast<clock::duration>(
+        chrono::duration<double>(buffer_size / samplerate));
+    auto deadline = clock::now();
+    uint64_t sequence = 0;
+    // Sample clock, anchored like a real source's.
+    uint64_t anchor = Time::getUTC();
+
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    while (_run.load())
+    {
+        if (paced)
+        {
+            deadline += period;
+            this_thread::sleep_until(deadline);
+        }
+
+        uint64_t index = sequence * buffer_size;
+        sdrm::pack_iq_frame(outbuf, wire_format, sequence, 0,
+                            samples.data(), samples.size(), 1, index,
+                            sdrm::sample_timestamp(anchor, index,
+                                                   (uint32_t)samplerate),
+                            sample_format);
+        bench::stamp_sent(sequence);
+        iq_signal_source.publish(outbuf);
+        ++sequence;
+    }
+}
+
+Component *BenchSinkComponent::factory(std::string name, std::string km_url)
+{
+    return new BenchSinkComponent(name, km_url);
+}
+
+BenchSinkComponent::BenchSinkComponent(std::string name,
+                                       std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &BenchSinkComponent::receiving_task)
+{
+}
+
+BenchSinkComponent::~BenchSinkComponent()
+{
+}
+
+bool BenchSinkComponent::_do_start()
+{
+    connect();
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("BenchSink _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (!rval)
+    {
+        logger.error(__PRETTY_FUNCTION__, "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        disconnect();
+    }
+
+    return rval;
+}
+
+bool BenchSinkComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    disconnect();
+    report();
+    return true;
+}
+
+bool BenchSinkComponent::connect()
+{
+    input_signal_sink.reset(
+        new matrix::DataSink<std::string,
+                             matrix::select_only>(keymaster_url, 10));
+    connect_sink(*input_signal_sink, "input_data");
+    return true;
+}
+
+bool BenchSinkComponent::disconnect()
+{
+    input_signal_sink->disconnect();
+    input_signal_sink.reset();
+    return true;
+}
+
+/**
+ * Writes the measurements to "BENCH.<name>".
+ *
+ */
+
+void BenchSinkComponent::report()
+{
+    YAML::Node results;
+    double elapsed = (_last_arrival - _first_arrival) * 1e-9;
+
+    results["messages"] = _messages;
+    results["samples"] = _samples;
+    results["elapsed_s"] = elapsed;
+    results["samples_per_s"] = elapsed > 0.0 ? _samples / elapsed : 0.0;
+    results["lost_buffers"] = _lost_buffers;
+    results["dropped_samples"] = _last_dropped - _first_dropped;
+
+    if (not _latencies.empty())
+    {
+        auto percentile =
+            [this](double p) -> double
+            {
+                size_t k = min(_latencies.size() - 1,
+                               (size_t)(p * _latencies.size()));
+                nth_element(_latencies.begin(), _latencies.begin() + k,
+                            _latencies.end());
+                return _latencies[k] * 1e-3;
+            };
+
+        results["latency_us"]["p50"] = percentile(0.50);
+        results["latency_us"]["p90"] = percentile(0.90);
+        results["latency_us"]["p99"] = percentile(0.99);
+        results["latency_us"]["p999"] = percentile(0.999);
+        results["latency_us"]["max"] =
+            *max_element(_latencies.begin(), _latencies.end()) * 1e-3;
+    }
+
+    keymaster->put("BENCH." + my_instance_name, results, true);
+}
+
+void BenchSinkComponent::receiving_task()
+{
+    // Latencies are kept for percentiles. Reserve enough for a long
+    // run so recording them doesn't allocate; beyond that they're
+    // dropped rather than grown.
+    const size_t max_latencies = 1 << 22;
+    sdrm::iq_frame_reader reader;
+    uint64_t expected = 0;
+
+    _messages = 0;
+    _samples = 0;
+    _lost_buffers = 0;
+    _first_dropped = 0;
+    _last_dropped = 0;
+    _first_arrival = 0;
+    _last_arrival = 0;
+    _latencies.clear();
+    _latencies.reserve(max_latencies);
+
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    while (_run.load())
+    {
+        string inbuf;
+
+        if (not input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
+        {
+            continue;
+        }
+
+        uint64_t now = bench::now_ns();
+
+        if (not reader.parse(inbuf))
+        {
+            continue;
+        }
+
+        if (_messages == 0)
+        {
+            _first_arrival = now;
+            _first_dropped = reader.dropped_samples();
+        }
+        else if (reader.sequence() > expected)
+        {
+            _lost_buffers += reader.sequence() - expected;
+        }
+
+        uint64_t sent;
+
+        if (bench::sent_at(reader.sequence(), sent)
+            && _latencies.size() < max_latencies)
+        {
+            _latencies.push_back(now - sent);
+        }
+
+        expected = reader.sequence() + reader.frame_count();
+        _last_dropped = reader.dropped_samples();
+        _last_arrival = now;
+        _samples += reader.sample_count();
+        ++_messages;
+    }
+}
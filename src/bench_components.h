@@ -0,0 +1,122 @@
+/*******************************************************************
+ *  bench_components.h - Components used by sdrm_bench: a synthetic
+ *  IQ source, and a sink that measures what arrives.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_BENCH_COMPONENTS_H_)
+#define _BENCH_COMPONENTS_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace bench
+{
+    uint64_t now_ns();
+    void stamp_sent(uint64_t sequence);
+    bool sent_at(uint64_t sequence, uint64_t &t);
+}
+
+/**
+ * \class BenchSourceComponent
+ *
+ * Publishes a tone as IQ frames, either paced to a samplerate as a
+ * radio would deliver them, or as fast as the pipeline will take
+ * them. The send time of each frame is recorded by sequence number
+ * for BenchSinkComponent to compute end-to-end latency.
+ *
+ */
+
+class BenchSourceComponent : public matrix::Component
+{
+public:
+
+    virtual ~BenchSourceComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    BenchSourceComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<BenchSourceComponent> _run_thread;
+    matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+
+    void sending_task();
+};
+
+/**
+ * \class BenchSinkComponent
+ *
+ * Consumes IQ messages (from a source or from a processing stage that
+ * carries the sequence number through) and measures throughput,
+ * lost buffers and end-to-end latency. The results are written to the
+ * Keymaster under "BENCH.<name>" when the component is stopped.
+ *
+ */
+
+class BenchSinkComponent : public matrix::Component
+{
+public:
+
+    virtual ~BenchSinkComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    BenchSinkComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool connect();
+    bool disconnect();
+    void report();
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<BenchSinkComponent> _run_thread;
+    std::unique_ptr<matrix::DataSink<std::string,
+                                     matrix::select_only>> input_signal_sink;
+
+    uint64_t _messages;
+    uint64_t _samples;
+    uint64_t _lost_buffers;
+    uint64_t _first_dropped;
+    uint64_t _last_dropped;
+    uint64_t _first_arrival;
+    uint64_t _last_arrival;
+    std::vector<uint64_t> _latencies;
+
+    void receiving_task();
+};
+
+#endif
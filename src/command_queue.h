@@ -0,0 +1,139 @@
+/*******************************************************************
+ *  command_queue.h - A worker thread that runs jobs one at a time,
+ *  in the order given.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_COMMAND_QUEUE_H_)
+#define _COMMAND_QUEUE_H_
+
+#include "matrix/Thread.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace sdrm
+{
+    /**
+     * \class command_queue
+     *
+     * A thread of its own that runs the jobs pushed to it, one at a
+     * time and in order. Commands for one device go through one
+     * queue, so they keep their order, while a slow command waits
+     * only for its own device's queue.
+     *
+     * push() may be called from any thread.
+     *
+     */
+
+    class command_queue
+    {
+    public:
+        typedef std::function<void ()> job_t;
+
+        command_queue(std::string name)
+            : _stop(false),
+              _thread(this, &command_queue::worker)
+        {
+            _thread.start(name);
+        }
+
+        /**
+         * Stops the worker once the job in progress, if any, is done.
+         * Jobs still queued are abandoned.
+         *
+         */
+
+        ~command_queue()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _stop = true;
+            }
+
+            _cv.notify_one();
+            _thread.join();
+        }
+
+        /**
+         * Queues a job.
+         *
+         * @param job: The job.
+         *
+         */
+
+        void push(job_t job)
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _jobs.push_back(std::move(job));
+            }
+
+            _cv.notify_one();
+        }
+
+        /**
+         * @return The number of jobs waiting, not counting the one in
+         * progress.
+         *
+         */
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _jobs.size();
+        }
+
+    private:
+        void worker()
+        {
+            while (true)
+            {
+                job_t job;
+
+                {
+                    std::unique_lock<std::mutex> l(_mutex);
+                    _cv.wait(l, [this] {return _stop or not _jobs.empty();});
+
+                    if (_stop)
+                    {
+                        return;
+                    }
+
+                    job = std::move(_jobs.front());
+                    _jobs.pop_front();
+                }
+
+                job();
+            }
+        }
+
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::deque<job_t> _jobs;
+        bool _stop;
+        matrix::Thread<command_queue> _thread;
+    };
+}
+
+#endif
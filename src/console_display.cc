@@ -21,8 +21,13 @@
  *******************************************************************/
 
 #include "simple_msgpk_client.h"
+#include "iq_frame.h"
+#include "simd_kernels.h"
+#include "sdrm_config.h"
+#include "trace.h"
 #include "matrix/log_t.h"
 #include <memory>
+#include <algorithm>
 #include <matrix/matrix_util.h>
 
 using namespace std;
@@ -47,8 +52,18 @@ MsgpackComponent::MsgpackComponent(std::string name, std::string keymaster_url)
     Component(name, keymaster_url),
     _run(false),
     _run_thread_started(false),
-    _run_thread(this, &MsgpackComponent::receiving_task)
+    _run_thread(this, &MsgpackComponent::receiving_task),
+    _stat_received(_stats.counter("received")),
+    _stat_lost(_stats.counter("lost_messages")),
+    _stat_malformed(_stats.counter("malformed")),
+    _stat_queue(_stats.gauge("input_queue")),
+    _stat_input_age(_stats.histogram("input_age")),
+    _stat_display_time(_stats.histogram("display_time")),
+    _input_sequence(_stat_lost)
 {
+    _stats_interval = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".stats_interval_ms", 1000.0)
+        * 1000000;
 }
 
 MsgpackComponent::~MsgpackComponent()
@@ -117,33 +132,124 @@ bool MsgpackComponent::disconnect()
     return true;
 }
 
+/**
+ * Writes the component's statistics to "STATS.<name>":
+ *
+ *   received:       messages received
+ *   lost_messages:  messages missing from the input's sequence
+ *   malformed:      messages that couldn't be decoded
+ *   input_queue:    messages waiting in the input sink
+ *   input_age:      age of a message's first sample on receipt
+ *   display_time:   time to summarize and print a message
+ *
+ * How often is set by
+ *
+ *   stats_interval_ms: 1000   # 0 turns reporting off
+ *
+ */
+
+void MsgpackComponent::report_stats()
+{
+    _stat_queue.set(input_signal_sink->items_in_queue());
+
+    YAML::Node stats;
+    _stats.report(stats);
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
 
 void MsgpackComponent::receiving_task()
 {
     logger.info(__PRETTY_FUNCTION__, "running");
     _run_thread_started.signal(true);
+    _input_sequence.reset();
+
+    sdrm::iq_frame_reader reader;
+    vector<float> power;
 
     while (_run.load())
     {
+        if (_stats.due(_stats_interval))
+        {
+            report_stats();
+        }
+
         // wait for a data bufferstring scan_status
         string inbuf;
+        bool received;
+
+        {
+            sdrm::trace_span span("console.wait");
+            received = input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC);
+        }
 
-        if (input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
+        if (received)
         {
-            msgpack::object_handle oh = msgpack::unpack(inbuf.data(), inbuf.size());
-            msgpack::object obj = oh.get();
-            sdrm::iq_data_t iq_data;
-            obj.convert(iq_data);
+            sdrm::trace_span span("console.display");
 
-            cout << "sample_count: " << iq_data.sample_count << "; ";
-            cout << "dropped_samples: " << iq_data.dropped_samples << "; ";
+            if (not reader.parse(inbuf))
+            {
+                logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+                _stat_malformed.add();
+                continue;
+            }
+
+            span.set_id(reader.sequence());
+
+            uint64_t start = sdrm::stats_now();
+            _stat_received.add();
+            _input_sequence.received(reader.sequence(), reader.frame_count());
+
+            if (reader.timestamp() != 0)
+            {
+                int64_t age = Time::getUTC() - reader.timestamp();
+                _stat_input_age.record(age > 0 ? age : 0);
+            }
+
+            cout << "sequence: " << reader.sequence() << "; ";
+            cout << "sample_count: " << reader.sample_count() << "; ";
+            cout << "dropped_samples: " << reader.dropped_samples() << "; ";
+            cout << "sample_index: " << reader.sample_index() << "; ";
+            cout << "timestamp: " << reader.timestamp() << "; ";
+
+            // The strongest sample (or bin, for spectra), in dB. Power
+            // spectra are shown as received.
+            if (reader.sample_count() > 0)
+            {
+                const float *p = reader.values();
+
+                if (reader.sample_format() == sdrm::SAMPLE_CF32)
+                {
+                    power.resize(reader.sample_count());
+                    sdrm::magnitude_squared(reader.samples(), power.data(),
+                                            power.size());
+                    p = power.data();
+                }
+
+                size_t peak = max_element(p, p + reader.sample_count()) - p;
+                float peak_value = p[peak];
+
+                if (reader.sample_format() == sdrm::SAMPLE_CF32)
+                {
+                    sdrm::power_to_db(&peak_value, &peak_value, 1);
+                }
+
+                cout << "peak: " << peak_value << " @ " << peak << "; ";
+            }
 
-            for (size_t i = 0; i < 3; ++i)
+            for (size_t i = 0; i < 3 && i < reader.sample_count(); ++i)
             {
-                cout << iq_data.samples[i] << ",";
+                if (reader.sample_format() == sdrm::SAMPLE_F32)
+                {
+                    cout << reader.values()[i] << ",";
+                }
+                else
+                {
+                    cout << reader.samples()[i] << ",";
+                }
             }
 
             cout << " ..." << endl;
+            _stat_display_time.record(sdrm::stats_now() - start);
         }
     }
 }
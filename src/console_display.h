@@ -23,6 +23,7 @@
 #define _SIMPLE_MSGPK_CLIENT_H_
 
 #include "sdrm_types.h"
+#include "stats.h"
 
 #include "matrix/Thread.h"
 #include "matrix/Component.h"
@@ -55,6 +56,18 @@ protected:
     matrix::Thread<MsgpackComponent> _run_thread;
     std::unique_ptr< matrix::DataSink<std::string, matrix::select_only> > input_signal_sink;
 
+    // Telemetry, reported to "STATS.<name>"; see report_stats().
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_received;
+    sdrm::stats_counter &_stat_lost;
+    sdrm::stats_counter &_stat_malformed;
+    sdrm::stats_gauge &_stat_queue;
+    sdrm::stats_histogram &_stat_input_age;
+    sdrm::stats_histogram &_stat_display_time;
+    sdrm::stats_sequence _input_sequence;
+    uint64_t _stats_interval;
+
+    void report_stats();
     void receiving_task();
 
 };
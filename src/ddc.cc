@@ -0,0 +1,363 @@
+/*******************************************************************
+ *  ddc.cc - Digital down-converter: NCO, mixer and decimators.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "ddc.h"
+#include "pfb_channelizer.h"
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+
+using namespace std;
+
+namespace sdrm
+{
+    // The table NCO's sine table: 2^14 entries, giving spurs below
+    // about -84 dBc.
+    static const unsigned NCO_TABLE_BITS = 14;
+    static const size_t NCO_TABLE_SIZE = 1 << NCO_TABLE_BITS;
+
+    // CIC stages, and taps of each half-band filter (4k + 3, so that
+    // the taps at even offsets from the center are zero).
+    static const size_t CIC_ORDER = 4;
+    static const size_t HALFBAND_TAPS = 31;
+    static const size_t MAX_HALFBANDS = 3;
+
+    static const vector<complex_float_t> &nco_table()
+    {
+        static const vector<complex_float_t> table = []()
+        {
+            vector<complex_float_t> t(NCO_TABLE_SIZE);
+
+            for (size_t i = 0; i < NCO_TABLE_SIZE; ++i)
+            {
+                double a = 2.0 * M_PI * i / NCO_TABLE_SIZE;
+                t[i].re = cos(a);
+                t[i].im = sin(a);
+            }
+
+            return t;
+        }();
+
+        return table;
+    }
+
+    /**
+     * Converts an NCO mode name, "table" or "recursive", to its
+     * nco_mode_t.
+     *
+     * @param s: The name.
+     *
+     * @return The mode. Throws std::invalid_argument for an unknown
+     * name.
+     *
+     */
+
+    nco_mode_t nco_mode_from_string(string s)
+    {
+        if (s == "table")
+        {
+            return NCO_TABLE;
+        }
+
+        if (s == "recursive")
+        {
+            return NCO_RECURSIVE;
+        }
+
+        throw invalid_argument("unknown NCO mode '" + s + "'");
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param frequency: In cycles per sample, -0.5 to 0.5.
+     *
+     * @param mode: NCO_TABLE looks the phase up in a sine table;
+     * NCO_RECURSIVE rotates a phasor by the phase step each sample,
+     * which is exact to float precision and has no spurs, but costs a
+     * complex multiply per sample.
+     *
+     */
+
+    nco::nco(double frequency, nco_mode_t mode)
+        : _mode(mode),
+          _phase(0)
+    {
+        // The step as a fraction of 2^32, negative frequencies
+        // wrapping around.
+        double cycles = frequency - floor(frequency);
+        _step = (uint32_t)llround(cycles * 4294967296.0);
+    }
+
+    /**
+     * Generates the next `n` samples of the oscillator.
+     *
+     * @param out: Receives the samples.
+     *
+     * @param n: The number of samples.
+     *
+     */
+
+    void nco::generate(complex_float_t *out, size_t n)
+    {
+        if (_mode == NCO_TABLE)
+        {
+            const complex_float_t *table = nco_table().data();
+            const unsigned shift = 32 - NCO_TABLE_BITS;
+            const uint32_t half = 1u << (shift - 1);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = table[((_phase + half) >> shift) & (NCO_TABLE_SIZE - 1)];
+                _phase += _step;
+            }
+
+            return;
+        }
+
+        // Recursive: start each buffer from the exact phase, so that
+        // rounding in the rotation never builds up beyond one buffer.
+        const double scale = 2.0 * M_PI / 4294967296.0;
+        complex<double> p = polar(1.0, _phase * scale);
+        complex<double> r = polar(1.0, _step * scale);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i].re = p.real();
+            out[i].im = p.imag();
+            p *= r;
+        }
+
+        _phase += (uint32_t)(_step * (uint64_t)n);
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param taps: The filter coefficients.
+     *
+     * @param factor: The decimation.
+     *
+     */
+
+    fir_decimator::fir_decimator(vector<float> taps, size_t factor)
+        : _taps(taps.rbegin(), taps.rend()),
+          _factor(factor)
+    {
+        if (_taps.empty() or factor == 0)
+        {
+            throw invalid_argument("fir_decimator: no taps, or zero decimation");
+        }
+
+        reset();
+    }
+
+    /**
+     * Clears the filter's history, as at the start of a stream.
+     *
+     */
+
+    void fir_decimator::reset()
+    {
+        _buf.assign(_taps.size() - 1, complex_float_t {0.0f, 0.0f});
+        _next = _taps.size() - 1;
+    }
+
+    /**
+     * Filters and decimates the next `n` samples of the stream.
+     *
+     * @param in: The samples.
+     *
+     * @param n: The number of samples.
+     *
+     * @param out: Receives the output; must have room for n / factor +
+     * 1 samples.
+     *
+     * @return The number of output samples.
+     *
+     */
+
+    size_t fir_decimator::process(const complex_float_t *in, size_t n,
+                                  complex_float_t *out)
+    {
+        size_t history = _taps.size() - 1;
+        size_t total = history + n;
+        size_t count = 0;
+
+        _buf.resize(total);
+        copy(in, in + n, _buf.begin() + history);
+
+        for (; _next < total; _next += _factor)
+        {
+            out[count++] = dot_product(&_buf[_next - history], _taps.data(),
+                                       _taps.size());
+        }
+
+        copy(_buf.end() - history, _buf.end(), _buf.begin());
+        _next -= n;
+        return count;
+    }
+
+    /**
+     * The impulse response of a CIC decimator of `order` stages and
+     * decimation `r`, scaled to unity gain at DC. Filtering with it
+     * directly gives the CIC's output without its integrators, which
+     * in floating point would lose precision as they grow.
+     *
+     */
+
+    static vector<float> cic_response(size_t r, size_t order)
+    {
+        vector<double> h(1, 1.0);
+
+        for (size_t s = 0; s < order; ++s)
+        {
+            vector<double> next(h.size() + r - 1, 0.0);
+
+            for (size_t i = 0; i < h.size(); ++i)
+            {
+                for (size_t k = 0; k < r; ++k)
+                {
+                    next[i + k] += h[i];
+                }
+            }
+
+            h.swap(next);
+        }
+
+        double gain = pow((double)r, (double)order);
+        vector<float> f(h.size());
+
+        for (size_t i = 0; i < h.size(); ++i)
+        {
+            f[i] = h[i] / gain;
+        }
+
+        return f;
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param frequency: The frequency brought to DC, in cycles per
+     * input sample (-0.5 to 0.5).
+     *
+     * @param decimation: The total decimation. Must be even. Powers of
+     * 2 of it, up to 8, after the final FIR's 2 go to half-band
+     * filters; the rest to the CIC.
+     *
+     * @param mode: The NCO mode.
+     *
+     * @param taps: Length of the final FIR filter.
+     *
+     * @param window: Window used to design the final FIR filter; see
+     * make_window().
+     *
+     */
+
+    ddc::ddc(double frequency, size_t decimation, nco_mode_t mode,
+             size_t taps, string window)
+        : _decimation(decimation),
+          _nco(-frequency, mode)
+    {
+        if (decimation < 2 or decimation % 2)
+        {
+            throw invalid_argument("DDC decimation must be even");
+        }
+
+        size_t d = decimation / 2;
+        size_t halfbands = 0;
+
+        while (d % 2 == 0 and halfbands < MAX_HALFBANDS)
+        {
+            d /= 2;
+            ++halfbands;
+        }
+
+        if (d > 1)
+        {
+            _stages.emplace_back(cic_response(d, CIC_ORDER), d);
+        }
+
+        for (size_t i = 0; i < halfbands; ++i)
+        {
+            _stages.emplace_back(design_lowpass(HALFBAND_TAPS, 0.25,
+                                                "blackman-harris"), 2);
+        }
+
+        _stages.emplace_back(design_lowpass(taps, 0.2, window), 2);
+        _work.resize(_stages.size());
+    }
+
+    /**
+     * Restarts the NCO and clears the filters, as at the start of a
+     * stream.
+     *
+     */
+
+    void ddc::reset()
+    {
+        _nco.reset();
+
+        for (auto &s : _stages)
+        {
+            s.reset();
+        }
+    }
+
+    /**
+     * Down-converts the next `n` samples of the stream.
+     *
+     * @param in: The samples.
+     *
+     * @param n: The number of samples.
+     *
+     * @param out: The output samples are appended to this.
+     *
+     * @return The number of output samples; about n / decimation, the
+     * filters carrying any remainder over to the next buffer.
+     *
+     */
+
+    size_t ddc::process(const complex_float_t *in, size_t n,
+                        vector<complex_float_t> &out)
+    {
+        _lo.resize(n);
+        _mixed.resize(n);
+        _nco.generate(_lo.data(), n);
+        complex_multiply(in, _lo.data(), _mixed.data(), n);
+
+        const complex_float_t *data = _mixed.data();
+
+        for (size_t i = 0; i < _stages.size(); ++i)
+        {
+            _work[i].resize(n / _stages[i].factor() + 1);
+            n = _stages[i].process(data, n, _work[i].data());
+            data = _work[i].data();
+        }
+
+        out.insert(out.end(), data, data + n);
+        return n;
+    }
+}
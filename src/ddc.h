@@ -0,0 +1,128 @@
+/*******************************************************************
+ *  ddc.h - Digital down-converter: NCO, mixer and decimators.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_DDC_H_)
+#define _DDC_H_
+
+#include "sdrm_types.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    enum nco_mode_t
+    {
+        NCO_TABLE,     // sine table lookup
+        NCO_RECURSIVE  // rotating phasor, resynchronized every buffer
+    };
+
+    nco_mode_t nco_mode_from_string(std::string s);
+
+    /**
+     * \class nco
+     *
+     * A numerically controlled oscillator, generating exp(j * 2 * pi *
+     * frequency * n). The phase is a 32 bit accumulator, so it is
+     * exact, and continuous from one call of generate() to the next.
+     *
+     */
+
+    class nco
+    {
+    public:
+        nco(double frequency, nco_mode_t mode = NCO_TABLE);
+
+        void generate(complex_float_t *out, size_t n);
+        void reset() {_phase = 0;}
+
+    private:
+        nco_mode_t _mode;
+        uint32_t _phase;
+        uint32_t _step;
+    };
+
+    /**
+     * \class fir_decimator
+     *
+     * An FIR filter computed only at the output samples kept: every
+     * `factor`th input. Keeps the last taps - 1 samples of each buffer,
+     * so the stream may be delivered in buffers of any size.
+     *
+     */
+
+    class fir_decimator
+    {
+    public:
+        fir_decimator(std::vector<float> taps, size_t factor);
+
+        size_t process(const complex_float_t *in, size_t n,
+                       complex_float_t *out);
+        void reset();
+
+        size_t factor() const {return _factor;}
+
+    private:
+        // Time reversed, to line up with the input (oldest first).
+        std::vector<float> _taps;
+        size_t _factor;
+        // The history, followed by the input being processed.
+        std::vector<complex_float_t> _buf;
+        // Index in _buf of the newest sample of the next output.
+        size_t _next;
+    };
+
+    /**
+     * \class ddc
+     *
+     * A digital down-converter: mixes the signal at `frequency` (in
+     * cycles per sample) down to DC, then decimates it by
+     * `decimation`, which must be even. The decimation is done by a
+     * CIC filter for the bulk of it, up to three half-band filters,
+     * and a final decimate-by-2 FIR which sets the output band: -6 dB
+     * at +/-0.4 times the output sample rate. The gain at DC is 1.
+     *
+     */
+
+    class ddc
+    {
+    public:
+        ddc(double frequency, size_t decimation, nco_mode_t mode = NCO_TABLE,
+            size_t taps = 64, std::string window = "blackman-harris");
+
+        size_t process(const complex_float_t *in, size_t n,
+                       std::vector<complex_float_t> &out);
+        void reset();
+
+        size_t decimation() const {return _decimation;}
+
+    private:
+        size_t _decimation;
+        nco _nco;
+        std::vector<fir_decimator> _stages;
+        std::vector<complex_float_t> _lo;
+        std::vector<complex_float_t> _mixed;
+        std::vector<std::vector<complex_float_t>> _work;
+    };
+}
+
+#endif
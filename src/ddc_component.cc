@@ -0,0 +1,289 @@
+/*******************************************************************
+ *  ddc_component.cc - Down-converts narrow bands of the incoming IQ
+ *  stream, and publishes them.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "ddc_component.h"
+#include "sdrm_config.h"
+#include "matrix/log_t.h"
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <matrix/matrix_util.h>
+
+using namespace std;
+using namespace matrix;
+using namespace mxutils;
+
+static matrix::log_t logger("DDCComponent");
+
+Component *DDCComponent::factory(std::string name, std::string km_url)
+{
+    return new DDCComponent(name, km_url);
+}
+
+DDCComponent::DDCComponent(std::string name, std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &DDCComponent::receiving_task),
+    iq_signal_source(keymaster_url, name, "iq_data"),
+    _input_rate(0.0)
+{
+    _wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".wire_format", "msgpack"));
+}
+
+DDCComponent::~DDCComponent()
+{
+}
+
+/**
+ * Reads the configuration, and creates a down-converter for each
+ * configured frequency at the configured samplerate, to be remade at
+ * the input's own samplerate if it says otherwise. Done on each
+ * start, so changes to the configuration take effect then.
+ *
+ * @return false if the configuration is invalid.
+ *
+ */
+
+bool DDCComponent::setup_ddcs()
+{
+    string base = my_full_instance_name + ".";
+    _sample_rate = sdrm::get_config<double>(keymaster, base + "sample_rate",
+                                            768000.0);
+    _frequencies = sdrm::get_config<vector<double>>(
+        keymaster, base + "frequencies", vector<double>(1, 0.0));
+    _decimation = sdrm::get_config<size_t>(keymaster, base + "decimation", 64);
+    _taps = sdrm::get_config<size_t>(keymaster, base + "taps", 64);
+    _window = sdrm::get_config<string>(keymaster, base + "window",
+                                       "blackman-harris");
+
+    _ddcs.clear();
+
+    if (_frequencies.empty() or _sample_rate <= 0.0)
+    {
+        logger.error(__PRETTY_FUNCTION__, "no frequencies, or bad sample_rate");
+        return false;
+    }
+
+    try
+    {
+        _nco_mode = sdrm::nco_mode_from_string(
+            sdrm::get_config<string>(keymaster, base + "nco", "table"));
+    }
+    catch (invalid_argument &e)
+    {
+        logger.error(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+
+    return make_ddcs(_sample_rate);
+}
+
+/**
+ * (Re)creates the down-converters, for input at `sample_rate`: the
+ * NCOs' frequencies, in cycles per sample, depend on it.
+ *
+ * @param sample_rate: The input's samplerate, Hz.
+ *
+ * @return false if the configuration is invalid.
+ *
+ */
+
+bool DDCComponent::make_ddcs(double sample_rate)
+{
+    _ddcs.clear();
+
+    try
+    {
+        for (auto f : _frequencies)
+        {
+            _ddcs.emplace_back(new sdrm::ddc(f / sample_rate, _decimation,
+                                             _nco_mode, _taps, _window));
+        }
+    }
+    catch (invalid_argument &e)
+    {
+        logger.error(__PRETTY_FUNCTION__, e.what());
+        _ddcs.clear();
+        return false;
+    }
+
+    _input_rate = sample_rate;
+    logger.info(__PRETTY_FUNCTION__, "bands =", _frequencies.size(),
+                "decimation =", _decimation, "input rate =", sample_rate,
+                "output rate =", sample_rate / _decimation);
+    return true;
+}
+
+bool DDCComponent::_do_start()
+{
+    if (not setup_ddcs())
+    {
+        return false;
+    }
+
+    connect();
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("DDC _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (rval)
+    {
+        logger.info(__PRETTY_FUNCTION__, "_run_thread started.");
+    }
+    else
+    {
+        logger.error(__PRETTY_FUNCTION__,
+                     "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        disconnect();
+    }
+
+    return rval;
+}
+
+bool DDCComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    disconnect();
+    return true;
+}
+
+bool DDCComponent::connect()
+{
+    input_signal_sink.reset(
+        new matrix::DataSink<std::string,
+                            matrix::select_only>(keymaster_url, 10));
+    connect_sink(*input_signal_sink, "input_data");
+    return true;
+}
+
+bool DDCComponent::disconnect()
+{
+    input_signal_sink->disconnect();
+    input_signal_sink.reset();
+    return true;
+}
+
+/**
+ * Down-converts each received buffer and publishes the result, with
+ * the input's sequence number, sample index and timestamp. The
+ * down-converters are remade whenever the input's samplerate
+ * changes; the configured one is used only for a source that doesn't
+ * say. If the source reports newly dropped samples, or has been
+ * retuned, the down-converters are restarted, so that no output
+ * mixes samples from either side of the gap or the retune.
+ *
+ */
+
+void DDCComponent::receiving_task()
+{
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    sdrm::iq_frame_reader reader;
+    uint64_t dropped = 0;
+    uint32_t epoch = 0;
+
+    while (_run.load())
+    {
+        string inbuf;
+
+        if (not input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
+        {
+            continue;
+        }
+
+        if (not reader.parse(inbuf) or reader.sample_format() != sdrm::SAMPLE_CF32)
+        {
+            logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+            continue;
+        }
+
+        double rate = reader.tuning().samplerate ? reader.tuning().samplerate
+            : _sample_rate;
+
+        if (rate != _input_rate)
+        {
+            make_ddcs(rate);
+        }
+        else if (reader.dropped_samples() != dropped
+                 or reader.tuning().epoch != epoch)
+        {
+            for (auto &d : _ddcs)
+            {
+                d->reset();
+            }
+        }
+
+        dropped = reader.dropped_samples();
+        epoch = reader.tuning().epoch;
+
+        if (_ddcs.empty())
+        {
+            continue;
+        }
+
+        // The bands all have the same decimation, and see the same
+        // input, so each produces the same number of samples.
+        size_t n = 0;
+        _channel_data.clear();
+
+        for (auto &d : _ddcs)
+        {
+            n = d->process(reader.samples(), reader.sample_count(),
+                           _channel_data);
+        }
+
+        if (n > 0)
+        {
+            sdrm::tuning_t tuning = reader.tuning();
+
+            tuning.samplerate /= _ddcs[0]->decimation();
+
+            if (tuning.frequency and _ddcs.size() == 1)
+            {
+                tuning.frequency = llround(tuning.frequency + _frequencies[0]);
+            }
+
+            sdrm::pack_iq_frame(_outbuf, _wire_format, reader.sequence(),
+                                reader.dropped_samples(), _channel_data.data(),
+                                n * _ddcs.size(), _ddcs.size(),
+                                reader.sample_index(), reader.timestamp(),
+                                sdrm::SAMPLE_CF32, tuning);
+            iq_signal_source.publish(_outbuf);
+        }
+    }
+}
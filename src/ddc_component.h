@@ -0,0 +1,104 @@
+/*******************************************************************
+ *  ddc_component.h - Down-converts narrow bands of the incoming IQ
+ *  stream, and publishes them.
+ *
+ *  Copyright (C) 2019 Ramon Creager.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined _DDC_COMPONENT_H_
+#define _DDC_COMPONENT_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "ddc.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * \class DDCComponent
+ *
+ * Down-converts one or more narrow bands of the IQ data received on
+ * "input_data", each with its own NCO and decimation filters, and
+ * publishes them on "iq_data": one message per input buffer, holding
+ * the output of every band, band by band (frame_count is the number
+ * of bands). The output's tuning is the input's, at the decimated
+ * samplerate; its frequency is the band's center if there is one
+ * band, but stays the input's center if there are several, whose
+ * offsets from it are those configured. Configuration:
+ *
+ *   sample_rate: 768000      # of the input, Hz, if it doesn't say
+ *   frequencies: [-100000.0, 25000.0]  # band centers, Hz from the
+ *                            # input's center
+ *   decimation: 64           # even
+ *   nco: table               # or recursive
+ *   taps: 64                 # of the final FIR filter
+ *   window: blackman-harris  # for the final FIR filter design
+ *   wire_format: msgpack     # or raw
+ *
+ */
+
+class DDCComponent : public matrix::Component
+{
+public:
+
+    virtual ~DDCComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    DDCComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool connect();
+    bool disconnect();
+    bool setup_ddcs();
+    bool make_ddcs(double sample_rate);
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<DDCComponent> _run_thread;
+    std::unique_ptr<matrix::DataSink<std::string,
+                                     matrix::select_only>> input_signal_sink;
+    matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+    sdrm::wire_format_t _wire_format;
+
+    // Configuration; see the class description.
+    double _sample_rate;
+    std::vector<double> _frequencies;
+    size_t _decimation;
+    sdrm::nco_mode_t _nco_mode;
+    size_t _taps;
+    std::string _window;
+
+    // The down-converters, and the input samplerate they are made for.
+    std::vector<std::unique_ptr<sdrm::ddc>> _ddcs;
+    double _input_rate;
+    std::vector<sdrm::complex_float_t> _channel_data;
+    msgpack::sbuffer _outbuf;
+
+    void receiving_task();
+};
+
+#endif
@@ -22,8 +22,15 @@
 
 #include "fft_component.h"
 #include "fftwp.h"
+#include "trace.h"
+#include "sdrm_config.h"
+#include "welch_psd.h"
 #include "matrix/log_t.h"
+#include <boost/algorithm/string.hpp>
 #include <memory>
+#include <algorithm>
+#include <string.h>
+#include <stdexcept>
 #include <matrix/matrix_util.h>
 
 using namespace std;
@@ -43,16 +50,63 @@ FFTComponent::FFTComponent(std::string name, std::string keymaster_url) :
     _run(false),
     _run_thread_started(false),
     _run_thread(this, &FFTComponent::receiving_task),
-    iq_signal_source(keymaster_url, name, "iq_data")
+    iq_signal_source(keymaster_url, name, "iq_data"),
+    _stat_received(_stats.counter("received")),
+    _stat_samples(_stats.counter("samples")),
+    _stat_lost(_stats.counter("lost_messages")),
+    _stat_published(_stats.counter("published")),
+    _stat_bytes(_stats.counter("published_bytes")),
+    _stat_queue(_stats.gauge("input_queue")),
+    _stat_input_age(_stats.histogram("input_age")),
+    _stat_compute(_stats.histogram("compute_time")),
+    _stat_publish(_stats.histogram("publish_time")),
+    _input_sequence(_stat_lost)
 {
+    _wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".wire_format", "msgpack"));
+    _batch_frames = 1;
+    _batch_count = 0;
+    _psd_mode = false;
+    _psd_publish_time = 0;
 }
 
 FFTComponent::~FFTComponent()
 {
 }
 
+/**
+ * Sets up the FFT planner before the data starts. If the component
+ * has a `planner` setting, it sets the planner effort; as the effort
+ * is shared by every FFT in the process, a component without one
+ * leaves it as it is (ESTIMATE, unless set elsewhere). If
+ * `wisdom_file` is set, FFTW wisdom saved there by an earlier run is
+ * loaded, so that measured plans don't have to be measured again.
+ *
+ */
+
+void FFTComponent::setup_planner()
+{
+    string planner = sdrm::get_config<string>(
+        keymaster, my_full_instance_name + ".planner", "");
+
+    if (not planner.empty() and planner != get_fft_planner_effort())
+    {
+        set_fft_planner_effort(planner);
+    }
+
+    _wisdom_file = sdrm::get_config<string>(
+        keymaster, my_full_instance_name + ".wisdom_file", "");
+
+    if (not _wisdom_file.empty())
+    {
+        import_fft_wisdom(_wisdom_file);
+    }
+}
+
 bool FFTComponent::_do_start()
 {
+    setup_planner();
     connect();
     Keymaster km(keymaster_url);
 
@@ -93,13 +147,20 @@ bool FFTComponent::_do_stop()
     _run_thread.join();
     _run_thread_started.set_value(false);
     disconnect();
+
+    // Save what was learned planning this run, for the next.
+    if (not _wisdom_file.empty())
+    {
+        export_fft_wisdom(_wisdom_file);
+    }
+
     return true;
 }
 
 bool FFTComponent::connect()
 {
     input_signal_sink.reset(
-        new matrix::DataSink<std::vector<sdrm::complex_float_t>,
+        new matrix::DataSink<std::string,
                             matrix::select_only>(keymaster_url, 10));
     connect_sink(*input_signal_sink, "input_data");
     return true;
@@ -113,24 +174,687 @@ bool FFTComponent::disconnect()
 }
 
 
+/**
+ * Adds a frame to the batch, first flushing the batch if the frame is
+ * of a different size than those already in it.
+ *
+ * @param samples: The frame's samples.
+ *
+ * @param n: The frame length.
+ *
+ * @param sequence: The frame's sequence number.
+ *
+ * @param dropped_samples: The source's dropped sample count.
+ *
+ * @param sample_index: The source stream index of the frame's first
+ * sample.
+ *
+ * @param timestamp: The time of that sample.
+ *
+ */
+
+void FFTComponent::add_to_batch(const sdrm::complex_float_t *samples, size_t n,
+                                uint64_t sequence, uint64_t dropped_samples,
+                                uint64_t sample_index, uint64_t timestamp)
+{
+    // A batch is all of one size, and of one tuning.
+    if (_batch_count > 0
+        && (n != _batch_n || _tuning.epoch != _batch_tuning.epoch))
+    {
+        flush_batch();
+    }
+
+    if (_batch_count == 0)
+    {
+        _batch_n = n;
+        _batch_sequence = sequence;
+        _batch_sample_index = sample_index;
+        _batch_timestamp = timestamp;
+        _batch_tuning = _tuning;
+        _batch_start = Time::getUTC();
+        // Only grows if N does; otherwise this doesn't allocate.
+        _batch_in.resize(_batch_frames * n);
+        _batch_out.resize(_batch_frames * n);
+    }
+
+    memcpy((void *)&_batch_in[_batch_count * n], (const void *)samples,
+           n * sizeof(sdrm::complex_float_t));
+    _batch_dropped = dropped_samples;
+    ++_batch_count;
+}
+
+/**
+ * Transforms the frames in the batch with one plan_many execution and
+ * publishes all the spectra in one message, whose sequence number,
+ * sample index and timestamp are those of the first frame. With a
+ * worker pool the batch is handed to the pool instead, which does the
+ * same on one of its threads.
+ *
+ */
+
+void FFTComponent::flush_batch()
+{
+    if (_batch_count == 0)
+    {
+        return;
+    }
+
+    if (_pool)
+    {
+        // The batch's buffer goes with the job, and the job's (from
+        // an earlier batch, so already grown) becomes the batch's.
+        fft_job_t *job = _pool->acquire();
+        job->in.swap(_batch_in);
+        job->n = _batch_n;
+        job->frames = _batch_count;
+        job->sequence = _batch_sequence;
+        job->dropped = _batch_dropped;
+        job->sample_index = _batch_sample_index;
+        job->timestamp = _batch_timestamp;
+        job->tuning = _batch_tuning;
+        _pool->submit(job);
+        _batch_count = 0;
+        return;
+    }
+
+    uint64_t start = sdrm::stats_now();
+
+    {
+        sdrm::trace_span span("fft.compute", _batch_sequence);
+        batched_dfft(_batch_in.data(), _batch_out.data(), _batch_n,
+                     _batch_count);
+    }
+
+    _stat_compute.record(sdrm::stats_now() - start);
+    sdrm::pack_iq_frame(_outbuf, _wire_format, _batch_sequence, _batch_dropped,
+                        _batch_out.data(), _batch_count * _batch_n,
+                        _batch_count, _batch_sample_index, _batch_timestamp,
+                        sdrm::SAMPLE_CF32, _batch_tuning);
+    publish(_outbuf, _batch_sequence);
+    _batch_count = 0;
+}
+
+/**
+ * Pool work function for complex mode: transforms the job's frames
+ * and packs them for publication, as flush_batch() does.
+ *
+ * @param job: The job.
+ *
+ * @param worker: The worker thread's index; unused.
+ *
+ */
+
+void FFTComponent::fft_work(fft_job_t &job, size_t)
+{
+    sdrm::trace_span span("fft.compute", job.sequence);
+    job.out.resize(job.frames * job.n);
+    uint64_t start = sdrm::stats_now();
+    batched_dfft(job.in.data(), job.out.data(), job.n, job.frames);
+    _stat_compute.record(sdrm::stats_now() - start);
+    sdrm::pack_iq_frame(job.packed, _wire_format, job.sequence, job.dropped,
+                        job.out.data(), job.frames * job.n, job.frames,
+                        job.sample_index, job.timestamp, sdrm::SAMPLE_CF32,
+                        job.tuning);
+}
+
+/**
+ * Pool work function for psd mode: the job is the stretch of input
+ * that makes one spectrum (see setup_psd()), which the worker's own
+ * PSD engine turns into that spectrum, packed for publication.
+ *
+ * @param job: The job.
+ *
+ * @param worker: The worker thread's index.
+ *
+ */
+
+void FFTComponent::psd_work(fft_job_t &job, size_t worker)
+{
+    sdrm::trace_span span("fft.psd", job.sequence);
+    uint64_t start = sdrm::stats_now();
+    _worker_job[worker] = &job;
+    _worker_psd[worker]->reset();
+    _worker_psd[worker]->add(job.in.data(), job.n);
+    _stat_compute.record(sdrm::stats_now() - start);
+}
+
+/**
+ * Starts the worker pool, if so configured:
+ *
+ *   workers: 4            # FFT threads; 1 (the default): FFTs are done
+ *                         # on the receiving thread
+ *
+ * With workers, frames (or batches) in complex mode, and
+ * integrations in psd mode, are computed in parallel and published
+ * strictly in order, so that one stream may use several cores. The
+ * output is the same as without.
+ *
+ */
+
+void FFTComponent::setup_pool()
+{
+    size_t workers = sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".workers", 1);
+
+    _pool.reset();
+
+    if (workers < 2)
+    {
+        return;
+    }
+
+    // Two jobs per worker: one being worked on, one waiting.
+    _pool.reset(new sdrm::ordered_pool<fft_job_t>(
+                    workers, 2 * workers,
+                    [this](fft_job_t &job, size_t worker)
+                    {
+                        if (_psd_mode)
+                        {
+                            psd_work(job, worker);
+                        }
+                        else
+                        {
+                            fft_work(job, worker);
+                        }
+                    },
+                    [this](fft_job_t &job)
+                    {
+                        publish(job.packed, job.sequence);
+                    }));
+
+    logger.info(__PRETTY_FUNCTION__, "FFT workers =", workers);
+}
+
+/**
+ * Creates the Welch PSD engine from the component's configuration:
+ *
+ *   mode: psd             # "complex" (the default) for plain FFTs
+ *   fft_size: 2048        # 0: the size of the first frame received
+ *   window: hann          # see sdrm::make_window()
+ *   overlap: 0.5          # fraction of fft_size
+ *   integrations: 16      # spectra averaged per output
+ *   psd_units: dB         # or "linear"
+ *
+ * @param frame_size: The size of the first frame, used if fft_size
+ * isn't set.
+ *
+ * @return false if the configuration is invalid.
+ *
+ */
+
+bool FFTComponent::setup_psd(size_t frame_size)
+{
+    string base = my_full_instance_name + ".";
+    size_t fft_size = sdrm::get_config<size_t>(keymaster, base + "fft_size", 0);
+    string window = sdrm::get_config<string>(keymaster, base + "window", "hann");
+    double overlap = sdrm::get_config<double>(keymaster, base + "overlap", 0.5);
+    size_t integrations =
+        sdrm::get_config<size_t>(keymaster, base + "integrations", 16);
+    string units = sdrm::get_config<string>(keymaster, base + "psd_units", "dB");
+
+    if (fft_size == 0)
+    {
+        fft_size = frame_size;
+    }
+
+    if (not boost::iequals(units, "dB") and not boost::iequals(units, "linear"))
+    {
+        logger.error(__PRETTY_FUNCTION__, "psd_units must be dB or linear,",
+                     "not", units);
+        return false;
+    }
+
+    bool db = boost::iequals(units, "dB");
+
+    try
+    {
+        _psd.reset(new sdrm::welch_psd(
+                       fft_size, window, overlap, integrations, db,
+                       [this](const float *bins, size_t n)
+                       {
+                           sdrm::pack_power_frame(_outbuf, _wire_format,
+                                                  _psd_sequence, _psd_dropped,
+                                                  bins, n, 1,
+                                                  _psd->sample_index(),
+                                                  _psd->timestamp(),
+                                                  _tuning);
+                           _psd_publish_time += publish(_outbuf,
+                                                        _psd_sequence);
+                       }));
+
+        _span_framer.reset();
+        _worker_psd.clear();
+
+        if (_pool)
+        {
+            // A spectrum is made from `integrations` segments a hop
+            // apart, so from a span of fft_size + (integrations - 1) *
+            // hop samples, and the next spectrum's span starts
+            // integrations * hop later. Cutting the input into these
+            // spans makes each spectrum an independent job.
+            size_t hop = _psd->hop();
+            _span_framer.reset(new sdrm::iq_framer(
+                                   fft_size + (integrations - 1) * hop,
+                                   integrations * hop));
+            _worker_job.assign(_pool->workers(), NULL);
+
+            for (size_t w = 0; w < _pool->workers(); ++w)
+            {
+                _worker_psd.emplace_back(new sdrm::welch_psd(
+                    fft_size, window, overlap, integrations, db,
+                    [this, w](const float *bins, size_t n)
+                    {
+                        fft_job_t *job = _worker_job[w];
+                        sdrm::pack_power_frame(job->packed, _wire_format,
+                                               job->sequence, job->dropped,
+                                               bins, n, 1, job->sample_index,
+                                               job->timestamp, job->tuning);
+                    }));
+            }
+        }
+    }
+    catch (invalid_argument &e)
+    {
+        logger.error(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+
+    logger.info(__PRETTY_FUNCTION__, "PSD: fft_size =", fft_size,
+                "window =", window, "hop =", _psd->hop(),
+                "integrations =", integrations, "units =", units);
+    return true;
+}
+
+/**
+ * Feeds a frame to the PSD engine, which publishes each spectrum as it
+ * is finished. A spectrum carries the sequence number of the frame
+ * that completed it, and the sample index and time of its first
+ * sample. If the source reports newly dropped samples the
+ * stream is no longer continuous, so the spectrum in progress is
+ * discarded; as it is if the radio has been retuned, so that no
+ * spectrum averages two tunings.
+ *
+ * @param reader: The received frame.
+ *
+ * @param retuned: Whether the frame's tuning is new.
+ *
+ * @return false if the PSD engine couldn't be set up.
+ *
+ */
+
+bool FFTComponent::add_to_psd(const sdrm::iq_frame_reader &reader,
+                              bool retuned)
+{
+    if (not _psd)
+    {
+        if (not setup_psd(reader.sample_count()))
+        {
+            return false;
+        }
+    }
+    else if (reader.dropped_samples() != _psd_dropped or retuned)
+    {
+        _psd->reset();
+
+        if (_span_framer)
+        {
+            _span_framer->reset();
+        }
+    }
+
+    _psd_sequence = reader.sequence();
+    _psd_dropped = reader.dropped_samples();
+
+    if (_span_framer)
+    {
+        _span_framer->set_clock(reader.sample_index(), reader.timestamp());
+        add_to_spans(reader);
+    }
+    else
+    {
+        // The spectra are published from within add(); their
+        // publication isn't counted as computation.
+        sdrm::trace_span span("fft.psd", reader.sequence());
+        uint64_t start = sdrm::stats_now();
+        _psd_publish_time = 0;
+        _psd->set_clock(reader.sample_index(), reader.timestamp());
+        _psd->add(reader.samples(), reader.sample_count());
+        _stat_compute.record(sdrm::stats_now() - start - _psd_publish_time);
+    }
+
+    return true;
+}
+
+/**
+ * psd mode with a worker pool: cuts the input into the spans that
+ * each make one spectrum, and submits each as a job. As without the
+ * pool, a spectrum carries the sequence number of the frame that
+ * completed it.
+ *
+ * @param reader: The received frame.
+ *
+ */
+
+void FFTComponent::add_to_spans(const sdrm::iq_frame_reader &reader)
+{
+    const sdrm::complex_float_t *samples = reader.samples();
+    size_t n = reader.sample_count();
+    size_t used = 0;
+
+    while (used < n)
+    {
+        used += _span_framer->add(samples + used, n - used);
+
+        for (auto f = _span_framer->front(); f; f = _span_framer->front())
+        {
+            fft_job_t *job = _pool->acquire();
+            job->in.assign(f->samples, f->samples + f->length);
+            job->n = f->length;
+            job->sequence = _psd_sequence;
+            job->dropped = _psd_dropped;
+            job->sample_index = f->sample_index;
+            job->timestamp = f->timestamp;
+            job->tuning = _tuning;
+            _pool->submit(job);
+            _span_framer->pop();
+        }
+    }
+}
+
+/**
+ * Transforms one frame, or adds it to the batch, and publishes the
+ * result. The output carries the frame's sequence number, sample
+ * index and timestamp.
+ *
+ * @param samples: The frame's samples. Read in place.
+ *
+ * @param n: The frame length, and so the FFT size.
+ *
+ * @param sequence: The frame's sequence number.
+ *
+ * @param dropped_samples: The source's dropped sample count.
+ *
+ * @param sample_index: The source stream index of the frame's first
+ * sample.
+ *
+ * @param timestamp: The time of that sample.
+ *
+ */
+
+void FFTComponent::process_frame(const sdrm::complex_float_t *samples, size_t n,
+                                 uint64_t sequence, uint64_t dropped_samples,
+                                 uint64_t sample_index, uint64_t timestamp)
+{
+    if (_batch_frames > 1 or _pool)
+    {
+        add_to_batch(samples, n, sequence, dropped_samples, sample_index,
+                     timestamp);
+
+        if (_batch_count == _batch_frames)
+        {
+            flush_batch();
+        }
+
+        return;
+    }
+
+    _fft_data.resize(n);
+    uint64_t start = sdrm::stats_now();
+
+    {
+        sdrm::trace_span span("fft.compute", sequence);
+        one_dimensional_dfft(samples, _fft_data.data(), n);
+    }
+
+    _stat_compute.record(sdrm::stats_now() - start);
+    sdrm::pack_iq_frame(_outbuf, _wire_format, sequence, dropped_samples,
+                        _fft_data.data(), n, 1, sample_index, timestamp,
+                        sdrm::SAMPLE_CF32, _tuning);
+    publish(_outbuf, sequence);
+}
+
+/**
+ * Publishes a message, counting it and timing the publication.
+ *
+ * @param buf: The serialized message.
+ *
+ * @param sequence: Its sequence number, for tracing.
+ *
+ * @return The time publication took, in ns.
+ *
+ */
+
+uint64_t FFTComponent::publish(const msgpack::sbuffer &buf, uint64_t sequence)
+{
+    sdrm::trace_span span("fft.publish", sequence);
+    uint64_t start = sdrm::stats_now();
+    iq_signal_source.publish(buf);
+    uint64_t elapsed = sdrm::stats_now() - start;
+
+    _stat_publish.record(elapsed);
+    _stat_published.add();
+    _stat_bytes.add(buf.size());
+    return elapsed;
+}
+
+/**
+ * Writes the component's statistics to "STATS.<name>":
+ *
+ *   received, samples:    messages and samples received
+ *   lost_messages:        messages missing from the input's sequence
+ *   input_queue:          messages waiting in the input sink
+ *   input_age:            age of a message's first sample on receipt
+ *   compute_time:         FFT (or PSD) time per message, batch or job
+ *   publish_time:         time to publish an output message
+ *   published, published_bytes
+ *
+ * Counters have a total and a rate, histograms percentiles; see
+ * sdrm::stats_group::report(). How often is set by
+ *
+ *   stats_interval_ms: 1000   # 0 turns reporting off
+ *
+ */
+
+void FFTComponent::report_stats()
+{
+    _stat_queue.set(input_signal_sink->items_in_queue());
+
+    YAML::Node stats;
+    _stats.report(stats);
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
+
+/**
+ * Re-blocks a received buffer into fft_size frames and processes
+ * each. The frames are numbered by the framer, consecutively. If the
+ * source reports newly dropped samples the partial frame is
+ * discarded, so that no frame straddles the gap; likewise if the
+ * radio has been retuned.
+ *
+ * @param reader: The received buffer.
+ *
+ * @param retuned: Whether the buffer's tuning is new.
+ *
+ */
+
+void FFTComponent::add_to_framer(const sdrm::iq_frame_reader &reader,
+                                 bool retuned)
+{
+    if (reader.dropped_samples() != _framer_dropped or retuned)
+    {
+        _framer->reset();
+        _framer_dropped = reader.dropped_samples();
+    }
+
+    const sdrm::complex_float_t *samples = reader.samples();
+    size_t n = reader.sample_count();
+    size_t used = 0;
+
+    _framer->set_clock(reader.sample_index(), reader.timestamp());
+
+    while (used < n)
+    {
+        used += _framer->add(samples + used, n - used, _framer_dropped);
+
+        for (auto f = _framer->front(); f; f = _framer->front())
+        {
+            process_frame(f->samples, f->length, f->sequence, f->dropped_samples,
+                          f->sample_index, f->timestamp);
+            _framer->pop();
+        }
+    }
+}
+
+/**
+ * Creates the framer if `fft_size` is set, so that the FFT size is
+ * independent of the size of the buffers received:
+ *
+ *   fft_size: 4096        # 0 (the default): one FFT per buffer received
+ *   hop_size: 2048        # distance between frame starts; default fft_size
+ *
+ * In psd mode these are not used; see setup_psd().
+ *
+ */
+
+void FFTComponent::setup_framer()
+{
+    size_t fft_size = sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".fft_size", 0);
+    size_t hop_size = sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".hop_size", 0);
+
+    _framer.reset();
+    _framer_dropped = 0;
+
+    if (fft_size > 0 and not _psd_mode)
+    {
+        _framer.reset(new sdrm::iq_framer(fft_size,
+                                          hop_size ? hop_size : fft_size));
+        logger.info(__PRETTY_FUNCTION__, "framing: fft_size =", fft_size,
+                    "hop =", _framer->hop());
+    }
+}
+
 void FFTComponent::receiving_task()
 {
+    _psd_mode = sdrm::get_config<string>(
+        keymaster, my_full_instance_name + ".mode", "complex") == "psd";
+    _psd.reset();
+    setup_framer();
+
+    _batch_frames = max(sdrm::get_config<size_t>(
+        keymaster, my_full_instance_name + ".batch_frames", 1), (size_t)1);
+    _batch_max_latency = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".batch_max_latency_ms", 50.0)
+        * 1000000;
+    _batch_count = 0;
+    _tuning = sdrm::tuning_t();
+    setup_pool();
+
+    _stats_interval = sdrm::get_config<double>(
+        keymaster, my_full_instance_name + ".stats_interval_ms", 1000.0)
+        * 1000000;
+    _input_sequence.reset();
+
+    // When batching, wake up often enough to honor the latency bound.
+    Time::Time_t timeout = _batch_frames > 1
+        ? min(Time::TM_ONE_SEC, _batch_max_latency) : Time::TM_ONE_SEC;
+
     logger.info(__PRETTY_FUNCTION__, "running");
     _run_thread_started.signal(true);
 
+    sdrm::iq_frame_reader reader;
+
     while (_run.load())
     {
+        if (_stats.due(_stats_interval))
+        {
+            report_stats();
+        }
+
         // wait for a data bufferstring scan_status
-        vector<sdrm::complex_float_t> inbuf;
+        string inbuf;
+        bool received;
 
-        if (input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
         {
-            auto fft_data = one_dimensional_dfft(std::move(inbuf));
-            iq_signal_source.publish(fft_data);
+            sdrm::trace_span span("fft.wait");
+            received = input_signal_sink->timed_get(inbuf, timeout);
+        }
+
+        if (received)
+        {
+            sdrm::trace_span span("fft.process");
+
+            if (not reader.parse(inbuf))
+            {
+                logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+                continue;
+            }
+
+            span.set_id(reader.sequence());
+
+            _stat_received.add();
+            _stat_samples.add(reader.sample_count());
+            _input_sequence.received(reader.sequence(), reader.frame_count());
+
+            if (reader.timestamp() != 0)
+            {
+                int64_t age = Time::getUTC() - reader.timestamp();
+                _stat_input_age.record(age > 0 ? age : 0);
+            }
+
+            if (reader.sample_format() != sdrm::SAMPLE_CF32)
+            {
+                logger.warning(__PRETTY_FUNCTION__, "Input is not IQ data.");
+                continue;
+            }
+
+            bool retuned = reader.tuning().epoch != _tuning.epoch;
+            _tuning = reader.tuning();
+
+            if (_psd_mode)
+            {
+                if (not add_to_psd(reader, retuned))
+                {
+                    logger.error(__PRETTY_FUNCTION__,
+                                 "Bad PSD configuration; FFT thread exiting.");
+                    break;
+                }
+
+                continue;
+            }
+
+            if (_framer)
+            {
+                add_to_framer(reader, retuned);
+            }
+            else
+            {
+                // Without a framer the FFT reads straight out of the
+                // received message.
+                process_frame(reader.samples(), reader.sample_count(),
+                              reader.sequence(), reader.dropped_samples(),
+                              reader.sample_index(), reader.timestamp());
+            }
         }
         else
         {
             logger.debug(__PRETTY_FUNCTION__, "Timed out waiting for FFT data.");
         }
+
+        if (_batch_count > 0 && Time::getUTC() - _batch_start > _batch_max_latency)
+        {
+            flush_batch();
+        }
+    }
+
+    flush_batch();
+
+    if (_pool)
+    {
+        _pool->drain();
+        _pool.reset();
+        _span_framer.reset();
+        _worker_psd.clear();
     }
 }
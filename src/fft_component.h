@@ -23,6 +23,11 @@
 #define _FFT_COMPONENT_H_
 
 #include "sdrm_types.h"
+#include "iq_frame.h"
+#include "welch_psd.h"
+#include "iq_framer.h"
+#include "ordered_pool.h"
+#include "stats.h"
 
 #include "matrix/Thread.h"
 #include "matrix/Component.h"
@@ -48,14 +53,109 @@ protected:
 
     bool connect();
     bool disconnect();
+    void setup_planner();
 
     std::atomic<bool> _run;
     matrix::TCondition<bool> _run_thread_started;
     matrix::Thread<FFTComponent> _run_thread;
-    std::unique_ptr<matrix::DataSink<std::vector<sdrm::complex_float_t>,
+    std::unique_ptr<matrix::DataSink<std::string,
                                      matrix::select_only>> input_signal_sink;
-    matrix::DataSource<std::vector<sdrm::complex_float_t>> iq_signal_source;
+    matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+    sdrm::wire_format_t _wire_format;
+    std::string _wisdom_file;
 
+    // Batching. Frames are collected in _batch_in until there are
+    // _batch_frames of them, or the oldest has waited
+    // _batch_max_latency, then transformed together.
+    size_t _batch_frames;
+    Time::Time_t _batch_max_latency;
+    size_t _batch_n;
+    size_t _batch_count;
+    uint64_t _batch_sequence;
+    uint64_t _batch_dropped;
+    uint64_t _batch_sample_index;
+    uint64_t _batch_timestamp;
+    sdrm::tuning_t _batch_tuning;
+    Time::Time_t _batch_start;
+    std::vector<sdrm::complex_float_t> _batch_in;
+    std::vector<sdrm::complex_float_t> _batch_out;
+    std::vector<sdrm::complex_float_t> _fft_data;
+    msgpack::sbuffer _outbuf;
+
+    // Re-blocks the input into fft_size frames. NULL if the FFT size
+    // is that of the buffers received. See setup_framer().
+    std::unique_ptr<sdrm::iq_framer> _framer;
+    uint64_t _framer_dropped;
+
+    // The tuning of the input, passed on with the output. When it
+    // changes, the radio has been retuned.
+    sdrm::tuning_t _tuning;
+
+    // PSD mode: instead of the complex FFT of each frame, publish
+    // Welch averaged power spectra. See setup_psd().
+    bool _psd_mode;
+    std::unique_ptr<sdrm::welch_psd> _psd;
+    uint64_t _psd_sequence;
+    uint64_t _psd_dropped;
+
+    // Worker pool: with `workers` > 1, FFTs (or, in psd mode, whole
+    // integrations) are computed on that many threads and published
+    // in order. See setup_pool().
+    struct fft_job_t
+    {
+        std::vector<sdrm::complex_float_t> in;
+        std::vector<sdrm::complex_float_t> out;
+        size_t n;
+        size_t frames;
+        uint64_t sequence;
+        uint64_t dropped;
+        uint64_t sample_index;
+        uint64_t timestamp;
+        sdrm::tuning_t tuning;
+        msgpack::sbuffer packed;
+    };
+
+    std::unique_ptr<sdrm::ordered_pool<fft_job_t>> _pool;
+    // psd mode: the input cut into the stretches each of which makes
+    // one spectrum, and a PSD engine per worker to compute them.
+    std::unique_ptr<sdrm::iq_framer> _span_framer;
+    std::vector<std::unique_ptr<sdrm::welch_psd>> _worker_psd;
+    std::vector<fft_job_t *> _worker_job;
+
+    // Telemetry, reported to "STATS.<name>" every _stats_interval ns.
+    // See report_stats().
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_received;
+    sdrm::stats_counter &_stat_samples;
+    sdrm::stats_counter &_stat_lost;
+    sdrm::stats_counter &_stat_published;
+    sdrm::stats_counter &_stat_bytes;
+    sdrm::stats_gauge &_stat_queue;
+    sdrm::stats_histogram &_stat_input_age;
+    sdrm::stats_histogram &_stat_compute;
+    sdrm::stats_histogram &_stat_publish;
+    sdrm::stats_sequence _input_sequence;
+    uint64_t _stats_interval;
+    // psd mode: time spent publishing from within _psd->add().
+    uint64_t _psd_publish_time;
+
+    void setup_pool();
+    void fft_work(fft_job_t &job, size_t worker);
+    void psd_work(fft_job_t &job, size_t worker);
+    void add_to_spans(const sdrm::iq_frame_reader &reader);
+    bool setup_psd(size_t frame_size);
+    bool add_to_psd(const sdrm::iq_frame_reader &reader, bool retuned);
+    void setup_framer();
+    void add_to_framer(const sdrm::iq_frame_reader &reader, bool retuned);
+    void process_frame(const sdrm::complex_float_t *samples, size_t n,
+                       uint64_t sequence, uint64_t dropped_samples,
+                       uint64_t sample_index, uint64_t timestamp);
+    void add_to_batch(const sdrm::complex_float_t *samples, size_t n,
+                      uint64_t sequence, uint64_t dropped_samples,
+                      uint64_t sample_index, uint64_t timestamp);
+    void flush_batch();
+    uint64_t publish(const msgpack::sbuffer &buf, uint64_t sequence);
+    void report_stats();
     void receiving_task();
 };
 
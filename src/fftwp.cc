@@ -23,8 +23,14 @@
 #include "fftwp.h"
 #include "matrix/log_t.h"
 
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <tuple>
+#include <stdexcept>
 #include <string.h>
 #include <fftw3.h>
 
@@ -32,47 +38,358 @@ using namespace std;
 using namespace sdrm;
 using namespace matrix;
 
-static log_t logger("fft_data_1d");
+static log_t logger("fftwp");
+
+// The FFTW planner flag used for new plans. See set_fft_planner_effort().
+static unsigned planner_flags = FFTW_ESTIMATE;
 
 /**
- * \struct fft_data_1d
+ * \struct fft_plan_key
  *
- * Contains and manages the data and plan required to do
- * one-dimensional ffts of size N, where N is constant during the
- * lifetime of this object.
+ * Identifies a plan in the plan cache. Plans are executed on the
+ * caller's arrays with fftwf_execute_dft(), which requires that the
+ * arrays have the same SIMD alignment, and the same in-place-ness, as
+ * the arrays the plan was made with; so those are part of the key.
  *
  */
 
-struct fft_data_1d
+struct fft_plan_key
 {
-    fft_data_1d(int n)
+    int n;
+    int direction;
+    int batch;
+    int in_alignment;
+    int out_alignment;
+    bool in_place;
+
+    bool operator<(const fft_plan_key &o) const
+    {
+        return tie(n, direction, batch, in_alignment, out_alignment, in_place)
+            < tie(o.n, o.direction, o.batch, o.in_alignment,
+                  o.out_alignment, o.in_place);
+    }
+
+    bool operator==(const fft_plan_key &o) const
     {
-        N = n;
-        in = (fftwf_complex*) fftw_malloc(sizeof(fftwf_complex) * N);
-        out = (fftwf_complex*) fftw_malloc(sizeof(fftwf_complex) * N);
-        p = fftwf_plan_dft_1d(N, in, out, FFTW_FORWARD, FFTW_ESTIMATE);
+        return not (*this < o) and not (o < *this);
     }
+};
 
+/**
+ * \struct fft_plan_t
+ *
+ * A plan for `batch` contiguous one-dimensional FFTs of size `n`. The
+ * plan owns no data arrays: those used for planning are freed once
+ * the plan is made, and the plan is always executed on the caller's
+ * arrays. Plans may therefore be executed by several threads at once.
+ *
+ */
 
-    ~fft_data_1d()
+struct fft_plan_t
+{
+    fft_plan_t(const fft_plan_key &k)
     {
-        fftwf_destroy_plan(p);
-        fftw_free(in);
-        fftw_free(out);
+        // Planning arrays with the same alignment offsets as the
+        // caller's. The slack covers the largest offset.
+        size_t bytes = sizeof(fftwf_complex) * k.n * k.batch + 64;
+        char *in_base = (char *)fftwf_malloc(bytes);
+        char *out_base = k.in_place ? in_base : (char *)fftwf_malloc(bytes);
+        fftwf_complex *in = (fftwf_complex *)(in_base + k.in_alignment);
+        fftwf_complex *out = k.in_place
+            ? in : (fftwf_complex *)(out_base + k.out_alignment);
+        int n = k.n;
+
+        plan = fftwf_plan_many_dft(1, &n, k.batch,
+                                   in, NULL, 1, n,
+                                   out, NULL, 1, n,
+                                   k.direction, planner_flags);
+
+        if (out_base != in_base)
+        {
+            fftwf_free(out_base);
+        }
+
+        fftwf_free(in_base);
+
+        if (plan == NULL)
+        {
+            throw runtime_error("FFTW could not create plan");
+        }
     }
 
-    void execute()
+    ~fft_plan_t()
     {
-        fftwf_execute(p);
+        fftwf_destroy_plan(plan);
     }
 
-    int N{0};
-    fftwf_plan p;
-    fftwf_complex *in{NULL};
-    fftwf_complex *out{NULL};
+    fftwf_plan plan;
 };
 
-shared_ptr<fft_data_1d> data1d;
+// The FFTW planner (including wisdom) is not thread safe, so all
+// planning, and all access to the cache, is done under this mutex.
+static mutex planner_mutex;
+static map<fft_plan_key, shared_ptr<fft_plan_t>> plan_cache;
+// Bumped whenever the cache is emptied, so that threads know their
+// last-used plans are stale.
+static atomic<unsigned> cache_generation{0};
+// Plans emptied from the cache, which threads may still hold. A
+// thread mustn't be the one to destroy a plan, when it lets go of it,
+// as that would be done without the mutex; so these are kept here
+// until no thread holds them, and destroyed by free_retired_plans().
+static vector<shared_ptr<fft_plan_t>> retired_plans;
+
+/**
+ * Destroys the retired plans that no thread holds any more. Must be
+ * called with planner_mutex held.
+ *
+ */
+
+static void free_retired_plans()
+{
+    // A use count of 1 is this list's alone. No thread can then get
+    // the plan back, as threads only copy plans out of the cache.
+    retired_plans.erase(remove_if(retired_plans.begin(), retired_plans.end(),
+                                  [](const shared_ptr<fft_plan_t> &p)
+                                  {
+                                      return p.use_count() == 1;
+                                  }),
+                        retired_plans.end());
+}
+
+/**
+ * Finds the plan for `key`, making it if need be. Each thread
+ * remembers the plan it used last, so a thread that keeps doing the
+ * same FFT (the normal case) gets its plan without taking the lock.
+ *
+ * @param key: The plan wanted.
+ *
+ * @return The plan.
+ *
+ */
+
+static shared_ptr<fft_plan_t> get_plan(const fft_plan_key &key)
+{
+    thread_local struct
+    {
+        unsigned generation;
+        fft_plan_key key;
+        shared_ptr<fft_plan_t> plan;
+    } last;
+
+    unsigned generation = cache_generation.load(memory_order_acquire);
+
+    if (last.plan and last.generation == generation and last.key == key)
+    {
+        return last.plan;
+    }
+
+    lock_guard<mutex> l(planner_mutex);
+    free_retired_plans();
+    auto &plan = plan_cache[key];
+
+    if (not plan)
+    {
+        logger.info(__PRETTY_FUNCTION__, "planning N =", key.n,
+                    "batch =", key.batch, "direction =", key.direction);
+        plan.reset(new fft_plan_t(key));
+    }
+
+    last.generation = cache_generation.load(memory_order_relaxed);
+    last.key = key;
+    last.plan = plan;
+    return plan;
+}
+
+/**
+ * Executes `batch` contiguous FFTs of size N from `in` to `out`,
+ * which may be the same array.
+ *
+ */
+
+static void execute_dft(const complex_float_t *in, complex_float_t *out,
+                        int N, int batch, fft_direction_t direction)
+{
+    // Out-of-place complex transforms don't modify their input, so it
+    // is safe to hand FFTW a const array.
+    fftwf_complex *fin = (fftwf_complex *)const_cast<complex_float_t *>(in);
+    fftwf_complex *fout = (fftwf_complex *)out;
+    fft_plan_key key;
+
+    key.n = N;
+    key.direction = direction;
+    key.batch = batch;
+    key.in_alignment = fftwf_alignment_of((float *)fin);
+    key.out_alignment = fftwf_alignment_of((float *)fout);
+    key.in_place = (fin == fout);
+
+    fftwf_execute_dft(get_plan(key)->plan, fin, fout);
+}
+
+static const struct
+{
+    const char *name;
+    unsigned flag;
+} planner_efforts[] =
+{
+    {"ESTIMATE", FFTW_ESTIMATE},
+    {"MEASURE", FFTW_MEASURE},
+    {"PATIENT", FFTW_PATIENT},
+    {"EXHAUSTIVE", FFTW_EXHAUSTIVE}
+};
+
+/**
+ * Sets how hard FFTW works to find a fast plan. ESTIMATE plans
+ * instantly from heuristics; MEASURE, PATIENT and EXHAUSTIVE time
+ * successively more candidate algorithms, taking from a fraction of a
+ * second to many seconds per size, and give faster transforms. The
+ * cost of the slower levels is only paid once per size if wisdom is
+ * saved and restored (see import_fft_wisdom()). The level is shared
+ * by every user of the plan cache in the process. If it changes, the
+ * cache is emptied so that subsequent FFTs are planned at the new
+ * level; setting the level already in force does nothing.
+ *
+ * @param effort: One of ESTIMATE, MEASURE, PATIENT, EXHAUSTIVE.
+ *
+ * @return true if `effort` was recognized, false otherwise, in which
+ * case the level is unchanged.
+ *
+ */
+
+bool set_fft_planner_effort(string effort)
+{
+    for (auto &e : planner_efforts)
+    {
+        if (effort == e.name)
+        {
+            lock_guard<mutex> l(planner_mutex);
+
+            if (planner_flags == e.flag)
+            {
+                return true;
+            }
+
+            planner_flags = e.flag;
+
+            for (auto &p : plan_cache)
+            {
+                retired_plans.push_back(p.second);
+            }
+
+            plan_cache.clear();
+            ++cache_generation;
+            free_retired_plans();
+            return true;
+        }
+    }
+
+    logger.error(__PRETTY_FUNCTION__, "Unknown FFTW planner effort", effort);
+    return false;
+}
+
+string get_fft_planner_effort()
+{
+    for (auto &e : planner_efforts)
+    {
+        if (planner_flags == e.flag)
+        {
+            return e.name;
+        }
+    }
+
+    return "UNKNOWN";
+}
+
+/**
+ * Loads FFTW wisdom (previously measured plans) from a file. Plans
+ * then made at a level covered by the wisdom are created without
+ * measurement.
+ *
+ * @param filename: The wisdom file.
+ *
+ * @return true if the wisdom was read, false if the file doesn't exist
+ * or isn't valid wisdom.
+ *
+ */
+
+bool import_fft_wisdom(string filename)
+{
+    lock_guard<mutex> l(planner_mutex);
+
+    if (fftwf_import_wisdom_from_filename(filename.c_str()))
+    {
+        logger.info(__PRETTY_FUNCTION__, "Imported FFTW wisdom from", filename);
+        return true;
+    }
+
+    logger.warning(__PRETTY_FUNCTION__, "No FFTW wisdom imported from", filename);
+    return false;
+}
+
+/**
+ * Saves all the wisdom accumulated so far, including any imported, to
+ * a file.
+ *
+ * @param filename: The wisdom file.
+ *
+ * @return true on success.
+ *
+ */
+
+bool export_fft_wisdom(string filename)
+{
+    lock_guard<mutex> l(planner_mutex);
+
+    if (fftwf_export_wisdom_to_filename(filename.c_str()))
+    {
+        logger.info(__PRETTY_FUNCTION__, "Exported FFTW wisdom to", filename);
+        return true;
+    }
+
+    logger.error(__PRETTY_FUNCTION__, "Could not export FFTW wisdom to", filename);
+    return false;
+}
+
+/**
+ * Returns an aligned per-thread scratch buffer of at least `n`
+ * samples. Each thread has a few of these (selected by `which`); they
+ * grow as needed and are reused, so callers that need temporary FFT
+ * arrays don't allocate or share them across threads.
+ *
+ * @param n: The number of samples needed.
+ *
+ * @param which: Which of the thread's buffers, 0 to
+ * FFT_THREAD_BUFFERS - 1.
+ *
+ * @return The buffer. Valid until the next call with the same
+ * `which` on this thread.
+ *
+ */
+
+complex_float_t *fft_thread_buffer(size_t n, int which)
+{
+    struct buffer_t
+    {
+        ~buffer_t()
+        {
+            fftwf_free(data);
+        }
+
+        complex_float_t *data{NULL};
+        size_t size{0};
+    };
+
+    thread_local buffer_t buffers[FFT_THREAD_BUFFERS];
+    buffer_t &b = buffers[which];
+
+    if (b.size < n)
+    {
+        fftwf_free(b.data);
+        b.data = (complex_float_t *)fftwf_malloc(n * sizeof(complex_float_t));
+        b.size = n;
+    }
+
+    return b.data;
+}
 
 /**
  * Receives and computes the data for a 1-d fft.
@@ -81,8 +398,7 @@ shared_ptr<fft_data_1d> data1d;
  * results (always complex with doubles) is returned.
  *
  * @param samples: An rval containing the input data. From this the
- * size N of the FFT will be known, and a new plan generated if the
- * previous size was not N.
+ * size N of the FFT will be known.
  *
  * @return Returns a vector<complex_float_t> with the results.
  *
@@ -91,17 +407,52 @@ shared_ptr<fft_data_1d> data1d;
 vector<complex_float_t> one_dimensional_dfft(vector<complex_float_t> &&samples)
 {
     int N = samples.size();
-    size_t binsize = N * sizeof(complex_float_t);
-
-    if (not data1d or N != data1d->N)
-    {
-        logger.info(__PRETTY_FUNCTION__, "initializing 'data1d'");
-        data1d.reset(new fft_data_1d(N));
-    }
-
-    memcpy((void *)data1d->in, (const void *)samples.data(), binsize);
-    data1d->execute();
     vector<complex_float_t> rval(N);
-    memcpy((void *)rval.data(), (const void *)data1d->out, binsize);
+    one_dimensional_dfft(samples.data(), rval.data(), N);
     return rval;
 }
+
+/**
+ * Computes a 1-d fft of caller-owned data. Nothing is copied: the
+ * cached plan for this size and alignment is executed directly on
+ * `in` and `out`. Safe to call from several threads at once.
+ *
+ * @param in: The N input samples.
+ *
+ * @param out: Receives the N output bins. May be `in`.
+ *
+ * @param N: The size of the FFT.
+ *
+ * @param direction: FFT_FORWARD or FFT_BACKWARD.
+ *
+ */
+
+void one_dimensional_dfft(const complex_float_t *in, complex_float_t *out,
+                          int N, fft_direction_t direction)
+{
+    execute_dft(in, out, N, 1, direction);
+}
+
+/**
+ * Computes `batch` 1-d ffts of size N, stored one after another in
+ * `in`, with a single plan_many execution. For small N this is much
+ * faster than `batch` separate calls, as the per-execution overhead is
+ * paid once.
+ *
+ * @param in: The batch * N input samples.
+ *
+ * @param out: Receives the batch * N output bins. May be `in`.
+ *
+ * @param N: The size of each FFT.
+ *
+ * @param batch: The number of FFTs.
+ *
+ * @param direction: FFT_FORWARD or FFT_BACKWARD.
+ *
+ */
+
+void batched_dfft(const complex_float_t *in, complex_float_t *out,
+                  int N, int batch, fft_direction_t direction)
+{
+    execute_dft(in, out, N, batch, direction);
+}
@@ -30,8 +30,33 @@
 
 #include "sdrm_types.h"
 #include <vector>
+#include <string>
+
+// Same values as FFTW_FORWARD and FFTW_BACKWARD.
+enum fft_direction_t
+{
+    FFT_FORWARD = -1,
+    FFT_BACKWARD = 1
+};
+
+const int FFT_THREAD_BUFFERS = 4;
 
 std::vector<sdrm::complex_float_t>
 one_dimensional_dfft(std::vector<sdrm::complex_float_t> &&samples);
 
+void one_dimensional_dfft(const sdrm::complex_float_t *in,
+                          sdrm::complex_float_t *out, int N,
+                          fft_direction_t direction = FFT_FORWARD);
+
+void batched_dfft(const sdrm::complex_float_t *in,
+                  sdrm::complex_float_t *out, int N, int batch,
+                  fft_direction_t direction = FFT_FORWARD);
+
+sdrm::complex_float_t *fft_thread_buffer(size_t n, int which = 0);
+
+bool set_fft_planner_effort(std::string effort);
+std::string get_fft_planner_effort();
+bool import_fft_wisdom(std::string filename);
+bool export_fft_wisdom(std::string filename);
+
 #endif
@@ -0,0 +1,184 @@
+/*******************************************************************
+ *  iq_buffer_pool.cc - Implementation of the IQ buffer pool.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "iq_buffer_pool.h"
+
+#include <new>
+#include <stdlib.h>
+#include <memory.h>
+
+using namespace std;
+
+namespace sdrm
+{
+    // Upper bound on the msgpack encoding of one complex_float_t: a
+    // fixarray marker and two float32s.
+    static const size_t PACKED_BYTES_PER_SAMPLE = 11;
+    // Upper bound on the msgpack encoding of everything else in an
+    // iq_data_t, tuning included.
+    static const size_t PACKED_HEADER_BYTES = 96;
+
+    iq_buffer_t::iq_buffer_t(size_t cap)
+        : sample_count(0),
+          sequence(0),
+          dropped_samples(0),
+          sample_index(0),
+          timestamp(0),
+          capacity(0),
+          samples(NULL),
+          packed(PACKED_HEADER_BYTES + cap * PACKED_BYTES_PER_SAMPLE)
+    {
+        reserve(cap);
+    }
+
+    iq_buffer_t::~iq_buffer_t()
+    {
+        free(samples);
+    }
+
+    /**
+     * Makes sure the sample storage can hold at least `n`
+     * samples. This only allocates if a transfer is larger than any
+     * seen so far, which for a given samplerate happens at most once.
+     *
+     * @param n: The number of samples required.
+     *
+     */
+
+    void iq_buffer_t::reserve(size_t n)
+    {
+        if (n <= capacity)
+        {
+            return;
+        }
+
+        void *p;
+
+        if (posix_memalign(&p, IQ_BUFFER_ALIGNMENT, n * sizeof(complex_float_t)))
+        {
+            throw bad_alloc();
+        }
+
+        free(samples);
+        samples = (complex_float_t *)p;
+        capacity = n;
+    }
+
+    /**
+     * Copies the contents of an Airspy transfer into this buffer.
+     *
+     * @param transfer: The transfer handed to the airspyhf callback.
+     *
+     * @param seq: The transfer's sequence number.
+     *
+     * @param index: The stream index of its first sample.
+     *
+     * @param time: The time of that sample.
+     *
+     * @param t: The device's tuning.
+     *
+     */
+
+    void iq_buffer_t::load(airspyhf_transfer_t *transfer, uint64_t seq,
+                           uint64_t index, uint64_t time, const tuning_t &t)
+    {
+        reserve(transfer->sample_count);
+        sample_count = transfer->sample_count;
+        sequence = seq;
+        dropped_samples = transfer->dropped_samples;
+        sample_index = index;
+        timestamp = time;
+        tuning = t;
+        memcpy((void *)samples, transfer->samples,
+               sample_count * sizeof(complex_float_t));
+    }
+
+    /**
+     * Serializes the buffer into `packed`, in the wire format `fmt`
+     * and sample format `sample_format`. See pack_iq_frame().
+     *
+     */
+
+    void iq_buffer_t::pack(wire_format_t fmt, sample_format_t sample_format)
+    {
+        pack_iq_frame(packed, fmt, sequence, dropped_samples,
+                      samples, sample_count, 1, sample_index, timestamp,
+                      sample_format, tuning);
+    }
+
+    iq_buffer_pool::iq_buffer_pool(size_t pool_size, size_t capacity)
+        : _free(pool_size)
+    {
+        _buffers.reserve(pool_size);
+
+        for (size_t i = 0; i < pool_size; ++i)
+        {
+            _buffers.emplace_back(new iq_buffer_t(capacity));
+            _free.push(_buffers.back().get());
+        }
+    }
+
+    iq_buffer_pool::~iq_buffer_pool()
+    {
+    }
+
+    /**
+     * Takes a buffer from the pool.
+     *
+     * @return A buffer, or NULL if all the buffers are in use.
+     *
+     */
+
+    iq_buffer_t *iq_buffer_pool::acquire()
+    {
+        iq_buffer_t *buf;
+
+        if (not _free.pop(buf))
+        {
+            return NULL;
+        }
+
+        return buf;
+    }
+
+    /**
+     * Returns a buffer to the pool. `_free` can hold every buffer, so
+     * this can't fail.
+     *
+     * @param buf: A buffer previously obtained from acquire().
+     *
+     */
+
+    void iq_buffer_pool::release(iq_buffer_t *buf)
+    {
+        _free.push(buf);
+    }
+
+    size_t iq_buffer_pool::size() const
+    {
+        return _buffers.size();
+    }
+
+    size_t iq_buffer_pool::available() const
+    {
+        return _free.occupancy();
+    }
+}
@@ -0,0 +1,117 @@
+/*******************************************************************
+ *  iq_buffer_pool.h - A fixed-size pool of preallocated, aligned IQ
+ *  buffers, so that the Airspy callback path can move samples
+ *  without touching the heap.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_IQ_BUFFER_POOL_H_)
+#define _IQ_BUFFER_POOL_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "spsc_ring.h"
+
+#include <vector>
+#include <memory>
+#include <msgpack.hpp>
+
+namespace sdrm
+{
+    // Alignment of the sample storage, good for any SIMD width we use.
+    const size_t IQ_BUFFER_ALIGNMENT = 64;
+    // Initial sample capacity of each buffer. libairspyhf hands us
+    // fewer samples than this per transfer at every samplerate, so
+    // buffers normally never grow.
+    const size_t IQ_BUFFER_DEFAULT_CAPACITY = 8192;
+
+    /**
+     * \struct iq_buffer_t
+     *
+     * One slot of an iq_buffer_pool. Holds a copy of an Airspy
+     * transfer in aligned storage, plus a buffer into which that data
+     * is serialized. Both are allocated once and reused, so
+     * that loading and packing a transfer does no allocation in the
+     * steady state.
+     *
+     */
+
+    struct iq_buffer_t
+    {
+        iq_buffer_t(size_t capacity);
+        ~iq_buffer_t();
+
+        void load(airspyhf_transfer_t *transfer, uint64_t seq,
+                  uint64_t index, uint64_t time, const tuning_t &t);
+        void pack(wire_format_t fmt,
+                  sample_format_t sample_format = SAMPLE_CF32);
+
+        int sample_count;
+        uint64_t sequence;
+        uint64_t dropped_samples;
+        uint64_t sample_index;
+        uint64_t timestamp;
+        tuning_t tuning;
+        size_t capacity;
+        complex_float_t *samples;
+        msgpack::sbuffer packed;
+
+    private:
+        iq_buffer_t(const iq_buffer_t &) = delete;
+        iq_buffer_t &operator=(const iq_buffer_t &) = delete;
+
+        void reserve(size_t n);
+    };
+
+    /**
+     * \class iq_buffer_pool
+     *
+     * A fixed number of iq_buffer_t objects, allocated up front. A
+     * user acquire()s a buffer, fills it, and release()s it back when
+     * done with it. If all the buffers are in use acquire() returns
+     * NULL rather than allocating a new one; the caller is expected
+     * to drop the data and count it.
+     *
+     * The free list is an spsc_ring, so one thread may acquire() while
+     * another release()s without locking. This is how the Airspy
+     * callback (acquire) and the publishing thread (release) share a
+     * device's pool. No more than one thread may do each.
+     *
+     */
+
+    class iq_buffer_pool
+    {
+    public:
+        iq_buffer_pool(size_t pool_size,
+                       size_t capacity = IQ_BUFFER_DEFAULT_CAPACITY);
+        ~iq_buffer_pool();
+
+        iq_buffer_t *acquire();
+        void release(iq_buffer_t *buf);
+
+        size_t size() const;
+        size_t available() const;
+
+    private:
+        std::vector<std::unique_ptr<iq_buffer_t>> _buffers;
+        spsc_ring<iq_buffer_t *> _free;
+    };
+}
+
+#endif
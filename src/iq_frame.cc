@@ -0,0 +1,554 @@
+/*******************************************************************
+ *  iq_frame.cc - Encoding and decoding of IQ messages.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "iq_frame.h"
+#include "simd_kernels.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <memory.h>
+
+using namespace std;
+
+namespace sdrm
+{
+    /**
+     * Fills in a raw frame's header, but for its sample format.
+     *
+     */
+
+    static void fill_header(iq_frame_header_t &hdr, uint16_t frame_count,
+                            size_t sample_count, uint64_t sequence,
+                            uint64_t dropped_samples, uint64_t sample_index,
+                            uint64_t timestamp, const tuning_t &tuning)
+    {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = IQ_FRAME_MAGIC;
+        hdr.version = IQ_FRAME_VERSION;
+        hdr.header_size = sizeof(hdr);
+        hdr.frame_count = frame_count;
+        hdr.sample_count = sample_count;
+        hdr.sequence = sequence;
+        hdr.dropped_samples = dropped_samples;
+        hdr.sample_index = sample_index;
+        hdr.timestamp = timestamp;
+        hdr.scale = 1.0f;
+        hdr.tune_epoch = tuning.epoch;
+        hdr.frequency = tuning.frequency;
+        hdr.samplerate = tuning.samplerate;
+        hdr.hf_att = tuning.hf_att;
+        hdr.hf_agc = tuning.hf_agc;
+        hdr.hf_agc_threshold = tuning.hf_agc_threshold;
+        hdr.lib_dsp = tuning.lib_dsp;
+    }
+
+    /**
+     * Converts a `wire_format` configuration value to a
+     * wire_format_t.
+     *
+     * @param s: "msgpack" or "raw".
+     *
+     * @return The corresponding wire_format_t. Throws
+     * std::invalid_argument if `s` is not recognized.
+     *
+     */
+
+    wire_format_t wire_format_from_string(string s)
+    {
+        if (s == "msgpack")
+        {
+            return WIRE_MSGPACK;
+        }
+        else if (s == "raw")
+        {
+            return WIRE_RAW;
+        }
+
+        throw invalid_argument("Unknown wire_format '" + s + "'");
+    }
+
+    /**
+     * Converts a `sample_format` configuration value to a
+     * sample_format_t.
+     *
+     * @param s: "cf32", "ci16" or "cf16".
+     *
+     * @return The corresponding sample_format_t. Throws
+     * std::invalid_argument if `s` is not recognized.
+     *
+     */
+
+    sample_format_t sample_format_from_string(string s)
+    {
+        if (s == "cf32")
+        {
+            return SAMPLE_CF32;
+        }
+        else if (s == "ci16")
+        {
+            return SAMPLE_CI16;
+        }
+        else if (s == "cf16")
+        {
+            return SAMPLE_CF16;
+        }
+
+        throw invalid_argument("Unknown sample_format '" + s + "'");
+    }
+
+    /**
+     * Serializes a block of IQ data into `out`, which is cleared
+     * first. `out` keeps its allocation between calls, so a caller
+     * that reuses one sbuffer stops allocating after the first few
+     * messages.
+     *
+     * The WIRE_MSGPACK encoding is written by hand but is identical
+     * to msgpack::pack() of an iq_data_t, so existing subscribers may
+     * keep converting to iq_data_t.
+     *
+     * @param out: The buffer to serialize into.
+     *
+     * @param fmt: The wire format to use.
+     *
+     * @param sequence: The message's sequence number.
+     *
+     * @param dropped_samples: The source's dropped sample count.
+     *
+     * @param samples: The IQ data.
+     *
+     * @param sample_count: The number of samples.
+     *
+     * @param frame_count: The number of equal-length frames the
+     * samples make up: either consecutive frames, numbered from
+     * `sequence`, or channels.
+     *
+     * @param sample_index: The source stream index of the first
+     * sample.
+     *
+     * @param timestamp: The UTC time of that sample, in ns.
+     *
+     * @param sample_format: SAMPLE_CF32, or SAMPLE_CI16 or SAMPLE_CF16
+     * to send the samples at half the size, scaled to the frame's
+     * peak. Only carried by WIRE_RAW; iq_data_t is always float.
+     *
+     * @param tuning: How the samples were captured.
+     *
+     */
+
+    void pack_iq_frame(msgpack::sbuffer &out, wire_format_t fmt,
+                       uint64_t sequence, uint64_t dropped_samples,
+                       const complex_float_t *samples, size_t sample_count,
+                       uint16_t frame_count, uint64_t sample_index,
+                       uint64_t timestamp, sample_format_t sample_format,
+                       const tuning_t &tuning)
+    {
+        out.clear();
+
+        if (fmt == WIRE_RAW)
+        {
+            iq_frame_header_t hdr;
+            fill_header(hdr, frame_count, sample_count, sequence,
+                        dropped_samples, sample_index, timestamp, tuning);
+            hdr.sample_format = sample_format;
+
+            if (sample_format != SAMPLE_CI16 && sample_format != SAMPLE_CF16)
+            {
+                hdr.sample_format = SAMPLE_CF32;
+                out.write((const char *)&hdr, sizeof(hdr));
+                out.write((const char *)samples,
+                          sample_count * sizeof(complex_float_t));
+                return;
+            }
+
+            // Converted here, then copied in; sbuffer can't be written
+            // in place. Kept per thread, so it stops allocating too.
+            static thread_local vector<uint16_t> converted;
+            const float *values = (const float *)samples;
+            size_t n = 2 * sample_count;
+            float full_scale = sample_format == SAMPLE_CI16 ? 32767.0f : 1.0f;
+            float peak = peak_magnitude(values, n);
+
+            // All zeros, or infinities, are sent unscaled.
+            if (peak > 0.0f && std::isfinite(peak))
+            {
+                hdr.scale = peak / full_scale;
+            }
+
+            converted.resize(n);
+
+            if (sample_format == SAMPLE_CI16)
+            {
+                float_to_int16(values, (int16_t *)converted.data(), n,
+                               1.0f / hdr.scale);
+            }
+            else
+            {
+                float_to_half(values, converted.data(), n, 1.0f / hdr.scale);
+            }
+
+            out.write((const char *)&hdr, sizeof(hdr));
+            out.write((const char *)converted.data(), n * sizeof(uint16_t));
+            return;
+        }
+
+        msgpack::packer<msgpack::sbuffer> pk(out);
+
+        pk.pack_array(8);
+        pk.pack((int)sample_count);
+        pk.pack(dropped_samples);
+        pk.pack_array(sample_count);
+
+        for (size_t i = 0; i < sample_count; ++i)
+        {
+            pk.pack_array(2);
+            pk.pack_float(samples[i].re);
+            pk.pack_float(samples[i].im);
+        }
+
+        pk.pack(sequence);
+        pk.pack(sample_index);
+        pk.pack(timestamp);
+        pk.pack(tuning);
+        pk.pack(frame_count);
+    }
+
+    /**
+     * Serializes a block of real values, such as the bins of a power
+     * spectrum, into `out`, which is cleared first. WIRE_RAW writes a
+     * SAMPLE_F32 frame; WIRE_MSGPACK writes a power_data_t.
+     *
+     * @param out: The buffer to serialize into.
+     *
+     * @param fmt: The wire format to use.
+     *
+     * @param sequence: The message's sequence number.
+     *
+     * @param dropped_samples: The source's dropped sample count.
+     *
+     * @param bins: The values.
+     *
+     * @param bin_count: The number of values.
+     *
+     * @param frame_count: The number of equal-length frames (e.g.
+     * spectra) the values make up.
+     *
+     * @param sample_index: The source stream index of the first
+     * sample the values were computed from.
+     *
+     * @param timestamp: The UTC time of that sample, in ns.
+     *
+     * @param tuning: How that sample was captured.
+     *
+     */
+
+    void pack_power_frame(msgpack::sbuffer &out, wire_format_t fmt,
+                          uint64_t sequence, uint64_t dropped_samples,
+                          const float *bins, size_t bin_count,
+                          uint16_t frame_count, uint64_t sample_index,
+                          uint64_t timestamp, const tuning_t &tuning)
+    {
+        out.clear();
+
+        if (fmt == WIRE_RAW)
+        {
+            iq_frame_header_t hdr;
+            fill_header(hdr, frame_count, bin_count, sequence,
+                        dropped_samples, sample_index, timestamp, tuning);
+            hdr.sample_format = SAMPLE_F32;
+            out.write((const char *)&hdr, sizeof(hdr));
+            out.write((const char *)bins, bin_count * sizeof(float));
+            return;
+        }
+
+        msgpack::packer<msgpack::sbuffer> pk(out);
+
+        pk.pack_array(8);
+        pk.pack((int)bin_count);
+        pk.pack(dropped_samples);
+        pk.pack_array(bin_count);
+
+        for (size_t i = 0; i < bin_count; ++i)
+        {
+            pk.pack_float(bins[i]);
+        }
+
+        pk.pack(sequence);
+        pk.pack(sample_index);
+        pk.pack(timestamp);
+        pk.pack(tuning);
+        pk.pack(frame_count);
+    }
+
+    /**
+     * The time of a sample, extrapolated from an anchor: `samples`
+     * samples at `samplerate` after time `anchor`. Exact, in integer
+     * arithmetic, however long the stream.
+     *
+     * @param anchor: The time of the anchor sample, in ns.
+     *
+     * @param samples: Samples since the anchor.
+     *
+     * @param samplerate: In samples per second.
+     *
+     * @return The sample's time, in ns.
+     *
+     */
+
+    uint64_t sample_timestamp(uint64_t anchor, uint64_t samples,
+                              uint32_t samplerate)
+    {
+        if (samplerate == 0)
+        {
+            return anchor;
+        }
+
+        uint64_t secs = samples / samplerate;
+        uint64_t rest = samples % samplerate;
+        return anchor + secs * 1000000000ULL
+            + rest * 1000000000ULL / samplerate;
+    }
+
+    iq_frame_reader::iq_frame_reader()
+        : _format(WIRE_MSGPACK),
+          _sample_format(SAMPLE_CF32),
+          _wire_sample_format(SAMPLE_CF32),
+          _scale(1.0f),
+          _samples(NULL),
+          _values(NULL),
+          _sample_count(0),
+          _sequence(0),
+          _dropped_samples(0),
+          _frame_count(1),
+          _sample_index(0),
+          _timestamp(0)
+    {
+    }
+
+    bool iq_frame_reader::parse(const string &msg)
+    {
+        return parse(msg.data(), msg.size());
+    }
+
+    /**
+     * Decodes a message. The format is recognized from the message
+     * itself: a msgpack'd iq_data_t always begins with an array
+     * marker, which can't be mistaken for the raw frame's magic.
+     *
+     * @param msg: The message bytes.
+     *
+     * @param len: The message length.
+     *
+     * @return true if the message was decoded, false if it was
+     * malformed or of an unsupported version or sample format.
+     *
+     */
+
+    bool iq_frame_reader::parse(const char *msg, size_t len)
+    {
+        _samples = NULL;
+        _values = NULL;
+        _sample_count = 0;
+
+        if (len >= sizeof(uint32_t) && *(const uint32_t *)msg == IQ_FRAME_MAGIC)
+        {
+            if (len < IQ_FRAME_HEADER_V1_SIZE)
+            {
+                return false;
+            }
+
+            auto hdr = (const iq_frame_header_t *)msg;
+            size_t sample_size;
+
+            switch (hdr->sample_format)
+            {
+            case SAMPLE_CF32:
+                sample_size = sizeof(complex_float_t);
+                break;
+            case SAMPLE_F32:
+                sample_size = sizeof(float);
+                break;
+            case SAMPLE_CI16:
+            case SAMPLE_CF16:
+                sample_size = 2 * sizeof(uint16_t);
+                break;
+            default:
+                return false;
+            }
+
+            if (hdr->version > IQ_FRAME_VERSION
+                || hdr->header_size < IQ_FRAME_HEADER_V1_SIZE
+                || len < hdr->header_size + hdr->sample_count * sample_size)
+            {
+                return false;
+            }
+
+            _format = WIRE_RAW;
+            _wire_sample_format = (sample_format_t)hdr->sample_format;
+            _sample_format = _wire_sample_format == SAMPLE_F32
+                ? SAMPLE_F32 : SAMPLE_CF32;
+            _scale = hdr->header_size >= IQ_FRAME_HEADER_V4_SIZE
+                ? hdr->scale : 1.0f;
+
+            const char *data = msg + hdr->header_size;
+            size_t n = 2 * hdr->sample_count;
+
+            switch (_wire_sample_format)
+            {
+            case SAMPLE_CF32:
+                _samples = (const complex_float_t *)data;
+                break;
+            case SAMPLE_F32:
+                _values = (const float *)data;
+                break;
+            case SAMPLE_CI16:
+                _converted.resize(hdr->sample_count);
+                int16_to_float((const int16_t *)data,
+                               (float *)_converted.data(), n, _scale);
+                _samples = _converted.data();
+                break;
+            case SAMPLE_CF16:
+                _converted.resize(hdr->sample_count);
+                half_to_float((const uint16_t *)data,
+                              (float *)_converted.data(), n, _scale);
+                _samples = _converted.data();
+                break;
+            }
+
+            _sample_count = hdr->sample_count;
+            _sequence = hdr->sequence;
+            _dropped_samples = hdr->dropped_samples;
+            // version 1 writers before frame_count existed wrote 0.
+            _frame_count = hdr->frame_count ? hdr->frame_count : 1;
+
+            if (hdr->header_size >= IQ_FRAME_HEADER_V2_SIZE)
+            {
+                _sample_index = hdr->sample_index;
+                _timestamp = hdr->timestamp;
+            }
+            else
+            {
+                _sample_index = 0;
+                _timestamp = 0;
+            }
+
+            _tuning = tuning_t();
+
+            if (hdr->version >= 4)
+            {
+                _tuning.epoch = hdr->tune_epoch;
+            }
+
+            if (hdr->header_size >= sizeof(iq_frame_header_t))
+            {
+                _tuning.frequency = hdr->frequency;
+                _tuning.samplerate = hdr->samplerate;
+                _tuning.hf_att = hdr->hf_att;
+                _tuning.hf_agc = hdr->hf_agc;
+                _tuning.hf_agc_threshold = hdr->hf_agc_threshold;
+                _tuning.lib_dsp = hdr->lib_dsp;
+            }
+
+            return true;
+        }
+
+        msgpack::object_handle oh;
+
+        try
+        {
+            oh = msgpack::unpack(msg, len);
+        }
+        catch (std::exception &e)
+        {
+            return false;
+        }
+
+        _format = WIRE_MSGPACK;
+        _frame_count = 1;
+        _scale = 1.0f;
+
+        // The third element's first entry tells IQ ([re, im] pairs)
+        // from real values.
+        const msgpack::object &o = oh.get();
+
+        if (o.type == msgpack::type::ARRAY && o.via.array.size >= 3
+            && o.via.array.ptr[2].type == msgpack::type::ARRAY
+            && o.via.array.ptr[2].via.array.size > 0
+            && o.via.array.ptr[2].via.array.ptr[0].type != msgpack::type::ARRAY)
+        {
+            // Messages from before the trailing fields were added
+            // lack them, and convert() leaves them as they are.
+            _unpacked_power.sequence = 0;
+            _unpacked_power.sample_index = 0;
+            _unpacked_power.timestamp = 0;
+            _unpacked_power.tuning = tuning_t();
+            _unpacked_power.frame_count = 1;
+
+            try
+            {
+                o.convert(_unpacked_power);
+            }
+            catch (std::exception &e)
+            {
+                return false;
+            }
+
+            _sample_format = SAMPLE_F32;
+            _wire_sample_format = SAMPLE_F32;
+            _values = _unpacked_power.bins.data();
+            _sample_count = _unpacked_power.bins.size();
+            _dropped_samples = _unpacked_power.dropped_samples;
+            _sequence = _unpacked_power.sequence;
+            _sample_index = _unpacked_power.sample_index;
+            _timestamp = _unpacked_power.timestamp;
+            _tuning = _unpacked_power.tuning;
+            _frame_count = _unpacked_power.frame_count
+                ? _unpacked_power.frame_count : 1;
+            return true;
+        }
+
+        _unpacked.sequence = 0;
+        _unpacked.sample_index = 0;
+        _unpacked.timestamp = 0;
+        _unpacked.tuning = tuning_t();
+        _unpacked.frame_count = 1;
+
+        try
+        {
+            o.convert(_unpacked);
+        }
+        catch (std::exception &e)
+        {
+            return false;
+        }
+
+        _sample_format = SAMPLE_CF32;
+        _wire_sample_format = SAMPLE_CF32;
+        _samples = _unpacked.samples.data();
+        _sample_count = _unpacked.samples.size();
+        _dropped_samples = _unpacked.dropped_samples;
+        _sequence = _unpacked.sequence;
+        _sample_index = _unpacked.sample_index;
+        _timestamp = _unpacked.timestamp;
+        _tuning = _unpacked.tuning;
+        _frame_count = _unpacked.frame_count ? _unpacked.frame_count : 1;
+        return true;
+    }
+}
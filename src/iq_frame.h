@@ -0,0 +1,224 @@
+/*******************************************************************
+ *  iq_frame.h - Wire formats for IQ data: the original msgpack
+ *  encoding of iq_data_t, and a fixed-header raw binary frame that
+ *  can be read in place.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_IQ_FRAME_H_)
+#define _IQ_FRAME_H_
+
+#include "sdrm_types.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <msgpack.hpp>
+
+namespace sdrm
+{
+    // "SDRM" when read as bytes on a little-endian host.
+    const uint32_t IQ_FRAME_MAGIC = 0x4d524453;
+    const uint16_t IQ_FRAME_VERSION = 5;
+    // The header size of version 1 frames, which lack sample_index and
+    // timestamp; the smallest header a reader accepts.
+    const uint16_t IQ_FRAME_HEADER_V1_SIZE = 32;
+    // ...and of version 2 frames, which lack scale.
+    const uint16_t IQ_FRAME_HEADER_V2_SIZE = 48;
+    // ...and of versions 3 and 4, which lack frequency and the rest of
+    // the tuning.
+    const uint16_t IQ_FRAME_HEADER_V4_SIZE = 56;
+
+    enum wire_format_t
+    {
+        WIRE_MSGPACK,  // msgpack'd iq_data_t
+        WIRE_RAW       // iq_frame_header_t followed by the samples
+    };
+
+    enum sample_format_t
+    {
+        SAMPLE_CF32 = 1, // interleaved float32 I, Q
+        SAMPLE_F32 = 2,  // float32, e.g. power spectrum bins
+        SAMPLE_CI16 = 3, // interleaved int16 I, Q, times `scale`
+        SAMPLE_CF16 = 4  // interleaved IEEE half I, Q, times `scale`
+    };
+
+    /**
+     * \struct iq_frame_header_t
+     *
+     * The header of a WIRE_RAW frame. The samples follow immediately
+     * after `header_size` bytes. Readers must use `header_size`, not
+     * sizeof(iq_frame_header_t), to find them, so that fields may be
+     * appended in later versions without breaking older readers. All
+     * fields are in host (little-endian) byte order.
+     *
+     * `sequence` numbers a source's buffers consecutively, so a
+     * subscriber can count lost messages. `sample_index` is the
+     * position of the first sample in the source's sample stream,
+     * counting the samples the device dropped, and `timestamp` the
+     * host UTC time of that sample in nanoseconds: the source anchors
+     * its stream to the host clock once and extrapolates from the
+     * sample rate, so timestamps are as regular as the samples.
+     * Derived data (spectra, channels) carry the index and time of
+     * the first source sample they were computed from. 0 means
+     * unknown.
+     *
+     * SAMPLE_CI16 and SAMPLE_CF16 frames carry IQ at half the size of
+     * SAMPLE_CF32: each value is the sample divided by `scale`, which
+     * the writer chooses per frame so that the largest value is full
+     * scale (32767, or 1.0). int16 resolves about 90 dB below a
+     * frame's peak; half precision keeps 11 significant bits whatever
+     * the level. For other formats `scale` is 1.
+     *
+     * The tuning fields say how the samples were captured: center
+     * frequency, samplerate, and the radio's attenuation and AGC
+     * settings, so that a subscriber can work out a frequency axis,
+     * or scale a level, without asking the Keymaster. `tune_epoch`
+     * counts changes to these, so that a subscriber can tell buffers
+     * from before and after a retune, and e.g. restart an average;
+     * samples just after the epoch changes may still be settling.
+     * While a change is being made the frequency is 0, and the
+     * epoch changes again once it is done. Derived data carry the
+     * tuning of their input, with the samplerate, and the frequency
+     * of a single down-converted band, made theirs; a multi-channel
+     * message keeps the input's center frequency. 0 means unknown.
+     * `tune_epoch` was `reserved`, always 0, before version 4, and
+     * the rest are new in version 5.
+     *
+     */
+
+    struct iq_frame_header_t
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_size;
+        uint16_t sample_format;
+        uint16_t frame_count;  // equal-length frames (or channels) in the samples
+        uint32_t sample_count;
+        uint64_t sequence;
+        uint64_t dropped_samples;
+        // version 2:
+        uint64_t sample_index;
+        uint64_t timestamp;    // UTC, ns since the Unix epoch
+        // version 3:
+        float scale;
+        // version 4:
+        uint32_t tune_epoch;
+        // version 5:
+        uint64_t frequency;        // Hz
+        uint32_t samplerate;       // S/s
+        uint8_t hf_att;            // attenuation, in 6 dB steps
+        uint8_t hf_agc;            // 1: AGC on
+        uint8_t hf_agc_threshold;  // 1: high AGC threshold
+        uint8_t lib_dsp;           // 1: the library's IQ correction on
+    };
+
+    static_assert(sizeof(iq_frame_header_t) == 72,
+                  "iq_frame_header_t must be packed to 72 bytes");
+
+    wire_format_t wire_format_from_string(std::string s);
+    sample_format_t sample_format_from_string(std::string s);
+
+    void pack_iq_frame(msgpack::sbuffer &out, wire_format_t fmt,
+                       uint64_t sequence, uint64_t dropped_samples,
+                       const complex_float_t *samples, size_t sample_count,
+                       uint16_t frame_count = 1, uint64_t sample_index = 0,
+                       uint64_t timestamp = 0,
+                       sample_format_t sample_format = SAMPLE_CF32,
+                       const tuning_t &tuning = tuning_t());
+
+    void pack_power_frame(msgpack::sbuffer &out, wire_format_t fmt,
+                          uint64_t sequence, uint64_t dropped_samples,
+                          const float *bins, size_t bin_count,
+                          uint16_t frame_count = 1, uint64_t sample_index = 0,
+                          uint64_t timestamp = 0,
+                          const tuning_t &tuning = tuning_t());
+
+    uint64_t sample_timestamp(uint64_t anchor, uint64_t samples,
+                              uint32_t samplerate);
+
+    /**
+     * \class iq_frame_reader
+     *
+     * Decodes a received IQ message of either wire format. A message
+     * may hold several frames of equal length, one after another;
+     * frame_count() says how many. They are either a batch of frames
+     * with consecutive sequence numbers (e.g. FFTComponent's batched
+     * spectra), or, from a channelizer, one block per channel, all
+     * covering the same input. For
+     * WIRE_RAW frames nothing is copied: samples() points into the
+     * message itself, which must therefore outlive the reader's use of
+     * it. For WIRE_MSGPACK messages the data is unpacked into an
+     * iq_data_t held by the reader.
+     *
+     * Messages of real values (SAMPLE_F32, or a msgpack'd
+     * power_data_t) are decoded too: then sample_format() is
+     * SAMPLE_F32, values() points to sample_count() floats, and
+     * samples() is NULL.
+     *
+     * SAMPLE_CI16 and SAMPLE_CF16 frames are converted to float into
+     * a buffer held by the reader, so they are read like any other IQ
+     * frame: sample_format() is SAMPLE_CF32, and wire_sample_format()
+     * tells what was sent.
+     *
+     */
+
+    class iq_frame_reader
+    {
+    public:
+        iq_frame_reader();
+
+        bool parse(const std::string &msg);
+        bool parse(const char *msg, size_t len);
+
+        wire_format_t format() const {return _format;}
+        sample_format_t sample_format() const {return _sample_format;}
+        sample_format_t wire_sample_format() const {return _wire_sample_format;}
+        float scale() const {return _scale;}
+        const complex_float_t *samples() const {return _samples;}
+        const float *values() const {return _values;}
+        size_t sample_count() const {return _sample_count;}
+        uint64_t sequence() const {return _sequence;}
+        uint64_t dropped_samples() const {return _dropped_samples;}
+        size_t frame_count() const {return _frame_count;}
+        uint64_t sample_index() const {return _sample_index;}
+        uint64_t timestamp() const {return _timestamp;}
+        const tuning_t &tuning() const {return _tuning;}
+
+    private:
+        wire_format_t _format;
+        sample_format_t _sample_format;
+        sample_format_t _wire_sample_format;
+        float _scale;
+        const complex_float_t *_samples;
+        const float *_values;
+        size_t _sample_count;
+        uint64_t _sequence;
+        uint64_t _dropped_samples;
+        size_t _frame_count;
+        uint64_t _sample_index;
+        uint64_t _timestamp;
+        tuning_t _tuning;
+        iq_data_t _unpacked;
+        power_data_t _unpacked_power;
+        std::vector<complex_float_t> _converted;
+    };
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*******************************************************************
+ *  iq_framer.cc - Re-blocks a stream of IQ buffers into frames of a
+ *  chosen length and hop.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "iq_framer.h"
+#include "iq_buffer_pool.h"
+
+#include <new>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <stdlib.h>
+#include <memory.h>
+
+using namespace std;
+
+namespace sdrm
+{
+    /**
+     * Constructor. All the frame buffers are allocated here.
+     *
+     * @param length: The frame length, in samples.
+     *
+     * @param hop: The distance between the starts of successive
+     * frames, in samples.
+     *
+     * @param ring_frames: The number of frame buffers. One is always
+     * being filled, so up to ring_frames - 1 finished frames may be
+     * waiting to be popped.
+     *
+     */
+
+    iq_framer::iq_framer(size_t length, size_t hop, size_t ring_frames)
+        : _length(length),
+          _hop(hop),
+          _ring(max(ring_frames, (size_t)2)),
+          _head(0),
+          _tail(0),
+          _fill(0),
+          _skip(0),
+          _sequence(0),
+          _index(0),
+          _clock_index(0),
+          _clock_timestamp(0),
+          _ns_per_sample(0.0)
+    {
+        if (length == 0 || hop == 0)
+        {
+            throw invalid_argument("iq_framer: length and hop must be > 0");
+        }
+
+        for (auto &f : _ring)
+        {
+            void *p;
+
+            if (posix_memalign(&p, IQ_BUFFER_ALIGNMENT,
+                               length * sizeof(complex_float_t)))
+            {
+                for (auto &g : _ring)
+                {
+                    free(g.samples);
+                }
+
+                throw bad_alloc();
+            }
+
+            f.samples = (complex_float_t *)p;
+            f.length = length;
+            f.sequence = 0;
+            f.dropped_samples = 0;
+            f.sample_index = 0;
+            f.timestamp = 0;
+        }
+    }
+
+    iq_framer::~iq_framer()
+    {
+        for (auto &f : _ring)
+        {
+            free(f.samples);
+        }
+    }
+
+    /**
+     * Adds samples to the stream.
+     *
+     * @param samples: The next `n` samples of the stream.
+     *
+     * @param n: The number of samples.
+     *
+     * @param dropped_samples: The source's dropped sample count as of
+     * these samples. Recorded in the frames they finish.
+     *
+     * @return The number of samples consumed. This is less than `n`
+     * only if the ring filled up, in which case the caller should pop
+     * frames and call again with the rest.
+     *
+     */
+
+    size_t iq_framer::add(const complex_float_t *samples, size_t n,
+                          uint64_t dropped_samples)
+    {
+        size_t used = 0;
+
+        while (used < n)
+        {
+            if (_skip > 0)
+            {
+                size_t s = min(_skip, n - used);
+                _skip -= s;
+                used += s;
+                _index += s;
+                continue;
+            }
+
+            size_t take = min(_length - _fill, n - used);
+
+            // Finishing this frame needs a free buffer for the next.
+            if (_fill + take == _length && pending() >= _ring.size() - 1)
+            {
+                break;
+            }
+
+            auto &f = _ring[_tail % _ring.size()];
+            memcpy((void *)(f.samples + _fill), (const void *)(samples + used),
+                   take * sizeof(complex_float_t));
+            _fill += take;
+            used += take;
+            _index += take;
+
+            if (_fill == _length)
+            {
+                complete_frame(dropped_samples);
+            }
+        }
+
+        return used;
+    }
+
+    /**
+     * Publishes the frame being filled and starts the next, seeding it
+     * with the overlap from this one.
+     *
+     */
+
+    void iq_framer::complete_frame(uint64_t dropped_samples)
+    {
+        auto &f = _ring[_tail % _ring.size()];
+        f.sequence = _sequence++;
+        f.dropped_samples = dropped_samples;
+        f.sample_index = _index - _length;
+        f.timestamp = 0;
+
+        if (_clock_timestamp)
+        {
+            // May be before the clock, if the frame started in an
+            // earlier buffer.
+            double offset = (double)(int64_t)(f.sample_index - _clock_index);
+            f.timestamp = _clock_timestamp
+                + (int64_t)llround(offset * _ns_per_sample);
+        }
+
+        ++_tail;
+
+        if (_hop < _length)
+        {
+            _fill = _length - _hop;
+            memcpy((void *)_ring[_tail % _ring.size()].samples,
+                   (const void *)(f.samples + _hop),
+                   _fill * sizeof(complex_float_t));
+        }
+        else
+        {
+            _fill = 0;
+            _skip = _hop - _length;
+        }
+    }
+
+    /**
+     * Places the next sample added in the source's stream. A source
+     * that doesn't keep an index tags its buffers with 0 for both;
+     * then the samples are just counted on, and frames get no time.
+     *
+     * @param sample_index: The stream index of the next sample added.
+     *
+     * @param timestamp: Its time, in ns; 0 if unknown, in which case
+     * `sample_index` is ignored.
+     *
+     */
+
+    void iq_framer::set_clock(uint64_t sample_index, uint64_t timestamp)
+    {
+        if (timestamp == 0)
+        {
+            _clock_timestamp = 0;
+            return;
+        }
+
+        if (_clock_timestamp and timestamp > _clock_timestamp
+            and sample_index > _clock_index)
+        {
+            _ns_per_sample = (double)(timestamp - _clock_timestamp)
+                / (sample_index - _clock_index);
+        }
+
+        _index = sample_index;
+        _clock_index = sample_index;
+        _clock_timestamp = timestamp;
+    }
+
+    /**
+     * The oldest finished frame.
+     *
+     * @return The frame, or NULL if there is none. Valid until it is
+     * popped.
+     *
+     */
+
+    const iq_framer_frame_t *iq_framer::front() const
+    {
+        return _head == _tail ? NULL : &_ring[_head % _ring.size()];
+    }
+
+    void iq_framer::pop()
+    {
+        if (_head != _tail)
+        {
+            ++_head;
+        }
+    }
+
+    /**
+     * Discards the partly filled frame, so that the next frame starts
+     * with the next sample added. Use when the stream has a gap.
+     * Finished frames are kept.
+     *
+     */
+
+    void iq_framer::reset()
+    {
+        _fill = 0;
+        _skip = 0;
+    }
+}
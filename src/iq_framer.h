@@ -0,0 +1,132 @@
+/*******************************************************************
+ *  iq_framer.h - Re-blocks a stream of IQ buffers into frames of a
+ *  chosen length and hop.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_IQ_FRAMER_H_)
+#define _IQ_FRAMER_H_
+
+#include "sdrm_types.h"
+
+#include <vector>
+
+namespace sdrm
+{
+    /**
+     * \struct iq_framer_frame_t
+     *
+     * A frame produced by an iq_framer. `samples` is aligned to
+     * IQ_BUFFER_ALIGNMENT and belongs to the framer.
+     *
+     */
+
+    struct iq_framer_frame_t
+    {
+        complex_float_t *samples;
+        size_t length;
+        uint64_t sequence;         // frames produced before this one
+        uint64_t dropped_samples;  // the source's count, as of the frame's end
+        uint64_t sample_index;     // of the frame's first sample
+        uint64_t timestamp;        // of the frame's first sample; 0 if unknown
+    };
+
+    /**
+     * \class iq_framer
+     *
+     * Cuts a stream of IQ buffers of arbitrary sizes into frames of
+     * `length` samples, the start of each frame `hop` samples after
+     * the start of the one before. A hop less than the length gives
+     * overlapping frames; greater, frames with samples skipped between
+     * them. A frame may be made of samples from several buffers.
+     *
+     * Finished frames are held in a ring of `ring_frames` frame
+     * buffers, allocated once, until the caller takes them with
+     * front() and pop(). add() stops early rather than overwrite a
+     * frame the caller hasn't popped, so the usual loop is:
+     *
+     *     size_t used = 0;
+     *     while (used < n)
+     *     {
+     *         used += framer.add(samples + used, n - used, dropped);
+     *         for (auto f = framer.front(); f; f = framer.front())
+     *         {
+     *             ... use *f ...
+     *             framer.pop();
+     *         }
+     *     }
+     *
+     * Frames are placed in the source's stream by set_clock(), given
+     * each buffer's sample_index and timestamp before it is added:
+     * frames get the index of their first sample, and its time,
+     * interpolated at the rate the buffers' clocks advance. Buffers
+     * without a timestamp leave the index counting on.
+     *
+     * Not thread safe.
+     *
+     */
+
+    class iq_framer
+    {
+    public:
+        iq_framer(size_t length, size_t hop, size_t ring_frames = 8);
+        ~iq_framer();
+
+        size_t add(const complex_float_t *samples, size_t n,
+                   uint64_t dropped_samples = 0);
+        void set_clock(uint64_t sample_index, uint64_t timestamp);
+        const iq_framer_frame_t *front() const;
+        void pop();
+        void reset();
+
+        size_t length() const {return _length;}
+        size_t hop() const {return _hop;}
+        size_t pending() const {return _tail - _head;}
+
+    private:
+        iq_framer(const iq_framer &) = delete;
+        iq_framer &operator=(const iq_framer &) = delete;
+
+        void complete_frame(uint64_t dropped_samples);
+
+        size_t _length;
+        size_t _hop;
+        std::vector<iq_framer_frame_t> _ring;
+
+        // Frames [_head, _tail) (modulo the ring size) are finished;
+        // frame _tail is being filled, and has _fill samples.
+        size_t _head;
+        size_t _tail;
+        size_t _fill;
+        // Samples still to be skipped before the next frame, when the
+        // hop exceeds the length.
+        size_t _skip;
+        uint64_t _sequence;
+
+        // Stream index of the next sample added, and the last clock
+        // given to set_clock(), with the ns per sample between it and
+        // the one before.
+        uint64_t _index;
+        uint64_t _clock_index;
+        uint64_t _clock_timestamp;
+        double _ns_per_sample;
+    };
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*******************************************************************
+ *  iq_replay_component.cc - Replays a recorded IQ file as a source.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "iq_replay_component.h"
+#include "sdrm_config.h"
+#include "sigmf_writer.h"
+#include "trace.h"
+#include "matrix/log_t.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+using namespace matrix;
+
+static matrix::log_t logger("IQReplayComponent");
+
+Component *IQReplayComponent::factory(std::string name, std::string km_url)
+{
+    return new IQReplayComponent(name, km_url);
+}
+
+IQReplayComponent::IQReplayComponent(std::string name,
+                                     std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &IQReplayComponent::sending_task),
+    iq_signal_source(keymaster_url, name, "iq_data"),
+    _samples(NULL),
+    _sample_count(0),
+    _map_size(0),
+    _map(NULL),
+    _sample_rate(0.0),
+    _first_index(0),
+    _first_timestamp(0),
+    _stat_published(_stats.counter("published")),
+    _stat_bytes(_stats.counter("published_bytes")),
+    _stat_samples(_stats.counter("samples")),
+    _stat_loops(_stats.counter("loops")),
+    _stat_late(_stats.counter("late")),
+    _stat_publish(_stats.histogram("publish_time"))
+{
+}
+
+IQReplayComponent::~IQReplayComponent()
+{
+    unmap_file();
+}
+
+bool IQReplayComponent::_do_start()
+{
+    if (not map_file())
+    {
+        return false;
+    }
+
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("IQReplay _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (!rval)
+    {
+        logger.error(__PRETTY_FUNCTION__, "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        unmap_file();
+    }
+
+    return rval;
+}
+
+bool IQReplayComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    unmap_file();
+    return true;
+}
+
+/**
+ * Maps the configured file, and reads its SigMF metadata if it has
+ * any. The kernel is told the mapping will be read sequentially, so
+ * it reads ahead aggressively and drops pages behind.
+ *
+ * @return false if the file can't be used.
+ *
+ */
+
+bool IQReplayComponent::map_file()
+{
+    string base = my_full_instance_name + ".";
+    string path = sdrm::get_config<string>(keymaster, base + "file", "");
+    string meta_path;
+    sdrm::sigmf_meta_t meta;
+
+    _sample_rate = sdrm::get_config<double>(keymaster, base + "sample_rate",
+                                            768000.0);
+    _first_index = 0;
+    _first_timestamp = 0;
+    _captures.clear();
+
+    for (string ext : {".sigmf-data", ".sigmf-meta"})
+    {
+        if (path.size() > ext.size()
+            and path.compare(path.size() - ext.size(), ext.size(), ext) == 0)
+        {
+            string stem = path.substr(0, path.size() - ext.size());
+            path = stem + ".sigmf-data";
+            meta_path = stem + ".sigmf-meta";
+        }
+    }
+
+    if (not meta_path.empty() and access(meta_path.c_str(), R_OK) == 0)
+    {
+        if (not sdrm::read_sigmf_meta(meta_path, meta))
+        {
+            return false;
+        }
+
+        if (meta.datatype != "cf32_le")
+        {
+            logger.error(__PRETTY_FUNCTION__, path, "is", meta.datatype,
+                         "; only cf32_le can be replayed");
+            return false;
+        }
+
+        if (meta.sample_rate > 0.0)
+        {
+            _sample_rate = meta.sample_rate;
+        }
+
+        if (not meta.captures.empty())
+        {
+            _first_index = meta.captures[0].global_index;
+            _first_timestamp = meta.captures[0].datetime;
+            _captures = meta.captures;
+        }
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 or fstat(fd, &st) < 0)
+    {
+        logger.error(__PRETTY_FUNCTION__, "can't open", path, ":",
+                     strerror(errno));
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    _sample_count = st.st_size / sizeof(sdrm::complex_float_t);
+
+    if (_sample_count == 0)
+    {
+        logger.error(__PRETTY_FUNCTION__, path, "holds no samples");
+        close(fd);
+        return false;
+    }
+
+    _map_size = _sample_count * sizeof(sdrm::complex_float_t);
+    _map = mmap(NULL, _map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open.
+    close(fd);
+
+    if (_map == MAP_FAILED)
+    {
+        logger.error(__PRETTY_FUNCTION__, "can't map", path, ":",
+                     strerror(errno));
+        _map = NULL;
+        return false;
+    }
+
+    madvise(_map, _map_size, MADV_SEQUENTIAL);
+    _samples = (const sdrm::complex_float_t *)_map;
+
+    logger.info(__PRETTY_FUNCTION__, "replaying", path, ":", _sample_count,
+                "samples at", _sample_rate, "S/s");
+    return true;
+}
+
+void IQReplayComponent::unmap_file()
+{
+    if (_map)
+    {
+        munmap(_map, _map_size);
+        _map = NULL;
+        _samples = NULL;
+        _sample_count = 0;
+    }
+}
+
+/**
+ * Writes the component's statistics to "STATS.<name>":
+ *
+ *   published, published_bytes, samples
+ *   loops:          times the file was started over
+ *   late:           messages sent late because publishing fell behind
+ *                   the configured speed; the schedule is then reset
+ *   publish_time:   time to pack and publish a message
+ *
+ */
+
+void IQReplayComponent::report_stats()
+{
+    YAML::Node stats;
+    _stats.report(stats);
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
+
+/**
+ * Publishes the file, a buffer at a time, until stopped. When paced,
+ * buffers go out on absolute deadlines, as from a radio; a deadline
+ * already missed by a whole buffer moves the schedule on rather than
+ * sending a burst to catch up.
+ *
+ */
+
+void IQReplayComponent::sending_task()
+{
+    using clock = chrono::steady_clock;
+
+    string base = my_full_instance_name + ".";
+    auto buffer_size = sdrm::get_config<size_t>(keymaster, base + "buffer_size",
+                                                2048);
+    auto speed = sdrm::get_config<double>(keymaster, base + "speed", 1.0);
+    auto loop = sdrm::get_config<bool>(keymaster, base + "loop", true);
+    auto wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(keymaster, base + "wire_format", "msgpack"));
+    auto sample_format = sdrm::sample_format_from_string(
+        sdrm::get_config<string>(keymaster, base + "sample_format", "cf32"));
+    auto stats_interval = sdrm::get_config<double>(
+        keymaster, base + "stats_interval_ms", 1000.0) * 1000000;
+
+    msgpack::sbuffer outbuf;
+    bool paced = speed > 0.0;
+    auto deadline = clock::now();
+    uint64_t anchor = _first_timestamp ? _first_timestamp : Time::getUTC();
+    uint64_t sequence = 0;
+    uint64_t published = 0;
+    size_t pos = 0;
+    // The capture segment `pos` is in, and the tuning it is sent with.
+    size_t capture = 0;
+    sdrm::tuning_t tuning;
+
+    tuning.samplerate = _sample_rate;
+    tuning.frequency = _captures.empty() ? 0 : _captures[0].frequency;
+
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    while (_run.load())
+    {
+        if (_stats.due(stats_interval))
+        {
+            report_stats();
+        }
+
+        if (pos == _sample_count)
+        {
+            if (not loop)
+            {
+                Time::thread_delay(100000000L);
+                continue;
+            }
+
+            pos = 0;
+            _stat_loops.add();
+        }
+
+        size_t n = min(buffer_size, _sample_count - pos);
+        size_t segment = capture;
+
+        if (pos == 0)
+        {
+            segment = 0;
+        }
+
+        while (segment + 1 < _captures.size()
+               and _captures[segment + 1].sample_start <= pos)
+        {
+            ++segment;
+        }
+
+        if (segment != capture)
+        {
+            capture = segment;
+            tuning.frequency = _captures[capture].frequency;
+            ++tuning.epoch;
+        }
+
+        if (capture + 1 < _captures.size())
+        {
+            n = min(n, (size_t)(_captures[capture + 1].sample_start - pos));
+        }
+
+        // A buffer is sent once its samples would have been received;
+        // it may be short, at the end of a capture segment or of the
+        // file.
+        if (paced)
+        {
+            auto period = chrono::duration_cast<clock::duration>(
+                chrono::duration<double>(n / (_sample_rate * speed)));
+            deadline += period;
+
+            if (clock::now() > deadline + period)
+            {
+                _stat_late.add();
+                deadline = clock::now();
+            }
+
+            this_thread::sleep_until(deadline);
+        }
+
+        sdrm::trace_span span("replay.publish", sequence);
+        uint64_t start = sdrm::stats_now();
+        sdrm::pack_iq_frame(outbuf, wire_format, sequence, 0, _samples + pos,
+                            n, 1, _first_index + published,
+                            sdrm::sample_timestamp(anchor, published,
+                                                   (uint32_t)_sample_rate),
+                            sample_format, tuning);
+        iq_signal_source.publish(outbuf);
+        _stat_publish.record(sdrm::stats_now() - start);
+        _stat_published.add();
+        _stat_bytes.add(outbuf.size());
+        _stat_samples.add(n);
+
+        pos += n;
+        published += n;
+        ++sequence;
+    }
+}
@@ -0,0 +1,113 @@
+/*******************************************************************
+ *  iq_replay_component.h - Replays a recorded IQ file as a source.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_IQ_REPLAY_COMPONENT_H_)
+#define _IQ_REPLAY_COMPONENT_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "sigmf_writer.h"
+#include "stats.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/**
+ * \class IQReplayComponent
+ *
+ * Publishes the samples of a recorded cf32 file on "iq_data", in the
+ * same messages AirspyComponent publishes, so that it can stand in
+ * for the radio in a configuration's `connections:`. The file is
+ * either a SigMF recording (as RecorderComponent writes), whose
+ * .sigmf-meta gives the samplerate and the time and stream index of
+ * the first sample, or raw interleaved float32 I, Q. The file is
+ * memory mapped, and each message is packed straight from the
+ * mapping. Configuration:
+ *
+ *   file: /data/iq_20190704T120000Z_000.sigmf-data
+ *   sample_rate: 768000      # if there is no .sigmf-meta
+ *   buffer_size: 2048        # samples per message
+ *   speed: 1.0               # 1: real time; N: N x real time;
+ *                            # 0: as fast as the pipeline takes them
+ *   loop: true               # start over at the end of the file
+ *   wire_format: msgpack     # or raw; see AirspyComponent
+ *   sample_format: cf32      # raw only: or ci16, cf16, at half the size
+ *   stats_interval_ms: 1000  # telemetry to STATS.<name>; 0: off
+ *
+ * The stream index of each message counts on through loops, so a
+ * looped file looks like one long stream. Timestamps follow from the
+ * recording's start time if known, otherwise from the time of start.
+ * The messages are tagged (see iq_frame_header_t) with the samplerate,
+ * and with the frequency of the recording's capture segment they are
+ * from; a message never spans two segments, and each new segment is
+ * a new tune epoch, as though the radio had been retuned.
+ *
+ */
+
+class IQReplayComponent : public matrix::Component
+{
+public:
+
+    virtual ~IQReplayComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    IQReplayComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool map_file();
+    void unmap_file();
+    void report_stats();
+    void sending_task();
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<IQReplayComponent> _run_thread;
+    matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+
+    // The mapped file's samples.
+    const sdrm::complex_float_t *_samples;
+    size_t _sample_count;
+    size_t _map_size;
+    void *_map;
+    double _sample_rate;
+    uint64_t _first_index;
+    uint64_t _first_timestamp;
+    std::vector<sdrm::sigmf_capture_t> _captures;
+
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_published;
+    sdrm::stats_counter &_stat_bytes;
+    sdrm::stats_counter &_stat_samples;
+    sdrm::stats_counter &_stat_loops;
+    sdrm::stats_counter &_stat_late;
+    sdrm::stats_histogram &_stat_publish;
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*******************************************************************
+ *  ordered_pool.h - A pool of worker threads whose results are
+ *  delivered in the order the work was submitted.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_ORDERED_POOL_H_)
+#define _ORDERED_POOL_H_
+
+#include "matrix/Thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    /**
+     * \class ordered_pool
+     *
+     * Runs jobs on `workers` threads and hands the finished jobs, one
+     * at a time and strictly in submission order, to a `deliver`
+     * callback; so work on a stream may be spread over several cores
+     * while its output stays in sequence.
+     *
+     * The pool owns `jobs` objects of type J, which must be default
+     * constructible; a producer gets a free one with acquire(), fills
+     * it in and hands it back with submit(). Once a job is delivered
+     * it is free again, along with whatever buffers it has grown, so
+     * in the steady state nothing is allocated. When all jobs are in
+     * flight acquire() blocks, throttling the producer to the speed
+     * of the workers.
+     *
+     * Submitted jobs are dealt round robin to per-worker queues; a
+     * worker whose queue is empty steals from the others. Both take
+     * the oldest job first, as it is the one delivery is waiting for.
+     *
+     * There must be only one producer thread. `work` is called on the
+     * worker threads, with the worker's index (0 to workers - 1), so
+     * that it can keep per-worker state; `deliver` is called on a
+     * worker thread too, but never on two at once.
+     *
+     */
+
+    template <typename J>
+    class ordered_pool
+    {
+    public:
+        typedef std::function<void (J &job, size_t worker)> work_t;
+        typedef std::function<void (J &job)> deliver_t;
+
+        ordered_pool(size_t workers, size_t jobs, work_t work, deliver_t deliver)
+            : _work(work),
+              _deliver(deliver),
+              _queued(0),
+              _order(std::max(jobs, workers)),
+              _submitted(0),
+              _delivered(0),
+              _next_queue(0),
+              _worker_ids(0),
+              _stop(false)
+        {
+            for (size_t i = 0; i < _order.size(); ++i)
+            {
+                _slots.emplace_back(new slot_t());
+                _free.push_back(_slots.back().get());
+            }
+
+            for (size_t i = 0; i < workers; ++i)
+            {
+                _queues.emplace_back(new queue_t());
+            }
+
+            for (size_t i = 0; i < workers; ++i)
+            {
+                _threads.emplace_back(
+                    new matrix::Thread<ordered_pool>(this, &ordered_pool::worker));
+                _threads.back()->start("ordered_pool worker " + std::to_string(i));
+            }
+        }
+
+        /**
+         * Stops the workers. Jobs not yet delivered are abandoned; call
+         * drain() first to finish them.
+         *
+         */
+
+        ~ordered_pool()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _stop = true;
+            }
+
+            _work_cv.notify_all();
+
+            for (auto &t : _threads)
+            {
+                t->join();
+            }
+        }
+
+        /**
+         * Gets a free job, waiting for one to be delivered if all are
+         * in flight.
+         *
+         * @return The job, to be filled in and passed to submit().
+         *
+         */
+
+        J *acquire()
+        {
+            std::unique_lock<std::mutex> l(_mutex);
+            _free_cv.wait(l, [this] {return not _free.empty();});
+            slot_t *s = _free.back();
+            _free.pop_back();
+            return s;
+        }
+
+        /**
+         * Queues a job obtained from acquire() for the workers.
+         *
+         * @param job: The job.
+         *
+         */
+
+        void submit(J *job)
+        {
+            slot_t *s = static_cast<slot_t *>(job);
+
+            {
+                std::lock_guard<std::mutex> l(_deliver_mutex);
+                s->done = false;
+                _order[_submitted % _order.size()] = s;
+                ++_submitted;
+            }
+
+            // Counted before it is queued, so that a worker that finds
+            // the count zero really has nothing to do.
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                ++_queued;
+            }
+
+            queue_t &q = *_queues[_next_queue++ % _queues.size()];
+
+            {
+                std::lock_guard<std::mutex> l(q.mutex);
+                q.jobs.push_back(s);
+            }
+
+            _work_cv.notify_one();
+        }
+
+        /**
+         * Waits until every submitted job has been delivered.
+         *
+         */
+
+        void drain()
+        {
+            std::unique_lock<std::mutex> l(_deliver_mutex);
+            _drained_cv.wait(l, [this] {return _delivered == _submitted;});
+        }
+
+        size_t workers() const
+        {
+            return _threads.size();
+        }
+
+    private:
+        struct slot_t : public J
+        {
+            bool done{false};
+        };
+
+        struct queue_t
+        {
+            std::mutex mutex;
+            std::deque<slot_t *> jobs;
+        };
+
+        /**
+         * Takes the oldest job from worker `me`'s queue or, if that is
+         * empty, from the first other queue that isn't.
+         *
+         */
+
+        slot_t *take(size_t me)
+        {
+            for (size_t i = 0; i < _queues.size(); ++i)
+            {
+                queue_t &q = *_queues[(me + i) % _queues.size()];
+                std::lock_guard<std::mutex> l(q.mutex);
+
+                if (not q.jobs.empty())
+                {
+                    slot_t *s = q.jobs.front();
+                    q.jobs.pop_front();
+                    return s;
+                }
+            }
+
+            return NULL;
+        }
+
+        void worker()
+        {
+            size_t me = _worker_ids++;
+
+            while (true)
+            {
+                slot_t *s = take(me);
+
+                if (s == NULL)
+                {
+                    std::unique_lock<std::mutex> l(_mutex);
+
+                    if (_stop)
+                    {
+                        return;
+                    }
+
+                    _work_cv.wait(l, [this] {return _stop or _queued > 0;});
+                    continue;
+                }
+
+                {
+                    std::lock_guard<std::mutex> l(_mutex);
+                    --_queued;
+                }
+
+                _work(*s, me);
+                finish(s);
+            }
+        }
+
+        /**
+         * Marks a job done, then delivers it and any jobs after it that
+         * were done already, as long as they are next in order.
+         *
+         */
+
+        void finish(slot_t *s)
+        {
+            std::lock_guard<std::mutex> l(_deliver_mutex);
+            s->done = true;
+
+            while (_delivered < _submitted)
+            {
+                slot_t *next = _order[_delivered % _order.size()];
+
+                if (not next->done)
+                {
+                    break;
+                }
+
+                _deliver(*next);
+                ++_delivered;
+
+                {
+                    std::lock_guard<std::mutex> fl(_mutex);
+                    _free.push_back(next);
+                }
+
+                _free_cv.notify_one();
+            }
+
+            _drained_cv.notify_all();
+        }
+
+        work_t _work;
+        deliver_t _deliver;
+
+        std::vector<std::unique_ptr<slot_t>> _slots;
+        std::vector<std::unique_ptr<queue_t>> _queues;
+        std::vector<std::unique_ptr<matrix::Thread<ordered_pool>>> _threads;
+
+        // _free, _queued and _stop are guarded by _mutex.
+        std::mutex _mutex;
+        std::condition_variable _work_cv;
+        std::condition_variable _free_cv;
+        std::vector<slot_t *> _free;
+        size_t _queued;
+
+        // The jobs in flight, by submission number modulo their
+        // count, and the delivery position; guarded by
+        // _deliver_mutex. At most _order.size() jobs are in flight, so
+        // the entries never collide.
+        std::mutex _deliver_mutex;
+        std::condition_variable _drained_cv;
+        std::vector<slot_t *> _order;
+        uint64_t _submitted;
+        uint64_t _delivered;
+
+        size_t _next_queue;
+        std::atomic<size_t> _worker_ids;
+        bool _stop;
+    };
+}
+
+#endif
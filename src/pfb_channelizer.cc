@@ -0,0 +1,219 @@
+/*******************************************************************
+ *  pfb_channelizer.cc - Polyphase filter bank channelizer.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "pfb_channelizer.h"
+#include "welch_psd.h"
+#include "simd_kernels.h"
+#include "fftwp.h"
+
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+namespace sdrm
+{
+    /**
+     * Designs a linear phase lowpass FIR filter by the window method,
+     * normalized to unity gain at DC.
+     *
+     * @param taps: The filter length.
+     *
+     * @param cutoff: The -6 dB frequency, as a fraction of the sample
+     * rate (0 to 0.5).
+     *
+     * @param window: The window; see make_window().
+     *
+     * @return The `taps` coefficients.
+     *
+     */
+
+    vector<float> design_lowpass(size_t taps, double cutoff, string window)
+    {
+        // make_window() gives periodic windows; the symmetric window of
+        // `taps` points is the periodic one of taps - 1, plus an end
+        // point equal to the first.
+        vector<float> w = make_window(window, max(taps, (size_t)2) - 1);
+        w.push_back(w[0]);
+        w.resize(taps);
+
+        vector<float> h(taps);
+        double center = (taps - 1) / 2.0;
+        double sum = 0.0;
+
+        for (size_t i = 0; i < taps; ++i)
+        {
+            double t = (i - center) * 2.0 * cutoff;
+            double sinc = t == 0.0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+            h[i] = sinc * w[i];
+            sum += h[i];
+        }
+
+        for (auto &c : h)
+        {
+            c /= sum;
+        }
+
+        return h;
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param channels: The number of channels. Must be even if
+     * oversampled.
+     *
+     * @param taps_per_channel: The prototype filter length, divided by
+     * `channels`. More taps give flatter channels with sharper edges;
+     * 8 to 16 is usual.
+     *
+     * @param oversample: 1 for critically sampled output, 2 for 2x
+     * oversampled.
+     *
+     * @param window: The window used to design the prototype filter.
+     *
+     */
+
+    pfb_channelizer::pfb_channelizer(size_t channels, size_t taps_per_channel,
+                                     size_t oversample, string window)
+        : _channels(channels),
+          _taps(channels * taps_per_channel),
+          _decimation(oversample == 2 ? channels / 2 : channels),
+          _filter(design_lowpass(channels * taps_per_channel,
+                                 0.5 / channels, window)),
+          _framer(max(_taps, (size_t)1), max(_decimation, (size_t)1)),
+          _phase(0),
+          _folded(channels)
+    {
+        if (channels < 2 || taps_per_channel == 0)
+        {
+            throw invalid_argument("pfb_channelizer: need at least 2 channels "
+                                   "and 1 tap per channel");
+        }
+
+        if (oversample != 1 && (oversample != 2 || channels % 2))
+        {
+            throw invalid_argument("pfb_channelizer: oversample must be 1, "
+                                   "or 2 with an even number of channels");
+        }
+
+        reverse(_filter.begin(), _filter.end());
+    }
+
+    /**
+     * Channelizes the next samples of the stream.
+     *
+     * @param samples: The next `n` input samples.
+     *
+     * @param n: The number of samples.
+     *
+     * @param out: Receives the output, channel by channel: all the
+     * output samples of channel 0, then of channel 1, and so on.
+     * Resized as needed, so reuse it to avoid allocation.
+     *
+     * @return The number of output samples per channel, which may be
+     * 0 when `n` is less than the decimation.
+     *
+     */
+
+    size_t pfb_channelizer::process(const complex_float_t *samples, size_t n,
+                                    vector<complex_float_t> &out)
+    {
+        size_t M = _channels;
+        size_t steps = 0;
+        size_t used = 0;
+
+        _spectra.resize(M * (n / _decimation + 1));
+
+        while (used < n)
+        {
+            used += _framer.add(samples + used, n - used);
+
+            for (auto f = _framer.front(); f; f = _framer.front())
+            {
+                if (M * (steps + 1) > _spectra.size())
+                {
+                    _spectra.resize(M * (steps + 1));
+                }
+
+                // Weight and fold: folded[q] = sum over p of
+                // frame[q + pM] * filter[q + pM].
+                fill(_folded.begin(), _folded.end(), complex_float_t{0.0, 0.0});
+
+                for (size_t p = 0; p < _taps; p += M)
+                {
+                    multiply_accumulate(f->samples + p, _filter.data() + p,
+                                        _folded.data(), M);
+                }
+
+                // Put the newest sample's branch where the inverse FFT
+                // gives each channel the phase of a mixer running since
+                // sample 0. With the frame's last sample at absolute
+                // index t, element s is folded[M - 1 - (s + t) mod M].
+                size_t t = (_phase + _taps - 1) % M;
+                complex_float_t *v = &_spectra[M * steps];
+
+                for (size_t s = 0; s < M; ++s)
+                {
+                    v[s] = _folded[M - 1 - (s + t) % M];
+                }
+
+                _phase = (_phase + _decimation) % M;
+                ++steps;
+                _framer.pop();
+            }
+        }
+
+        if (steps == 0)
+        {
+            return 0;
+        }
+
+        // One inverse FFT per output instant, all at once, in place.
+        batched_dfft(_spectra.data(), _spectra.data(), M, steps, FFT_BACKWARD);
+
+        // Transpose to channel-major.
+        out.resize(M * steps);
+
+        for (size_t s = 0; s < steps; ++s)
+        {
+            for (size_t k = 0; k < M; ++k)
+            {
+                out[k * steps + s] = _spectra[s * M + k];
+            }
+        }
+
+        return steps;
+    }
+
+    /**
+     * Restarts the filter, e.g. after a gap in the input. Output
+     * resumes once a full filter length of new samples has arrived.
+     *
+     */
+
+    void pfb_channelizer::reset()
+    {
+        _framer.reset();
+        _phase = 0;
+    }
+}
@@ -0,0 +1,93 @@
+/*******************************************************************
+ *  pfb_channelizer.h - Polyphase filter bank channelizer.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_PFB_CHANNELIZER_H_)
+#define _PFB_CHANNELIZER_H_
+
+#include "sdrm_types.h"
+#include "iq_framer.h"
+
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    std::vector<float> design_lowpass(size_t taps, double cutoff,
+                                      std::string window);
+
+    /**
+     * \class pfb_channelizer
+     *
+     * Splits a complex stream sampled at fs into `channels` equally
+     * spaced channels. Channel k is centered on k * fs / channels
+     * (channels above channels / 2 being negative frequencies), is
+     * fs / channels wide, and is decimated by `channels` (critically
+     * sampled) or by channels / 2 (2x oversampled, so that signals
+     * near a channel edge aren't aliased).
+     *
+     * The prototype filter is a windowed sinc of `taps_per_channel`
+     * * `channels` taps with unity gain at DC, so a tone at a channel
+     * center comes out of that channel at its input amplitude.
+     *
+     * It is computed by weighted overlap-add: at each output instant
+     * the last channels * taps_per_channel input samples are weighted
+     * by the prototype, folded to `channels` samples, rotated to keep
+     * each channel's phase continuous, and inverse-transformed, all
+     * the output instants of an input buffer in one batched FFT. The
+     * input windows are cut by an iq_framer (length channels *
+     * taps_per_channel, hop the decimation), so buffers may be of any
+     * size.
+     *
+     */
+
+    class pfb_channelizer
+    {
+    public:
+        pfb_channelizer(size_t channels, size_t taps_per_channel,
+                        size_t oversample = 1,
+                        std::string window = "blackman-harris");
+
+        size_t process(const complex_float_t *samples, size_t n,
+                       std::vector<complex_float_t> &out);
+        void reset();
+
+        size_t channels() const {return _channels;}
+        size_t decimation() const {return _decimation;}
+
+    private:
+        size_t _channels;
+        size_t _taps;
+        size_t _decimation;
+
+        // The prototype filter, time reversed so that it lines up with
+        // a frame of input (oldest sample first).
+        std::vector<float> _filter;
+        iq_framer _framer;
+        // Input samples seen, modulo `channels`, as of the start of
+        // the current frame; gives the phase rotation.
+        size_t _phase;
+
+        std::vector<complex_float_t> _folded;
+        std::vector<complex_float_t> _spectra;
+    };
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*******************************************************************
+ *  pfb_component.cc - Splits the incoming IQ stream into channels
+ *  with a polyphase filter bank, and publishes them.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "pfb_component.h"
+#include "sdrm_config.h"
+#include "matrix/log_t.h"
+#include <memory>
+#include <stdexcept>
+#include <matrix/matrix_util.h>
+
+using namespace std;
+using namespace matrix;
+using namespace mxutils;
+
+static matrix::log_t logger("PFBComponent");
+
+Component *PFBComponent::factory(std::string name, std::string km_url)
+{
+    return new PFBComponent(name, km_url);
+}
+
+PFBComponent::PFBComponent(std::string name, std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &PFBComponent::receiving_task),
+    iq_signal_source(keymaster_url, name, "iq_data")
+{
+    _wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(
+            keymaster, my_full_instance_name + ".wire_format", "msgpack"));
+}
+
+PFBComponent::~PFBComponent()
+{
+}
+
+/**
+ * Creates the channelizer from the component's configuration. Done
+ * on each start, so changes to the configuration take effect then.
+ *
+ * @return false if the configuration is invalid.
+ *
+ */
+
+bool PFBComponent::setup_channelizer()
+{
+    string base = my_full_instance_name + ".";
+    size_t channels = sdrm::get_config<size_t>(keymaster, base + "channels", 64);
+    size_t taps = sdrm::get_config<size_t>(keymaster, base + "taps_per_channel", 12);
+    size_t oversample = sdrm::get_config<size_t>(keymaster, base + "oversample", 1);
+    string window = sdrm::get_config<string>(keymaster, base + "window",
+                                             "blackman-harris");
+
+    try
+    {
+        _pfb.reset(new sdrm::pfb_channelizer(channels, taps, oversample, window));
+    }
+    catch (invalid_argument &e)
+    {
+        logger.error(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+
+    logger.info(__PRETTY_FUNCTION__, "channels =", channels,
+                "taps_per_channel =", taps, "decimation =", _pfb->decimation());
+    return true;
+}
+
+bool PFBComponent::_do_start()
+{
+    if (not setup_channelizer())
+    {
+        return false;
+    }
+
+    connect();
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("PFB _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (rval)
+    {
+        logger.info(__PRETTY_FUNCTION__, "_run_thread started.");
+    }
+    else
+    {
+        logger.error(__PRETTY_FUNCTION__,
+                     "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        disconnect();
+    }
+
+    return rval;
+}
+
+bool PFBComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    disconnect();
+    return true;
+}
+
+bool PFBComponent::connect()
+{
+    input_signal_sink.reset(
+        new matrix::DataSink<std::string,
+                            matrix::select_only>(keymaster_url, 10));
+    connect_sink(*input_signal_sink, "input_data");
+    return true;
+}
+
+bool PFBComponent::disconnect()
+{
+    input_signal_sink->disconnect();
+    input_signal_sink.reset();
+    return true;
+}
+
+/**
+ * Channelizes each received buffer and publishes the result, with
+ * the input's sequence number, sample index and timestamp. If the
+ * source reports newly dropped samples the filter is restarted, so
+ * that no output mixes samples from either side of the gap.
+ *
+ */
+
+void PFBComponent::receiving_task()
+{
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    sdrm::iq_frame_reader reader;
+    uint64_t dropped = 0;
+
+    while (_run.load())
+    {
+        string inbuf;
+
+        if (not input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
+        {
+            continue;
+        }
+
+        if (not reader.parse(inbuf) or reader.sample_format() != sdrm::SAMPLE_CF32)
+        {
+            logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+            continue;
+        }
+
+        if (reader.dropped_samples() != dropped)
+        {
+            _pfb->reset();
+            dropped = reader.dropped_samples();
+        }
+
+        size_t n = _pfb->process(reader.samples(), reader.sample_count(),
+                                 _channel_data);
+
+        if (n > 0)
+        {
+            sdrm::tuning_t tuning = reader.tuning();
+
+            tuning.samplerate /= _pfb->decimation();
+            sdrm::pack_iq_frame(_outbuf, _wire_format, reader.sequence(),
+                                reader.dropped_samples(), _channel_data.data(),
+                                n * _pfb->channels(), _pfb->channels(),
+                                reader.sample_index(), reader.timestamp(),
+                                sdrm::SAMPLE_CF32, tuning);
+            iq_signal_source.publish(_outbuf);
+        }
+    }
+}
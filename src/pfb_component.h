@@ -0,0 +1,88 @@
+/*******************************************************************
+ *  pfb_component.h - Splits the incoming IQ stream into channels
+ *  with a polyphase filter bank, and publishes them.
+ *
+ *  Copyright (C) 2019 Ramon Creager.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined _PFB_COMPONENT_H_
+#define _PFB_COMPONENT_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "pfb_channelizer.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * \class PFBComponent
+ *
+ * Channelizes the IQ data received on "input_data" and publishes it on
+ * "iq_data": one message per input buffer, holding that buffer's worth
+ * of output for every channel, channel by channel (frame_count is the
+ * number of channels). The output's tuning is the input's, at the
+ * channels' samplerate; its frequency stays the input's center, from
+ * which channel k is offset as below. Configuration:
+ *
+ *   channels: 64             # channel k is centered on k * fs / channels
+ *   taps_per_channel: 12
+ *   oversample: 1            # 1: critically sampled; 2: 2x oversampled
+ *   window: blackman-harris  # for the prototype filter design
+ *   wire_format: msgpack     # or raw
+ *
+ */
+
+class PFBComponent : public matrix::Component
+{
+public:
+
+    virtual ~PFBComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    PFBComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool connect();
+    bool disconnect();
+    bool setup_channelizer();
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<PFBComponent> _run_thread;
+    std::unique_ptr<matrix::DataSink<std::string,
+                                     matrix::select_only>> input_signal_sink;
+    matrix::DataSource<msgpack::sbuffer> iq_signal_source;
+    sdrm::wire_format_t _wire_format;
+
+    std::unique_ptr<sdrm::pfb_channelizer> _pfb;
+    std::vector<sdrm::complex_float_t> _channel_data;
+    msgpack::sbuffer _outbuf;
+
+    void receiving_task();
+};
+
+#endif
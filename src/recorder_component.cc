@@ -0,0 +1,690 @@
+/*******************************************************************
+ *  recorder_component.cc - Records a sample stream to SigMF files.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "recorder_component.h"
+#include "sdrm_config.h"
+#include "trace.h"
+#include "matrix/log_t.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <time.h>
+
+using namespace std;
+using namespace matrix;
+
+static matrix::log_t logger("RecorderComponent");
+
+Component *RecorderComponent::factory(std::string name, std::string km_url)
+{
+    return new RecorderComponent(name, km_url);
+}
+
+RecorderComponent::RecorderComponent(std::string name, std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &RecorderComponent::receiving_task),
+    _io_run(false),
+    _io_thread(this, &RecorderComponent::writing_task),
+    _block(NULL),
+    _stat_received(_stats.counter("received")),
+    _stat_samples(_stats.counter("samples")),
+    _stat_dropped(_stats.counter("dropped_samples")),
+    _stat_gaps(_stats.counter("gaps")),
+    _stat_bytes(_stats.counter("bytes_written")),
+    _stat_files(_stats.counter("files")),
+    _stat_errors(_stats.counter("write_errors")),
+    _stat_queue(_stats.gauge("write_queue")),
+    _stat_write(_stats.histogram("write_time"))
+{
+}
+
+RecorderComponent::~RecorderComponent()
+{
+}
+
+/**
+ * Reads the configuration and allocates the blocks. Done on each
+ * start, so changes to the configuration take effect then.
+ *
+ * @return false if the configuration is invalid.
+ *
+ */
+
+bool RecorderComponent::setup()
+{
+    string base = my_full_instance_name + ".";
+    _directory = sdrm::get_config<string>(keymaster, base + "directory", ".");
+    _file_prefix = sdrm::get_config<string>(keymaster, base + "file_prefix",
+                                            my_instance_name);
+    _sample_rate = sdrm::get_config<double>(keymaster, base + "sample_rate",
+                                            768000.0);
+    _frequency = sdrm::get_config<double>(keymaster, base + "frequency", 0.0);
+    _description = sdrm::get_config<string>(keymaster, base + "description", "");
+    _hw = sdrm::get_config<string>(keymaster, base + "hw", "AirspyHF+");
+    _direct_io = sdrm::get_config<bool>(keymaster, base + "direct_io", true);
+    _max_file_bytes = sdrm::get_config<double>(keymaster, base + "max_file_mb", 0.0)
+        * 1048576;
+    _max_file_time = sdrm::get_config<double>(keymaster, base + "max_file_s", 0.0)
+        * 1000000000;
+    _stats_interval = sdrm::get_config<double>(
+        keymaster, base + "stats_interval_ms", 1000.0) * 1000000;
+
+    size_t block_kb = sdrm::get_config<size_t>(keymaster, base + "block_kb", 4096);
+    size_t blocks = sdrm::get_config<size_t>(keymaster, base + "blocks", 8);
+
+    // Whole multiples of the O_DIRECT alignment, which also holds a
+    // whole number of samples of either size.
+    _block_size = block_kb * 1024;
+    _block_size -= _block_size % sdrm::direct_file::ALIGNMENT;
+
+    if (_block_size == 0 or blocks < 2)
+    {
+        logger.error(__PRETTY_FUNCTION__, "block_kb must be at least 4,",
+                     "and blocks at least 2");
+        return false;
+    }
+
+    _storage.clear();
+    _blocks.assign(blocks, block_t {NULL, 0});
+    _free.reset(new sdrm::spsc_ring<block_t *>(blocks));
+    // Room for every block, and for the close requests of a few
+    // files on top; any more wait in _pending.
+    _requests.reset(new sdrm::spsc_ring<io_request_t>(blocks + 16));
+
+    for (auto &b : _blocks)
+    {
+        void *p = NULL;
+
+        if (posix_memalign(&p, sdrm::direct_file::ALIGNMENT, _block_size))
+        {
+            logger.error(__PRETTY_FUNCTION__, "can't allocate", blocks,
+                         "blocks of", _block_size, "bytes");
+            _storage.clear();
+            return false;
+        }
+
+        _storage.emplace_back((char *)p, free);
+        b.data = (char *)p;
+        _free->push(&b);
+    }
+
+    _pending.clear();
+    _block = NULL;
+    _recording.reset();
+    _file_number = 0;
+    _next_index = 0;
+    _next_sequence = 0;
+    _last_index = 0;
+    _last_count = 0;
+    _indexed = false;
+    _last_dropped = 0;
+    _overrun = 0;
+    _epoch = 0;
+
+    logger.info(__PRETTY_FUNCTION__, "recording to", _directory,
+                "blocks =", blocks, "x", _block_size,
+                "max_file_mb =", _max_file_bytes / 1048576.0,
+                "max_file_s =", _max_file_time / 1e9);
+    return true;
+}
+
+bool RecorderComponent::_do_start()
+{
+    if (not setup())
+    {
+        return false;
+    }
+
+    connect();
+    _io_run = true;
+
+    if (!_io_thread.running())
+    {
+        _io_thread.start("Recorder _io_thread");
+    }
+
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("Recorder _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (rval)
+    {
+        logger.info(__PRETTY_FUNCTION__, "_run_thread started.");
+    }
+    else
+    {
+        logger.error(__PRETTY_FUNCTION__,
+                     "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        _io_run = false;
+        _io_thread.join();
+        disconnect();
+    }
+
+    return rval;
+}
+
+/**
+ * Stops recording. The receiving thread closes the file in progress
+ * on its way out, and the I/O thread writes everything queued before
+ * it exits, so nothing received is lost.
+ *
+ */
+
+bool RecorderComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    _io_run = false;
+    _io_thread.join();
+    disconnect();
+    return true;
+}
+
+bool RecorderComponent::connect()
+{
+    input_signal_sink.reset(
+        new matrix::DataSink<std::string,
+                            matrix::select_only>(keymaster_url, 10));
+    connect_sink(*input_signal_sink, "input_data");
+    return true;
+}
+
+bool RecorderComponent::disconnect()
+{
+    input_signal_sink->disconnect();
+    input_signal_sink.reset();
+    return true;
+}
+
+/**
+ * Begins a new recording with the message in `reader`. Its name is
+ * the file prefix, the UTC time of its first sample (or, if the
+ * source doesn't say, of now) and a count of the files this run.
+ *
+ * @param reader: The first message.
+ *
+ * @param index: The stream index of its first sample.
+ *
+ */
+
+void RecorderComponent::start_file(const sdrm::iq_frame_reader &reader,
+                                   uint64_t index)
+{
+    time_t t = reader.timestamp() ? reader.timestamp() / 1000000000ULL
+        : time(NULL);
+    tm utc;
+    char stamp[32];
+    char number[16];
+
+    gmtime_r(&t, &utc);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &utc);
+    snprintf(number, sizeof(number), "%03u", _file_number++);
+
+    _recording = make_shared<recording_t>();
+    _recording->base = _directory + "/" + _file_prefix + "_" + stamp + "_"
+        + number;
+
+    sdrm::sigmf_meta_t &meta = _recording->meta;
+    meta.datatype = _datatype;
+    meta.sample_rate = sample_rate(reader.tuning());
+    meta.description = _description;
+    meta.hw = _hw;
+    meta.recorder = "sdrm RecorderComponent";
+    meta.captures.push_back({0, index, reader.timestamp(),
+                             frequency(reader.tuning())});
+
+    _file_samples = 0;
+    _file_start = sdrm::stats_now();
+}
+
+/**
+ * Hands the current recording's last samples to the I/O thread, and
+ * asks it to close the recording.
+ *
+ */
+
+void RecorderComponent::finish_file()
+{
+    if (not _recording)
+    {
+        return;
+    }
+
+    if (_block && _block->used > 0)
+    {
+        submit({_block, _recording, false});
+        _block = NULL;
+    }
+
+    submit({NULL, _recording, true});
+    _recording.reset();
+}
+
+/**
+ * @return The samplerate of samples with tuning `tuning`: theirs if
+ * they say, the configured one if not.
+ *
+ */
+
+double RecorderComponent::sample_rate(const sdrm::tuning_t &tuning) const
+{
+    return tuning.samplerate ? tuning.samplerate : _sample_rate;
+}
+
+/**
+ * @return The center frequency of samples with tuning `tuning`:
+ * theirs if they say; 0, unknown, if they are of a retune in
+ * progress; and the configured one if they are from a source that
+ * doesn't tag its samples (and never retunes).
+ *
+ */
+
+double RecorderComponent::frequency(const sdrm::tuning_t &tuning) const
+{
+    if (tuning.frequency)
+    {
+        return tuning.frequency;
+    }
+
+    return tuning.epoch ? 0.0 : _frequency;
+}
+
+/**
+ * Begins a new capture segment at the current position, with the
+ * time, stream index and frequency of the message in `reader`.
+ *
+ * @param reader: The message.
+ *
+ * @param index: The stream index of its first sample.
+ *
+ */
+
+void RecorderComponent::new_capture(const sdrm::iq_frame_reader &reader,
+                                    uint64_t index)
+{
+    auto &captures = _recording->meta.captures;
+    sdrm::sigmf_capture_t capture {_file_samples, index, reader.timestamp(),
+                                   frequency(reader.tuning())};
+
+    // Nothing was written since the last one; it is superseded.
+    if (captures.back().sample_start == _file_samples)
+    {
+        captures.back() = capture;
+    }
+    else
+    {
+        captures.push_back(capture);
+    }
+}
+
+/**
+ * Records a break in the stream: a new capture segment at the
+ * current position, and an annotation saying what is missing.
+ *
+ * @param reader: The message after the break.
+ *
+ * @param index: The stream index of its first sample.
+ *
+ * @param missing: The samples missing; 0 if the stream went
+ * backwards, i.e. the source restarted.
+ *
+ */
+
+void RecorderComponent::mark_gap(const sdrm::iq_frame_reader &reader,
+                                 uint64_t index, uint64_t missing)
+{
+    new_capture(reader, index);
+
+    string comment = missing ? to_string(missing) + " samples missing"
+        : "stream restarted";
+
+    if (_overrun)
+    {
+        comment += " (" + to_string(_overrun) + " dropped by the recorder)";
+    }
+
+    _recording->meta.annotations.push_back({_file_samples, 0, comment});
+    _stat_gaps.add();
+}
+
+/**
+ * Copies samples into the current block, handing each block to the
+ * I/O thread as it fills. If no free block is left, the rest of the
+ * samples are dropped and counted in _overrun; the next message then
+ * shows up as a gap.
+ *
+ * @param data: The samples.
+ *
+ * @param samples: Their number.
+ *
+ */
+
+void RecorderComponent::append(const char *data, size_t samples)
+{
+    size_t bytes = samples * _sample_size;
+
+    while (bytes > 0)
+    {
+        if (_block == NULL and not _free->pop(_block))
+        {
+            _block = NULL;
+            _overrun += bytes / _sample_size;
+            _stat_dropped.add(bytes / _sample_size);
+            return;
+        }
+
+        size_t n = min(_block_size - _block->used, bytes);
+        memcpy(_block->data + _block->used, data, n);
+        _block->used += n;
+        data += n;
+        bytes -= n;
+        _file_samples += n / _sample_size;
+        _next_index += n / _sample_size;
+        _stat_samples.add(n / _sample_size);
+
+        if (_block->used == _block_size)
+        {
+            submit({_block, _recording, false});
+            _block = NULL;
+        }
+    }
+}
+
+void RecorderComponent::submit(io_request_t r)
+{
+    _pending.push_back(r);
+    flush_pending();
+}
+
+/**
+ * Moves waiting requests to the I/O thread's ring, in order, as far as
+ * it has room.
+ *
+ */
+
+void RecorderComponent::flush_pending()
+{
+    while (not _pending.empty() and _requests->push(_pending.front()))
+    {
+        _pending.pop_front();
+    }
+}
+
+/**
+ * Writes the component's statistics to "STATS.<name>":
+ *
+ *   received:         messages received
+ *   samples:          samples queued for writing
+ *   dropped_samples:  samples dropped because no block was free
+ *   gaps:             breaks in the stream, from any cause
+ *   bytes_written, files, write_errors
+ *   write_queue:      requests waiting for the I/O thread
+ *   write_time:       time to write one block
+ *
+ */
+
+void RecorderComponent::report_stats()
+{
+    _stat_queue.set(_requests->occupancy() + _pending.size());
+
+    YAML::Node stats;
+    _stats.report(stats);
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
+
+/**
+ * Receives messages and copies their samples into blocks for the I/O
+ * thread. A new file is begun at the first message, when the sample
+ * format or samplerate changes, and when the current file reaches
+ * `max_file_mb` or `max_file_s`; and a new capture segment when the
+ * source is retuned.
+ *
+ * Samples are missing wherever the source's dropped sample count
+ * goes up, or, in IQ, a sequence number is skipped. (A spectrum
+ * carries the sequence number of the frame that completed it, so
+ * spectra are numbered with gaps.) A source's own stream index, if
+ * it keeps one, also says how many are missing. Derived data carry
+ * the index of the source sample they were computed from, which
+ * counts the source's samples, not theirs; so an index is relied on
+ * only once it has been seen to advance by the samples received.
+ *
+ * Messages of several frames are refused; see the class description.
+ *
+ */
+
+void RecorderComponent::receiving_task()
+{
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    sdrm::iq_frame_reader reader;
+    bool refused = false;
+
+    while (_run.load())
+    {
+        if (_stats.due(_stats_interval))
+        {
+            report_stats();
+        }
+
+        flush_pending();
+
+        string inbuf;
+
+        if (not input_signal_sink->timed_get(inbuf, Time::TM_ONE_SEC))
+        {
+            continue;
+        }
+
+        if (not reader.parse(inbuf))
+        {
+            logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+            continue;
+        }
+
+        sdrm::trace_span span("recorder.copy", reader.sequence());
+        _stat_received.add();
+
+        if (reader.frame_count() != 1)
+        {
+            if (not refused)
+            {
+                logger.warning(__PRETTY_FUNCTION__, "can't record messages of",
+                               reader.frame_count(), "frames; record a",
+                               "single DDC band, or FFT spectra with",
+                               "batch_frames: 1");
+                refused = true;
+            }
+
+            continue;
+        }
+
+        bool iq = reader.sample_format() == sdrm::SAMPLE_CF32;
+        const char *data = iq ? (const char *)reader.samples()
+            : (const char *)reader.values();
+        string datatype = iq ? "cf32_le" : "rf32_le";
+        uint64_t count = reader.sample_count();
+        uint64_t dropped = reader.dropped_samples() - _last_dropped;
+        uint64_t lost = 0;
+        bool restarted = false;
+
+        if (_recording and iq)
+        {
+            lost = reader.sequence() > _next_sequence
+                ? reader.sequence() - _next_sequence : 0;
+            restarted = reader.sequence() < _next_sequence;
+        }
+
+        if (not reader.timestamp())
+        {
+            _indexed = false;
+        }
+        else if (_recording and not lost and not dropped and not restarted)
+        {
+            bool indexed = reader.sample_index() == _last_index + _last_count;
+
+            if (indexed and not _indexed)
+            {
+                _next_index = reader.sample_index() - _overrun;
+            }
+
+            _indexed = indexed;
+        }
+
+        uint64_t index = _indexed ? reader.sample_index()
+            : _next_index + _overrun + dropped + lost * count;
+        uint64_t now = sdrm::stats_now();
+        bool retuned = reader.tuning().epoch != _epoch;
+
+        _last_dropped = reader.dropped_samples();
+        _next_sequence = reader.sequence() + 1;
+        _last_index = reader.sample_index();
+        _last_count = count;
+        _epoch = reader.tuning().epoch;
+
+        if (not _recording or datatype != _datatype
+            or sample_rate(reader.tuning()) != _recording->meta.sample_rate
+            or (_max_file_bytes > 0 and _file_samples > 0
+                and (_file_samples + count) * _sample_size
+                > _max_file_bytes)
+            or (_max_file_time > 0 and now - _file_start >= _max_file_time))
+        {
+            finish_file();
+            _datatype = datatype;
+            _sample_size = iq ? sizeof(sdrm::complex_float_t) : sizeof(float);
+            start_file(reader, index);
+        }
+        else if (restarted or index < _next_index)
+        {
+            mark_gap(reader, index, 0);
+        }
+        else if (index != _next_index)
+        {
+            mark_gap(reader, index, index - _next_index);
+        }
+        else if (retuned)
+        {
+            new_capture(reader, index);
+        }
+
+        _overrun = 0;
+        _next_index = index;
+        append(data, count);
+    }
+
+    finish_file();
+
+    // The I/O thread is still running, and will make room.
+    while (not _pending.empty())
+    {
+        flush_pending();
+        Time::thread_delay(1000000L);
+    }
+}
+
+/**
+ * The I/O thread: writes the blocks queued by the receiving thread,
+ * returns them to the free ring, and closes each file, writing its
+ * metadata, when asked. Sleeps briefly when there is nothing to do;
+ * blocks take a good fraction of a second to fill, so this costs
+ * nothing in throughput. Exits once stopped and the queue is empty.
+ *
+ */
+
+void RecorderComponent::writing_task()
+{
+    logger.info(__PRETTY_FUNCTION__, "running");
+
+    while (true)
+    {
+        io_request_t r;
+
+        if (not _requests->pop(r))
+        {
+            if (not _io_run.load())
+            {
+                break;
+            }
+
+            Time::thread_delay(1000000L);
+            continue;
+        }
+
+        if (r.recording != _open_recording)
+        {
+            _file.open(r.recording->base + ".sigmf-data", _direct_io);
+            _open_recording = r.recording;
+
+            if (_file.is_open() and not _file.is_direct() and _direct_io)
+            {
+                logger.info(__PRETTY_FUNCTION__, "O_DIRECT not supported in",
+                            _directory, "; writing through the page cache");
+            }
+        }
+
+        if (r.block)
+        {
+            sdrm::trace_span span("recorder.write");
+            uint64_t start = sdrm::stats_now();
+
+            if (_file.write(r.block->data, r.block->used))
+            {
+                _stat_bytes.add(r.block->used);
+            }
+            else
+            {
+                _stat_errors.add();
+            }
+
+            _stat_write.record(sdrm::stats_now() - start);
+            r.block->used = 0;
+            _free->push(r.block);
+        }
+
+        if (r.close)
+        {
+            _file.close();
+            sdrm::write_sigmf_meta(r.recording->base + ".sigmf-meta",
+                                   r.recording->meta);
+            _stat_files.add();
+            _open_recording.reset();
+            logger.info(__PRETTY_FUNCTION__, "wrote", r.recording->base);
+        }
+    }
+
+    _file.close();
+    _open_recording.reset();
+}
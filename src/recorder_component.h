@@ -0,0 +1,204 @@
+/*******************************************************************
+ *  recorder_component.h - Records a sample stream to SigMF files.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined _RECORDER_COMPONENT_H_
+#define _RECORDER_COMPONENT_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "sigmf_writer.h"
+#include "spsc_ring.h"
+#include "stats.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+/**
+ * \class RecorderComponent
+ *
+ * Records the samples received on "input_data" to SigMF recordings:
+ * a .sigmf-data file of the samples as received (cf32_le for IQ,
+ * rf32_le for real values), and a .sigmf-meta file giving the
+ * samplerate, frequency, and the time and stream index of the first
+ * sample. Wherever the stream is broken -- samples dropped by the
+ * source, messages lost on the way, or samples the recorder itself
+ * had to drop -- a new capture segment begins, with an annotation
+ * saying how many samples are missing.
+ *
+ * The samplerate and frequency are those the samples are tagged with
+ * (see iq_frame_header_t); those configured are used only for a
+ * source that doesn't tag them. A retune begins a new capture
+ * segment, at the new frequency; or, if the samplerate changed, a
+ * new file, as a SigMF recording has one samplerate. While a retune
+ * is in progress the frequency is unknown, and left out.
+ *
+ * The receiving thread only copies samples into large aligned
+ * blocks; a separate I/O thread writes the full blocks out (with
+ * O_DIRECT where possible). The two pass blocks through lock-free
+ * rings, and the receiving thread never waits for the disk: if every
+ * block is waiting to be written, samples are dropped, and counted,
+ * instead. Configuration:
+ *
+ *   directory: /data         # where recordings go
+ *   file_prefix: iq          # default: the component's name
+ *   sample_rate: 768000      # Hz, if the source doesn't say
+ *   frequency: 10000000.0    # center frequency, Hz, likewise
+ *   description: ""          # core:description
+ *   hw: AirspyHF+            # core:hw
+ *   block_kb: 4096           # write size, a multiple of 4
+ *   blocks: 8                # blocks in flight: 8 x 4 MB is about 5 s
+ *                            # of a 768 kS/s stream
+ *   direct_io: true          # use O_DIRECT if the file system allows
+ *   max_file_mb: 0           # start a new file at this size; 0: never
+ *   max_file_s: 0            # or after this many seconds; 0: never
+ *   stats_interval_ms: 1000  # telemetry to STATS.<name>; 0: off
+ *
+ * One recorder records one stream; to record several devices at
+ * once, use a recorder per device. A message of several frames --
+ * the bands of a DDC, the channels of a PFB, or a batch of spectra --
+ * isn't one stream, and is refused; to record a band, give it a
+ * DDCComponent of its own.
+ *
+ */
+
+class RecorderComponent : public matrix::Component
+{
+public:
+
+    virtual ~RecorderComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    RecorderComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool connect();
+    bool disconnect();
+    bool setup();
+
+    // One file (.sigmf-data and .sigmf-meta). Its metadata is the
+    // receiving thread's until it asks for the file to be closed.
+    struct recording_t
+    {
+        std::string base;
+        sdrm::sigmf_meta_t meta;
+    };
+
+    struct block_t
+    {
+        char *data;
+        size_t used;
+    };
+
+    // A request to the I/O thread: write `block` (if not NULL) to
+    // `recording`'s data file, then close the file if `close`.
+    struct io_request_t
+    {
+        block_t *block;
+        std::shared_ptr<recording_t> recording;
+        bool close;
+    };
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<RecorderComponent> _run_thread;
+    std::atomic<bool> _io_run;
+    matrix::Thread<RecorderComponent> _io_thread;
+    std::unique_ptr<matrix::DataSink<std::string,
+                                     matrix::select_only>> input_signal_sink;
+
+    // Configuration; see the class description.
+    std::string _directory;
+    std::string _file_prefix;
+    double _sample_rate;
+    double _frequency;
+    std::string _description;
+    std::string _hw;
+    size_t _block_size;
+    bool _direct_io;
+    uint64_t _max_file_bytes;
+    uint64_t _max_file_time;
+    uint64_t _stats_interval;
+
+    // The blocks, and the rings that pass them between the threads.
+    std::vector<std::unique_ptr<char, void (*)(void *)>> _storage;
+    std::vector<block_t> _blocks;
+    std::unique_ptr<sdrm::spsc_ring<block_t *>> _free;
+    std::unique_ptr<sdrm::spsc_ring<io_request_t>> _requests;
+
+    // The receiving thread's state. Requests wait in _pending when
+    // the request ring is full.
+    std::deque<io_request_t> _pending;
+    block_t *_block;
+    std::shared_ptr<recording_t> _recording;
+    unsigned _file_number;
+    uint64_t _file_samples;
+    uint64_t _file_start;
+    std::string _datatype;
+    size_t _sample_size;
+    uint64_t _next_index;
+    uint64_t _next_sequence;
+    uint64_t _last_index;
+    uint64_t _last_count;
+    bool _indexed;
+    uint64_t _last_dropped;
+    uint64_t _overrun;
+    uint32_t _epoch;
+
+    // The I/O thread's file.
+    sdrm::direct_file _file;
+    std::shared_ptr<recording_t> _open_recording;
+
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_received;
+    sdrm::stats_counter &_stat_samples;
+    sdrm::stats_counter &_stat_dropped;
+    sdrm::stats_counter &_stat_gaps;
+    sdrm::stats_counter &_stat_bytes;
+    sdrm::stats_counter &_stat_files;
+    sdrm::stats_counter &_stat_errors;
+    sdrm::stats_gauge &_stat_queue;
+    sdrm::stats_histogram &_stat_write;
+
+    void start_file(const sdrm::iq_frame_reader &reader, uint64_t index);
+    void finish_file();
+    double sample_rate(const sdrm::tuning_t &tuning) const;
+    double frequency(const sdrm::tuning_t &tuning) const;
+    void new_capture(const sdrm::iq_frame_reader &reader, uint64_t index);
+    void mark_gap(const sdrm::iq_frame_reader &reader, uint64_t index,
+                  uint64_t missing);
+    void append(const char *data, size_t samples);
+    void submit(io_request_t r);
+    void flush_pending();
+    void report_stats();
+    void receiving_task();
+    void writing_task();
+};
+
+#endif
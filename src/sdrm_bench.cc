@@ -0,0 +1,376 @@
+// ======================================================================
+// Copyright (C) 2019 Ramon Creager
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+// sdrm_bench: runs a source -> FFTComponent -> sink pipeline over each
+// of the matrix transports in turn, and reports sustained throughput,
+// end-to-end latency, lost buffers and the CPU used by each thread.
+// The source is the synthetic BenchSource, an AirspyComponent (with
+// real hardware, or libairspyhf_mock), or an IQReplayComponent playing
+// a recording.
+
+#include "airspy_component.h"
+#include "fft_component.h"
+#include "pfb_component.h"
+#include "ddc_component.h"
+#include "recorder_component.h"
+#include "iq_replay_component.h"
+#include "sweep_component.h"
+#include "bench_components.h"
+#include "simd_kernels.h"
+#include "trace.h"
+
+#include "matrix/Architect.h"
+#include "matrix/Component.h"
+#include "matrix/Keymaster.h"
+#include "matrix/ZMQContext.h"
+#include "matrix/log_t.h"
+#include "matrix/matrix_util.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <dirent.h>
+#include <unistd.h>
+#include <yaml-cpp/yaml.h>
+#include <boost/algorithm/string.hpp>
+#include <tclap/CmdLine.h>
+
+using namespace std;
+using namespace matrix;
+using namespace mxutils;
+using namespace TCLAP;
+
+static matrix::log_t logger("sdrm_bench");
+static string km_tcp_url{"tcp://localhost:42001"};
+
+class BenchArchitect : public Architect
+{
+public:
+    BenchArchitect(string name, string km_url);
+};
+
+BenchArchitect::BenchArchitect(string name, string km_url) :
+    Architect(name, km_url)
+{
+    add_component_factory("AirspyComponent", &AirspyComponent::factory);
+    add_component_factory("FFTComponent", &FFTComponent::factory);
+    add_component_factory("PFBComponent", &PFBComponent::factory);
+    add_component_factory("DDCComponent", &DDCComponent::factory);
+    add_component_factory("RecorderComponent", &RecorderComponent::factory);
+    add_component_factory("IQReplayComponent", &IQReplayComponent::factory);
+    add_component_factory("SweepComponent", &SweepComponent::factory);
+    add_component_factory("BenchSource", &BenchSourceComponent::factory);
+    add_component_factory("BenchSink", &BenchSinkComponent::factory);
+
+    try
+    {
+        basic_init();
+    }
+    catch(ArchitectException &e)
+    {
+        cout << e.what() << endl;
+        throw move(e);
+    }
+
+    initialize();
+}
+
+/**
+ * Reads the accumulated user + system CPU time of every thread in
+ * this process, summed by thread name.
+ *
+ * @return A map of thread name to CPU seconds.
+ *
+ */
+
+map<string, double> thread_cpu_times()
+{
+    map<string, double> times;
+    double tick = sysconf(_SC_CLK_TCK);
+    DIR *dir = opendir("/proc/self/task");
+
+    if (dir == NULL)
+    {
+        return times;
+    }
+
+    struct dirent *ent;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        ifstream f(string("/proc/self/task/") + ent->d_name + "/stat");
+        string stat;
+        getline(f, stat);
+
+        // The name is in parentheses and may contain spaces; the
+        // fields after it are space separated. utime and stime are
+        // fields 14 and 15, i.e. the 12th and 13th after the name.
+        auto open = stat.find('(');
+        auto close = stat.rfind(')');
+
+        if (open == string::npos || close == string::npos)
+        {
+            continue;
+        }
+
+        string name = stat.substr(open + 1, close - open - 1);
+        vector<string> fields;
+        string rest = stat.substr(close + 2);
+        boost::split(fields, rest, boost::is_any_of(" "));
+
+        if (fields.size() > 12)
+        {
+            times[name] += (stod(fields[11]) + stod(fields[12])) / tick;
+        }
+    }
+
+    closedir(dir);
+    return times;
+}
+
+/**
+ * Sends an AIRSPYCMDS request and waits briefly for it to be handled.
+ *
+ */
+
+void airspy_request(Keymaster &km, string cmd, YAML::Node params)
+{
+    km.put("AIRSPYCMDS." + cmd + ".request", params);
+    Time::thread_delay(100000000L);
+}
+
+/**
+ * Runs the pipeline over one transport.
+ *
+ * @param config: The bench configuration.
+ *
+ * @param transport: One of rtinproc, inproc, ipc, tcp.
+ *
+ * @param source: "synthetic", "airspyhf" or "replay"; also the configuration
+ * (connection set) used.
+ *
+ * @param duration: How long to run, in seconds.
+ *
+ * @param trace: If not empty, the pipeline is traced while it runs,
+ * and the trace written to this file name with the transport added.
+ *
+ */
+
+void run_bench(YAML::Node config, string transport, string source,
+               int duration, string trace)
+{
+    // Every source in the bench config uses the transport under test.
+    for (auto c : config["components"])
+    {
+        if (c.second["Transports"])
+        {
+            for (auto t : c.second["Transports"])
+            {
+                t.second["Specified"] = vector<string>{transport};
+            }
+        }
+    }
+
+    config["architect"]["control"]["configuration"] = source;
+
+    string fname = "/tmp/sdrm_bench_" + transport + ".yaml";
+    ofstream out(fname);
+    out << config;
+    out.close();
+
+    Architect::create_keymaster_server(fname);
+
+    {
+        Keymaster km(km_tcp_url);
+        auto urls = km.get_as<vector<string>>("Keymaster.URLS.AsConfigured.State");
+        auto km_url = get_most_local(urls);
+
+        BenchArchitect arch("control", km_url);
+        arch.wait_all_in_state("Standby", 1000000);
+        arch.set_system_mode(source);
+        arch.ready();
+        arch.wait_all_in_state("Ready", 4000000);
+
+        if (source == "airspyhf")
+        {
+            YAML::Node sn;
+            sn.push_back(0xFFFFFFFFFFFFFFFFULL);
+            airspy_request(km, "open", YAML::Node(YAML::NodeType::Sequence));
+            airspy_request(km, "start", sn);
+        }
+
+        arch.start();
+        arch.wait_all_in_state("Running", 4000000);
+
+        auto &tracer = sdrm::trace_recorder::instance();
+        uint64_t trace_start = sdrm::stats_now();
+        tracer.enable(not trace.empty());
+
+        auto cpu0 = thread_cpu_times();
+        sleep(duration);
+        auto cpu1 = thread_cpu_times();
+
+        if (not trace.empty())
+        {
+            tracer.enable(false);
+            tracer.dump(trace + "_" + transport + ".json", trace_start);
+        }
+
+        if (source == "airspyhf")
+        {
+            YAML::Node sn;
+            sn.push_back(0xFFFFFFFFFFFFFFFFULL);
+            airspy_request(km, "stop", sn);
+            airspy_request(km, "close", sn);
+        }
+
+        arch.stop();
+        arch.wait_all_in_state("Ready", 4000000);
+
+        auto results = km.get("BENCH.sink");
+
+        cout << "=== " << transport << " (" << source << ") ===" << endl;
+        cout << results << endl;
+        cout << "cpu_s (of " << duration << " s):" << endl;
+
+        for (auto &t : cpu1)
+        {
+            double used = t.second - cpu0[t.first];
+
+            if (used > 0.0)
+            {
+                cout << "  " << left << setw(20) << t.first
+                     << fixed << setprecision(3) << used
+                     << " (" << setprecision(1) << 100.0 * used / duration
+                     << "%)" << endl;
+            }
+        }
+
+        cout << endl;
+        arch.standby();
+        arch.wait_all_in_state("Standby", 4000000);
+    }
+
+    Architect::destroy_keymaster_server();
+}
+
+int main(int argc, char **argv)
+{
+    int rval = 0;
+
+    try
+    {
+        auto ctx = ZMQContext::Instance();
+        CmdLine cmd("sdrm_bench: sdrm pipeline benchmark");
+
+        ValueArg<string> configArg(
+            "c", "config", "Bench configuration file",
+            false, "bench.yaml", "string");
+        cmd.add(configArg);
+        ValueArg<string> transportArg(
+            "t", "transports", "Comma separated transports to test",
+            false, "rtinproc,inproc,ipc,tcp", "string");
+        cmd.add(transportArg);
+        ValueArg<string> sourceArg(
+            "s", "source", "Source, one of synthetic|airspyhf|replay",
+            false, "synthetic", "string");
+        cmd.add(sourceArg);
+        ValueArg<int> durationArg(
+            "d", "duration", "Seconds to run each transport",
+            false, 10, "int");
+        cmd.add(durationArg);
+        ValueArg<string> simdArg(
+            "", "simd", "SIMD kernels to use: avx512|avx2|sse2|scalar",
+            false, "", "string");
+        cmd.add(simdArg);
+        SwitchArg verifyArg(
+            "k", "verify-kernels",
+            "Check the SIMD kernels against the scalar ones, and exit",
+            false);
+        cmd.add(verifyArg);
+        ValueArg<string> traceArg(
+            "", "trace",
+            "Trace the pipeline, writing <file>_<transport>.json",
+            false, "", "file");
+        cmd.add(traceArg);
+        cmd.parse(argc, argv);
+
+        log_t::set_default_backend();
+        log_t::set_log_level(Levels::WARNING_LEVEL);
+
+        if (verifyArg.getValue())
+        {
+            bool ok = sdrm::verify_simd_kernels();
+            cout << "SIMD kernels (";
+
+            for (auto l : sdrm::simd_levels_supported())
+            {
+                cout << " " << l;
+            }
+
+            cout << " ): " << (ok ? "OK" : "FAILED") << endl;
+            return ok ? 0 : 1;
+        }
+
+        if (not simdArg.getValue().empty()
+            and not sdrm::set_simd_level(simdArg.getValue()))
+        {
+            return 1;
+        }
+
+        cout << "SIMD kernels: " << sdrm::simd_level() << endl;
+
+        vector<string> transports;
+        boost::split(transports, transportArg.getValue(), boost::is_any_of(","));
+
+        for (auto t : transports)
+        {
+            run_bench(YAML::LoadFile(configArg.getValue()), t,
+                      sourceArg.getValue(), durationArg.getValue(),
+                      traceArg.getValue());
+        }
+    }
+    catch (KeymasterException &e)
+    {
+        logger.fatal(e.what());
+        rval = 1;
+    }
+    catch (ArgException &e)
+    {
+        logger.fatal(e.error(), " for arg ", e.argId());
+        rval = 1;
+    }
+    catch (runtime_error &e)
+    {
+        logger.fatal(e.what());
+        rval = 1;
+    }
+    catch (zmq::error_t &e)
+    {
+        logger.fatal(e.what());
+        rval = 1;
+    }
+
+    return rval;
+}
@@ -0,0 +1,73 @@
+/*******************************************************************
+ *  sdrm_config.h - Helpers to read component configuration values
+ *  from the Keymaster.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_SDRM_CONFIG_H_)
+#define _SDRM_CONFIG_H_
+
+#include "matrix/Keymaster.h"
+
+#include <memory>
+#include <string>
+#include <yaml-cpp/yaml.h>
+
+namespace sdrm
+{
+    /**
+     * Fetches a configuration value from the Keymaster, falling back
+     * to a default if the key is missing or won't convert to T. Most
+     * component settings are optional, so this saves every component
+     * from wrapping each lookup in its own try/catch.
+     *
+     * @param km: The Keymaster client to use.
+     *
+     * @param key: The full key, i.e. "components.airspyhf.ringbuffer_pool_size"
+     *
+     * @param dflt: The value returned if the key can't be used.
+     *
+     * @return The configured value, or `dflt`.
+     *
+     */
+
+    template <typename T>
+    T get_config(std::shared_ptr<matrix::Keymaster> km, std::string key, T dflt)
+    {
+        try
+        {
+            YAML::Node n = km->get(key);
+
+            if (n.IsDefined() && !n.IsNull())
+            {
+                return n.as<T>();
+            }
+        }
+        catch (matrix::KeymasterException &e)
+        {
+        }
+        catch (YAML::Exception &e)
+        {
+        }
+
+        return dflt;
+    }
+}
+
+#endif
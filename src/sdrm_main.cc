@@ -16,7 +16,13 @@
 // Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 
 #include "airspy_component.h"
+#include "ddc_component.h"
+#include "iq_replay_component.h"
+#include "pfb_component.h"
+#include "recorder_component.h"
 #include "simple_msgpk_client.h"
+#include "sweep_component.h"
+#include "trace.h"
 
 #include "matrix/Architect.h"
 #include "matrix/Component.h"
@@ -52,6 +58,11 @@ SDRMArchitect::SDRMArchitect(string name, string km_url) :
 {
     add_component_factory("AirspyComponent", &AirspyComponent::factory);
     add_component_factory("simple_msgpk_client", &MsgpackComponent::factory);
+    add_component_factory("PFBComponent", &PFBComponent::factory);
+    add_component_factory("DDCComponent", &DDCComponent::factory);
+    add_component_factory("RecorderComponent", &RecorderComponent::factory);
+    add_component_factory("IQReplayComponent", &IQReplayComponent::factory);
+    add_component_factory("SweepComponent", &SweepComponent::factory);
 
     try
     {
@@ -154,6 +165,9 @@ int main(int argc, char **argv)
                 last_pulse_update = now;
             }
 
+            // Pipeline tracing: see sdrm::trace_recorder::poll().
+            sdrm::trace_recorder::instance().poll(km);
+
             Time::thread_delay(1000000000L);
         }
     }
@@ -26,14 +26,32 @@ using namespace std;
 
 namespace sdrm
 {
+    tuning_t::tuning_t()
+        : epoch(0),
+          samplerate(0),
+          frequency(0),
+          hf_att(0),
+          hf_agc(0),
+          hf_agc_threshold(0),
+          lib_dsp(0)
+    {
+    }
+
     iq_data_t::iq_data_t()
         : sample_count(0),
-          dropped_samples(0)
+          dropped_samples(0),
+          sequence(0),
+          sample_index(0),
+          timestamp(0),
+          frame_count(1)
     {
     }
 
     iq_data_t::iq_data_t(airspyhf_transfer_t *transfer)
-
+        : sequence(0),
+          sample_index(0),
+          timestamp(0),
+          frame_count(1)
     {
         sample_count = transfer->sample_count;
         dropped_samples = transfer->dropped_samples;
@@ -59,9 +77,19 @@ namespace sdrm
             samples = std::move(other.samples);
             sample_count = other.sample_count;
             dropped_samples = other.dropped_samples;
+            sequence = other.sequence;
+            sample_index = other.sample_index;
+            timestamp = other.timestamp;
+            tuning = other.tuning;
+            frame_count = other.frame_count;
             other.samples.clear();
             other.sample_count = 0;
             other.dropped_samples = 0;
+            other.sequence = 0;
+            other.sample_index = 0;
+            other.timestamp = 0;
+            other.tuning = tuning_t();
+            other.frame_count = 1;
         }
 
         return *this;
@@ -45,6 +45,23 @@ namespace sdrm
         MSGPACK_DEFINE(re, im);
     };
 
+    // How a buffer's samples were captured, as last set through the
+    // AIRSPYCMDS handlers; see iq_frame_header_t. 0 means unknown.
+    struct tuning_t
+    {
+        tuning_t();
+
+        uint32_t epoch;            // count of changes to the rest
+        uint32_t samplerate;       // S/s
+        uint64_t frequency;        // center frequency, Hz
+        uint8_t hf_att;            // attenuation, in 6 dB steps
+        uint8_t hf_agc;            // 1: AGC on
+        uint8_t hf_agc_threshold;  // 1: high AGC threshold
+        uint8_t lib_dsp;           // 1: the library's IQ correction on
+        MSGPACK_DEFINE(epoch, samplerate, frequency, hf_att, hf_agc,
+                       hf_agc_threshold, lib_dsp);
+    };
+
     struct iq_data_t
     {
         iq_data_t();
@@ -57,7 +74,33 @@ namespace sdrm
         int sample_count;
         uint64_t dropped_samples;
         std::vector<complex_float_t> samples;
-        MSGPACK_DEFINE(sample_count, dropped_samples, samples);
+        // Appended so that readers of the original three fields can
+        // still decode this. See iq_frame_header_t.
+        uint64_t sequence;
+        uint64_t sample_index;
+        uint64_t timestamp;
+        tuning_t tuning;
+        uint16_t frame_count;  // frames (or channels) in the samples
+        MSGPACK_DEFINE(sample_count, dropped_samples, samples,
+                       sequence, sample_index, timestamp, tuning,
+                       frame_count);
+    };
+
+    // A block of real-valued data, e.g. the power bins of a spectrum;
+    // the msgpack counterpart of a SAMPLE_F32 raw frame.
+    struct power_data_t
+    {
+        int bin_count;
+        uint64_t dropped_samples;
+        std::vector<float> bins;
+        uint64_t sequence;
+        uint64_t sample_index;
+        uint64_t timestamp;
+        tuning_t tuning;
+        uint16_t frame_count;  // frames (e.g. spectra) in the bins
+        MSGPACK_DEFINE(bin_count, dropped_samples, bins,
+                       sequence, sample_index, timestamp, tuning,
+                       frame_count);
     };
 }
 
@@ -0,0 +1,141 @@
+/*******************************************************************
+ *  seqlock.h - A value written now and then, and read often without
+ *  locking.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_SEQLOCK_H_)
+#define _SEQLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+
+namespace sdrm
+{
+    /**
+     * \class seqlock
+     *
+     * Holds a small value that writers change now and then, and that
+     * readers -- such as a streaming callback -- read all the time,
+     * and must never wait for. A reader copies the value and checks a
+     * sequence count, which is odd while a write is in progress, and
+     * copies it again if it was; so a reader always gets a value as
+     * some writer left it, never half of one. Writers take a mutex
+     * among themselves.
+     *
+     * T must be trivially copyable. It is kept as 64-bit atomic words,
+     * so that the readers' copying, which races with the writer's by
+     * design, is well defined.
+     *
+     */
+
+    template <typename T>
+    class seqlock
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "seqlock<T> needs a trivially copyable T");
+
+    public:
+        seqlock(const T &v = T())
+            : _seq(0)
+        {
+            store(v);
+        }
+
+        /**
+         * @return A consistent copy of the value. Never blocks; spins
+         * only for as long as a write takes.
+         *
+         */
+
+        T load() const
+        {
+            uint64_t w[WORDS];
+            uint32_t before;
+            uint32_t after;
+
+            do
+            {
+                before = _seq.load(std::memory_order_acquire);
+
+                for (size_t i = 0; i < WORDS; ++i)
+                {
+                    w[i] = _words[i].load(std::memory_order_relaxed);
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                after = _seq.load(std::memory_order_relaxed);
+            }
+            while (before != after or (before & 1));
+
+            T v;
+            memcpy(&v, w, sizeof(T));
+            return v;
+        }
+
+        /**
+         * Changes the value. Writers are serialized, so that a change
+         * made by reading, modifying and writing back is not lost.
+         *
+         * @param change: Called with a copy of the value to modify;
+         * the result is then stored.
+         *
+         * @return The new value.
+         *
+         */
+
+        template <typename F>
+        T update(F change)
+        {
+            std::lock_guard<std::mutex> l(_writer);
+            T v = load();
+            change(v);
+
+            uint32_t seq = _seq.load(std::memory_order_relaxed);
+            _seq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            store(v);
+            _seq.store(seq + 2, std::memory_order_release);
+            return v;
+        }
+
+    private:
+        static const size_t WORDS = (sizeof(T) + 7) / 8;
+
+        void store(const T &v)
+        {
+            uint64_t w[WORDS] = {};
+            memcpy(w, &v, sizeof(T));
+
+            for (size_t i = 0; i < WORDS; ++i)
+            {
+                _words[i].store(w[i], std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint32_t> _seq;
+        std::atomic<uint64_t> _words[WORDS];
+        std::mutex _writer;
+    };
+}
+
+#endif
@@ -0,0 +1,401 @@
+/*******************************************************************
+ *  sigmf_writer.cc - Large-block file output and SigMF metadata, for
+ *  recording sample streams.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "sigmf_writer.h"
+#include "matrix/log_t.h"
+
+#include <yaml-cpp/yaml.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static matrix::log_t logger("sigmf_writer");
+
+namespace sdrm
+{
+    /**
+     * Formats a UTC time as SigMF wants it: ISO 8601, to the ns.
+     *
+     * @param ns: The time, in ns since the Unix epoch.
+     *
+     * @return e.g. "2019-07-04T12:00:00.000000000Z".
+     *
+     */
+
+    string iso8601(uint64_t ns)
+    {
+        time_t secs = ns / 1000000000ULL;
+        tm utc;
+        char buf[64];
+
+        gmtime_r(&secs, &utc);
+        size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(buf + n, sizeof(buf) - n, ".%09lluZ",
+                 (unsigned long long)(ns % 1000000000ULL));
+        return buf;
+    }
+
+    /**
+     * Reads a time written by iso8601(), or any ISO 8601 UTC time
+     * with a fractional second of up to 9 digits.
+     *
+     * @param s: The time, e.g. "2019-07-04T12:00:00.5Z".
+     *
+     * @return The time in ns since the Unix epoch; 0 if `s` can't be
+     * read.
+     *
+     */
+
+    uint64_t parse_iso8601(string s)
+    {
+        tm utc = {};
+        char frac[16] = "";
+
+        if (sscanf(s.c_str(), "%d-%d-%dT%d:%d:%d.%15[0-9]",
+                   &utc.tm_year, &utc.tm_mon, &utc.tm_mday, &utc.tm_hour,
+                   &utc.tm_min, &utc.tm_sec, frac) < 6)
+        {
+            return 0;
+        }
+
+        utc.tm_year -= 1900;
+        utc.tm_mon -= 1;
+        size_t digits = strlen(frac);
+        uint64_t ns = 0;
+
+        for (size_t i = 0; i < 9; ++i)
+        {
+            ns = ns * 10 + (i < digits ? frac[i] - '0' : 0);
+        }
+
+        return (uint64_t)timegm(&utc) * 1000000000ULL + ns;
+    }
+
+    /**
+     * Escapes a string for a JSON string literal.
+     *
+     */
+
+    static string json_string(const string &s)
+    {
+        ostringstream o;
+        o << '"';
+
+        for (char c : s)
+        {
+            switch (c)
+            {
+            case '"':
+                o << "\\\"";
+                break;
+            case '\\':
+                o << "\\\\";
+                break;
+            case '\n':
+                o << "\\n";
+                break;
+            default:
+                if ((unsigned char)c < 0x20)
+                {
+                    o << "\\u" << hex << setw(4) << setfill('0') << (int)c
+                      << dec;
+                }
+                else
+                {
+                    o << c;
+                }
+            }
+        }
+
+        o << '"';
+        return o.str();
+    }
+
+    /**
+     * Writes a SigMF metadata file.
+     *
+     * @param path: The file, normally <name>.sigmf-meta.
+     *
+     * @param meta: The metadata.
+     *
+     * @return false if the file couldn't be written.
+     *
+     */
+
+    bool write_sigmf_meta(string path, const sigmf_meta_t &meta)
+    {
+        ofstream o(path);
+
+        o << setprecision(17);
+        o << "{\n  \"global\": {\n"
+          << "    \"core:datatype\": " << json_string(meta.datatype) << ",\n"
+          << "    \"core:sample_rate\": " << meta.sample_rate << ",\n"
+          << "    \"core:version\": \"1.0.0\"";
+
+        if (not meta.description.empty())
+        {
+            o << ",\n    \"core:description\": " << json_string(meta.description);
+        }
+
+        if (not meta.hw.empty())
+        {
+            o << ",\n    \"core:hw\": " << json_string(meta.hw);
+        }
+
+        if (not meta.recorder.empty())
+        {
+            o << ",\n    \"core:recorder\": " << json_string(meta.recorder);
+        }
+
+        o << "\n  },\n  \"captures\": [";
+
+        for (size_t i = 0; i < meta.captures.size(); ++i)
+        {
+            const sigmf_capture_t &c = meta.captures[i];
+            o << (i ? ",\n" : "\n")
+              << "    {\"core:sample_start\": " << c.sample_start
+              << ", \"core:global_index\": " << c.global_index;
+
+            if (c.frequency)
+            {
+                o << ", \"core:frequency\": " << c.frequency;
+            }
+
+            if (c.datetime)
+            {
+                o << ", \"core:datetime\": \"" << iso8601(c.datetime) << "\"";
+            }
+
+            o << "}";
+        }
+
+        o << "\n  ],\n  \"annotations\": [";
+
+        for (size_t i = 0; i < meta.annotations.size(); ++i)
+        {
+            const sigmf_annotation_t &a = meta.annotations[i];
+            o << (i ? ",\n" : "\n")
+              << "    {\"core:sample_start\": " << a.sample_start;
+
+            if (a.sample_count)
+            {
+                o << ", \"core:sample_count\": " << a.sample_count;
+            }
+
+            o << ", \"core:comment\": " << json_string(a.comment) << "}";
+        }
+
+        o << "\n  ]\n}\n";
+        o.close();
+
+        if (not o)
+        {
+            logger.error(__PRETTY_FUNCTION__, "can't write", path);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Reads a SigMF metadata file: the global fields that
+     * sigmf_meta_t has, and the captures. Annotations are not read.
+     *
+     * @param path: The file, normally <name>.sigmf-meta.
+     *
+     * @param meta: Receives the metadata.
+     *
+     * @return false if the file couldn't be read or parsed.
+     *
+     */
+
+    bool read_sigmf_meta(string path, sigmf_meta_t &meta)
+    {
+        try
+        {
+            // JSON is YAML, as far as yaml-cpp is concerned.
+            YAML::Node root = YAML::LoadFile(path);
+            YAML::Node global = root["global"];
+
+            meta = sigmf_meta_t();
+            meta.datatype = global["core:datatype"].as<string>();
+            meta.sample_rate = global["core:sample_rate"].as<double>(0.0);
+            meta.description = global["core:description"].as<string>("");
+            meta.hw = global["core:hw"].as<string>("");
+            meta.recorder = global["core:recorder"].as<string>("");
+
+            for (auto c : root["captures"])
+            {
+                meta.captures.push_back(
+                    {c["core:sample_start"].as<uint64_t>(0),
+                     c["core:global_index"].as<uint64_t>(0),
+                     parse_iso8601(c["core:datetime"].as<string>("")),
+                     c["core:frequency"].as<double>(0.0)});
+            }
+        }
+        catch (YAML::Exception &e)
+        {
+            logger.error(__PRETTY_FUNCTION__, "can't read", path, ":",
+                         e.what());
+            return false;
+        }
+
+        return true;
+    }
+
+    direct_file::direct_file()
+        : _fd(-1),
+          _direct(false),
+          _size(0)
+    {
+    }
+
+    direct_file::~direct_file()
+    {
+        close();
+    }
+
+    /**
+     * Creates (or truncates) a file for writing.
+     *
+     * @param path: The file.
+     *
+     * @param direct: Try O_DIRECT; if the file system refuses it
+     * (tmpfs, some network file systems) the file is opened without.
+     *
+     * @return false if the file couldn't be created.
+     *
+     */
+
+    bool direct_file::open(string path, bool direct)
+    {
+        close();
+        _path = path;
+        _size = 0;
+        _direct = false;
+
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+        if (direct)
+        {
+            _fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            _direct = _fd >= 0;
+        }
+
+        if (_fd < 0)
+        {
+            _fd = ::open(path.c_str(), flags, 0644);
+        }
+
+        if (_fd < 0)
+        {
+            logger.error(__PRETTY_FUNCTION__, "can't create", path, ":",
+                         strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    bool direct_file::write_all(const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t n = ::write(_fd, data, len);
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                logger.error(__PRETTY_FUNCTION__, "writing", _path, ":",
+                             strerror(errno));
+                return false;
+            }
+
+            data += n;
+            len -= n;
+            _size += n;
+        }
+
+        return true;
+    }
+
+    /**
+     * Appends to the file. Under O_DIRECT a length that is not a
+     * multiple of ALIGNMENT is taken to be the last write: the
+     * aligned part is written directly, then O_DIRECT is turned off
+     * for the rest.
+     *
+     * @param data: The bytes; aligned to ALIGNMENT under O_DIRECT.
+     *
+     * @param len: Their number.
+     *
+     * @return false on a write error.
+     *
+     */
+
+    bool direct_file::write(const char *data, size_t len)
+    {
+        if (_fd < 0)
+        {
+            return false;
+        }
+
+        if (_direct && len % ALIGNMENT)
+        {
+            size_t aligned = len - len % ALIGNMENT;
+
+            if (not write_all(data, aligned))
+            {
+                return false;
+            }
+
+            fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+            _direct = false;
+            data += aligned;
+            len -= aligned;
+        }
+
+        return write_all(data, len);
+    }
+
+    void direct_file::close()
+    {
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+        }
+    }
+}
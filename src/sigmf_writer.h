@@ -0,0 +1,126 @@
+/*******************************************************************
+ *  sigmf_writer.h - Large-block file output and SigMF metadata, for
+ *  recording sample streams.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_SIGMF_WRITER_H_)
+#define _SIGMF_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    /**
+     * \struct sigmf_capture_t
+     *
+     * A SigMF capture segment: from `sample_start` on, the samples are
+     * contiguous, the first being `global_index` in the source's
+     * stream, taken at `datetime` (UTC ns; 0 if unknown), at center
+     * `frequency` (Hz; 0 if unknown).
+     *
+     */
+
+    struct sigmf_capture_t
+    {
+        uint64_t sample_start;
+        uint64_t global_index;
+        uint64_t datetime;
+        double frequency;
+    };
+
+    /**
+     * \struct sigmf_annotation_t
+     *
+     * A SigMF annotation: a comment on the samples from
+     * `sample_start`, for `sample_count` samples (0: a point).
+     *
+     */
+
+    struct sigmf_annotation_t
+    {
+        uint64_t sample_start;
+        uint64_t sample_count;
+        std::string comment;
+    };
+
+    /**
+     * \struct sigmf_meta_t
+     *
+     * The contents of a .sigmf-meta file.
+     *
+     */
+
+    struct sigmf_meta_t
+    {
+        std::string datatype;     // e.g. "cf32_le"
+        double sample_rate;
+        std::string description;
+        std::string hw;
+        std::string recorder;
+        std::vector<sigmf_capture_t> captures;
+        std::vector<sigmf_annotation_t> annotations;
+    };
+
+    std::string iso8601(uint64_t ns);
+    uint64_t parse_iso8601(std::string s);
+    bool write_sigmf_meta(std::string path, const sigmf_meta_t &meta);
+    bool read_sigmf_meta(std::string path, sigmf_meta_t &meta);
+
+    /**
+     * \class direct_file
+     *
+     * A file written sequentially in large blocks. Opened with
+     * O_DIRECT where the file system supports it, so that a long
+     * recording doesn't fill the page cache and then stall on its
+     * write-back; buffered otherwise. With O_DIRECT every write but
+     * the last must be a multiple of ALIGNMENT bytes, from a buffer
+     * aligned to ALIGNMENT.
+     *
+     */
+
+    class direct_file
+    {
+    public:
+        static const size_t ALIGNMENT = 4096;
+
+        direct_file();
+        ~direct_file();
+
+        bool open(std::string path, bool direct = true);
+        bool write(const char *data, size_t len);
+        void close();
+
+        bool is_open() const {return _fd >= 0;}
+        bool is_direct() const {return _direct;}
+        uint64_t size() const {return _size;}
+
+    private:
+        bool write_all(const char *data, size_t len);
+
+        int _fd;
+        bool _direct;
+        uint64_t _size;
+        std::string _path;
+    };
+}
+
+#endif
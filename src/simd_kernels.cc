@@ -0,0 +1,1679 @@
+/*******************************************************************
+ *  simd_kernels.cc - Vectorized loops for the spectral processing:
+ *  windowing, |X|^2 and dB conversion, with the implementation chosen
+ *  at run time for the CPU.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+// Every implementation must do the same IEEE operations in the same
+// order as the scalar one, so that all give identical results. This
+// file is therefore built with -ffp-contract=off (no fused
+// multiply-adds), and power_to_db() uses its own logarithm, built only
+// of operations that are exact the same way in every instruction set,
+// rather than log10f().
+
+#include "simd_kernels.h"
+#include "matrix/log_t.h"
+
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SDRM_X86_KERNELS
+// GCC 12's AVX-512 headers trip -Wmaybe-uninitialized when optimizing
+// (GCC bug 105593).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+using namespace std;
+using namespace matrix;
+
+static log_t logger("simd_kernels");
+
+namespace sdrm
+{
+    // ln(m) = 2 atanh(s), s = (m - 1) / (m + 1); for m in [1, 2), s is
+    // in [0, 1/3) and the series below is good to ~1e-7.
+    static const float LN_C1 = 2.0f;
+    static const float LN_C3 = 2.0f / 3.0f;
+    static const float LN_C5 = 2.0f / 5.0f;
+    static const float LN_C7 = 2.0f / 7.0f;
+    static const float LN_C9 = 2.0f / 9.0f;
+    static const float LN_C11 = 2.0f / 11.0f;
+    // 10 log10(2) and 10 / ln(10).
+    static const float DB_PER_OCTAVE = 3.0102999566f;
+    static const float DB_PER_NEPER = 4.3429448190f;
+
+    /********************************************************************
+     * Scalar. The reference, and the tail of every vector loop.
+     ********************************************************************/
+
+    static void apply_window_scalar(const complex_float_t *in, const float *w,
+                                    complex_float_t *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i].re = in[i].re * w[i];
+            out[i].im = in[i].im * w[i];
+        }
+    }
+
+    static void multiply_accumulate_scalar(const complex_float_t *in,
+                                           const float *h,
+                                           complex_float_t *acc, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            acc[i].re = acc[i].re + in[i].re * h[i];
+            acc[i].im = acc[i].im + in[i].im * h[i];
+        }
+    }
+
+    static void complex_multiply_scalar(const complex_float_t *a,
+                                        const complex_float_t *b,
+                                        complex_float_t *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            float re = a[i].re * b[i].re - a[i].im * b[i].im;
+            float im = a[i].im * b[i].re + a[i].re * b[i].im;
+            out[i].re = re;
+            out[i].im = im;
+        }
+    }
+
+    // dot_product() sums in DOT_LANES interleaved complex partial sums,
+    // sample i going to lane i % DOT_LANES, which are then added in
+    // lane order. Every implementation does exactly this, whatever its
+    // vector width, so that all give the same result.
+    static const size_t DOT_LANES = 8;
+
+    static complex_float_t dot_combine(const float *lanes)
+    {
+        complex_float_t r = {lanes[0], lanes[1]};
+
+        for (size_t l = 1; l < DOT_LANES; ++l)
+        {
+            r.re = r.re + lanes[2 * l];
+            r.im = r.im + lanes[2 * l + 1];
+        }
+
+        return r;
+    }
+
+    // Continues a dot product from sample `start`, a multiple of
+    // DOT_LANES, into `lanes`.
+    static void dot_tail(const complex_float_t *x, const float *h,
+                         size_t start, size_t n, float *lanes)
+    {
+        for (size_t i = start; i < n; ++i)
+        {
+            size_t l = i % DOT_LANES;
+            lanes[2 * l] = lanes[2 * l] + x[i].re * h[i];
+            lanes[2 * l + 1] = lanes[2 * l + 1] + x[i].im * h[i];
+        }
+    }
+
+    static complex_float_t dot_product_scalar(const complex_float_t *x,
+                                              const float *h, size_t n)
+    {
+        float lanes[2 * DOT_LANES] = {0.0f};
+        dot_tail(x, h, 0, n, lanes);
+        return dot_combine(lanes);
+    }
+
+    static void magnitude_squared_scalar(const complex_float_t *in, float *out,
+                                         size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = in[i].re * in[i].re + in[i].im * in[i].im;
+        }
+    }
+
+    static void accumulate_power_scalar(const complex_float_t *in, float *acc,
+                                        size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            acc[i] = acc[i] + (in[i].re * in[i].re + in[i].im * in[i].im);
+        }
+    }
+
+    static inline float db_scalar(float p, float scale)
+    {
+        float q = p * scale;
+        // Written to match maxps(q, floor), NaN included.
+        q = q > POWER_FLOOR ? q : POWER_FLOOR;
+
+        uint32_t bits;
+        memcpy(&bits, &q, sizeof(bits));
+        float e = (float)((int32_t)(bits >> 23) - 127);
+        bits = (bits & 0x007fffff) | 0x3f800000;
+        float m;
+        memcpy(&m, &bits, sizeof(m));
+
+        float s = (m - 1.0f) / (m + 1.0f);
+        float s2 = s * s;
+        float ln_m = s * (LN_C1 + s2 * (LN_C3 + s2 * (LN_C5 + s2 * (LN_C7
+                     + s2 * (LN_C9 + s2 * LN_C11)))));
+
+        return e * DB_PER_OCTAVE + ln_m * DB_PER_NEPER;
+    }
+
+    static void power_to_db_scalar(const float *in, float *out, size_t n,
+                                   float scale)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = db_scalar(in[i], scale);
+        }
+    }
+
+    static float peak_magnitude_scalar(const float *in, size_t n)
+    {
+        float m = 0.0f;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            // Written to match maxps(|x|, m), which ignores NaNs here.
+            float a = fabsf(in[i]);
+            m = a > m ? a : m;
+        }
+
+        return m;
+    }
+
+    static inline int16_t int16_scalar(float v)
+    {
+        // As cvtps2dq then packssdw: round to nearest even, NaN and
+        // anything beyond int32 give INT32_MIN, then saturate.
+        int32_t r = v >= -2147483648.0f && v < 2147483648.0f
+            ? (int32_t)nearbyintf(v) : INT32_MIN;
+        return r > 32767 ? 32767 : r < -32768 ? -32768 : r;
+    }
+
+    static void float_to_int16_scalar(const float *in, int16_t *out, size_t n,
+                                      float scale)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = int16_scalar(in[i] * scale);
+        }
+    }
+
+    static void int16_to_float_scalar(const int16_t *in, float *out, size_t n,
+                                      float scale)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = (float)in[i] * scale;
+        }
+    }
+
+    // IEEE binary16, rounding to nearest even, as F16C's vcvtps2ph
+    // does: overflow gives infinity, NaNs are quieted keeping the top
+    // of their payload.
+    static inline uint16_t half_scalar(float f)
+    {
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        uint16_t sign = (x >> 16) & 0x8000;
+        uint32_t mant = x & 0x007fffff;
+        int e = (int)((x >> 23) & 0xff) - 127 + 15;
+
+        if (e == 0xff - 127 + 15)
+        {
+            return sign | 0x7c00 | (mant ? 0x0200 | (mant >> 13) : 0);
+        }
+
+        if (e >= 0x1f)
+        {
+            return sign | 0x7c00;
+        }
+
+        uint32_t shift = 13;
+        uint32_t h;
+
+        if (e > 0)
+        {
+            h = (e << 10) | (mant >> 13);
+        }
+        else if (e >= -10)
+        {
+            // A subnormal half; the implicit bit becomes explicit.
+            mant |= 0x00800000;
+            shift = 14 - e;
+            h = mant >> shift;
+        }
+        else
+        {
+            return sign;
+        }
+
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+
+        // A carry out of the mantissa correctly bumps the exponent,
+        // to infinity if need be.
+        if (rem > halfway || (rem == halfway && (h & 1)))
+        {
+            ++h;
+        }
+
+        return sign | h;
+    }
+
+    static inline float float_from_half_scalar(uint16_t h)
+    {
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t e = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x03ff;
+        uint32_t x;
+
+        if (e == 0x1f)
+        {
+            x = sign | 0x7f800000 | (mant ? 0x00400000 | (mant << 13) : 0);
+        }
+        else if (e == 0)
+        {
+            // Zero or subnormal: mant x 2^-24, exactly.
+            float f = (float)mant * (1.0f / 16777216.0f);
+            memcpy(&x, &f, sizeof(x));
+            x |= sign;
+        }
+        else
+        {
+            x = sign | ((e + 127 - 15) << 23) | (mant << 13);
+        }
+
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    static void float_to_half_scalar(const float *in, uint16_t *out, size_t n,
+                                     float scale)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = half_scalar(in[i] * scale);
+        }
+    }
+
+    static void half_to_float_scalar(const uint16_t *in, float *out, size_t n,
+                                     float scale)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = float_from_half_scalar(in[i]) * scale;
+        }
+    }
+
+#if defined(SDRM_X86_KERNELS)
+
+    /********************************************************************
+     * SSE2: 2 complex or 4 real values at a time.
+     ********************************************************************/
+
+    __attribute__((target("sse2")))
+    static void apply_window_sse2(const complex_float_t *in, const float *w,
+                                  complex_float_t *out, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128 x = _mm_loadu_ps((const float *)(in + i));
+            __m128 wv = _mm_castpd_ps(_mm_load_sd((const double *)(w + i)));
+            wv = _mm_unpacklo_ps(wv, wv);
+            _mm_storeu_ps((float *)(out + i), _mm_mul_ps(x, wv));
+        }
+
+        apply_window_scalar(in + i, w + i, out + i, n - i);
+    }
+
+    __attribute__((target("sse2")))
+    static void multiply_accumulate_sse2(const complex_float_t *in,
+                                         const float *h,
+                                         complex_float_t *acc, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128 x = _mm_loadu_ps((const float *)(in + i));
+            __m128 hv = _mm_castpd_ps(_mm_load_sd((const double *)(h + i)));
+            hv = _mm_unpacklo_ps(hv, hv);
+            __m128 a = _mm_loadu_ps((const float *)(acc + i));
+            _mm_storeu_ps((float *)(acc + i), _mm_add_ps(a, _mm_mul_ps(x, hv)));
+        }
+
+        multiply_accumulate_scalar(in + i, h + i, acc + i, n - i);
+    }
+
+    // a * b for 2 complex values, as scalar: the product with b's real
+    // parts duplicated, plus the product of a swapped with b's
+    // imaginary parts duplicated and the real results negated.
+    __attribute__((target("sse2")))
+    static inline __m128 cmul2_sse2(__m128 a, __m128 b)
+    {
+        const __m128 neg_re = _mm_castsi128_ps(
+            _mm_setr_epi32(0x80000000, 0, 0x80000000, 0));
+        __m128 b_re = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 b_im = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 a_sw = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_add_ps(_mm_mul_ps(a, b_re),
+                          _mm_xor_ps(_mm_mul_ps(a_sw, b_im), neg_re));
+    }
+
+    __attribute__((target("sse2")))
+    static void complex_multiply_sse2(const complex_float_t *a,
+                                      const complex_float_t *b,
+                                      complex_float_t *out, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128 r = cmul2_sse2(_mm_loadu_ps((const float *)(a + i)),
+                                  _mm_loadu_ps((const float *)(b + i)));
+            _mm_storeu_ps((float *)(out + i), r);
+        }
+
+        complex_multiply_scalar(a + i, b + i, out + i, n - i);
+    }
+
+    __attribute__((target("sse2")))
+    static complex_float_t dot_product_sse2(const complex_float_t *x,
+                                            const float *h, size_t n)
+    {
+        __m128 acc[4] = {_mm_setzero_ps(), _mm_setzero_ps(),
+                         _mm_setzero_ps(), _mm_setzero_ps()};
+        size_t i = 0;
+
+        for (; i + DOT_LANES <= n; i += DOT_LANES)
+        {
+            for (size_t v = 0; v < 4; ++v)
+            {
+                __m128 xv = _mm_loadu_ps((const float *)(x + i + 2 * v));
+                __m128 hv = _mm_castpd_ps(
+                    _mm_load_sd((const double *)(h + i + 2 * v)));
+                hv = _mm_unpacklo_ps(hv, hv);
+                acc[v] = _mm_add_ps(acc[v], _mm_mul_ps(xv, hv));
+            }
+        }
+
+        float lanes[2 * DOT_LANES];
+
+        for (size_t v = 0; v < 4; ++v)
+        {
+            _mm_storeu_ps(lanes + 4 * v, acc[v]);
+        }
+
+        dot_tail(x, h, i, n, lanes);
+        return dot_combine(lanes);
+    }
+
+    // |X|^2 of 4 complex values, as re * re + im * im.
+    __attribute__((target("sse2")))
+    static inline __m128 power4_sse2(const complex_float_t *in)
+    {
+        __m128 a = _mm_loadu_ps((const float *)in);
+        __m128 b = _mm_loadu_ps((const float *)(in + 2));
+        __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        return _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im));
+    }
+
+    __attribute__((target("sse2")))
+    static void magnitude_squared_sse2(const complex_float_t *in, float *out,
+                                       size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_ps(out + i, power4_sse2(in + i));
+        }
+
+        magnitude_squared_scalar(in + i, out + i, n - i);
+    }
+
+    __attribute__((target("sse2")))
+    static void accumulate_power_sse2(const complex_float_t *in, float *acc,
+                                      size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 a = _mm_loadu_ps(acc + i);
+            _mm_storeu_ps(acc + i, _mm_add_ps(a, power4_sse2(in + i)));
+        }
+
+        accumulate_power_scalar(in + i, acc + i, n - i);
+    }
+
+    __attribute__((target("sse2")))
+    static void power_to_db_sse2(const float *in, float *out, size_t n,
+                                 float scale)
+    {
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 floor = _mm_set1_ps(POWER_FLOOR);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128i mant_mask = _mm_set1_epi32(0x007fffff);
+        const __m128i one_bits = _mm_set1_epi32(0x3f800000);
+        const __m128i bias = _mm_set1_epi32(127);
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 q = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vscale), floor);
+            __m128i bits = _mm_castps_si128(q);
+            __m128 e = _mm_cvtepi32_ps(
+                _mm_sub_epi32(_mm_srli_epi32(bits, 23), bias));
+            __m128 m = _mm_castsi128_ps(
+                _mm_or_si128(_mm_and_si128(bits, mant_mask), one_bits));
+            __m128 s = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+            __m128 s2 = _mm_mul_ps(s, s);
+            __m128 p = _mm_add_ps(_mm_set1_ps(LN_C9),
+                                  _mm_mul_ps(s2, _mm_set1_ps(LN_C11)));
+            p = _mm_add_ps(_mm_set1_ps(LN_C7), _mm_mul_ps(s2, p));
+            p = _mm_add_ps(_mm_set1_ps(LN_C5), _mm_mul_ps(s2, p));
+            p = _mm_add_ps(_mm_set1_ps(LN_C3), _mm_mul_ps(s2, p));
+            p = _mm_add_ps(_mm_set1_ps(LN_C1), _mm_mul_ps(s2, p));
+            p = _mm_mul_ps(s, p);
+            __m128 db = _mm_add_ps(_mm_mul_ps(e, _mm_set1_ps(DB_PER_OCTAVE)),
+                                   _mm_mul_ps(p, _mm_set1_ps(DB_PER_NEPER)));
+            _mm_storeu_ps(out + i, db);
+        }
+
+        power_to_db_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("sse2")))
+    static float peak_magnitude_sse2(const float *in, size_t n)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 m = _mm_setzero_ps();
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            m = _mm_max_ps(_mm_andnot_ps(sign, _mm_loadu_ps(in + i)), m);
+        }
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, m);
+        float m_lanes = peak_magnitude_scalar(lanes, 4);
+        float m_rest = peak_magnitude_scalar(in + i, n - i);
+        return m_rest > m_lanes ? m_rest : m_lanes;
+    }
+
+    __attribute__((target("sse2")))
+    static void float_to_int16_sse2(const float *in, int16_t *out, size_t n,
+                                    float scale)
+    {
+        const __m128 vscale = _mm_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), vscale));
+            __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4),
+                                                   vscale));
+            _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+        }
+
+        float_to_int16_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("sse2")))
+    static void int16_to_float_sse2(const int16_t *in, float *out, size_t n,
+                                    float scale)
+    {
+        const __m128 vscale = _mm_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+            // Sign extended by an arithmetic shift of each value from
+            // the top half of a 32 bit lane.
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+        }
+
+        int16_to_float_scalar(in + i, out + i, n - i, scale);
+    }
+
+    /********************************************************************
+     * AVX2: 4 complex or 8 real values at a time.
+     ********************************************************************/
+
+    __attribute__((target("avx2")))
+    static void apply_window_avx2(const complex_float_t *in, const float *w,
+                                  complex_float_t *out, size_t n)
+    {
+        const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256 x = _mm256_loadu_ps((const float *)(in + i));
+            __m256 wv = _mm256_permutevar8x32_ps(
+                _mm256_castps128_ps256(_mm_loadu_ps(w + i)), dup);
+            _mm256_storeu_ps((float *)(out + i), _mm256_mul_ps(x, wv));
+        }
+
+        apply_window_scalar(in + i, w + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void multiply_accumulate_avx2(const complex_float_t *in,
+                                         const float *h,
+                                         complex_float_t *acc, size_t n)
+    {
+        const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256 x = _mm256_loadu_ps((const float *)(in + i));
+            __m256 hv = _mm256_permutevar8x32_ps(
+                _mm256_castps128_ps256(_mm_loadu_ps(h + i)), dup);
+            __m256 a = _mm256_loadu_ps((const float *)(acc + i));
+            _mm256_storeu_ps((float *)(acc + i),
+                             _mm256_add_ps(a, _mm256_mul_ps(x, hv)));
+        }
+
+        multiply_accumulate_scalar(in + i, h + i, acc + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void complex_multiply_avx2(const complex_float_t *a,
+                                      const complex_float_t *b,
+                                      complex_float_t *out, size_t n)
+    {
+        const __m256 neg_re = _mm256_castsi256_ps(
+            _mm256_setr_epi32(0x80000000, 0, 0x80000000, 0,
+                              0x80000000, 0, 0x80000000, 0));
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256 av = _mm256_loadu_ps((const float *)(a + i));
+            __m256 bv = _mm256_loadu_ps((const float *)(b + i));
+            __m256 b_re = _mm256_shuffle_ps(bv, bv, _MM_SHUFFLE(2, 2, 0, 0));
+            __m256 b_im = _mm256_shuffle_ps(bv, bv, _MM_SHUFFLE(3, 3, 1, 1));
+            __m256 a_sw = _mm256_shuffle_ps(av, av, _MM_SHUFFLE(2, 3, 0, 1));
+            __m256 r = _mm256_add_ps(_mm256_mul_ps(av, b_re),
+                                     _mm256_xor_ps(_mm256_mul_ps(a_sw, b_im),
+                                                   neg_re));
+            _mm256_storeu_ps((float *)(out + i), r);
+        }
+
+        complex_multiply_scalar(a + i, b + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static complex_float_t dot_product_avx2(const complex_float_t *x,
+                                            const float *h, size_t n)
+    {
+        const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        __m256 acc[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+        size_t i = 0;
+
+        for (; i + DOT_LANES <= n; i += DOT_LANES)
+        {
+            for (size_t v = 0; v < 2; ++v)
+            {
+                __m256 xv = _mm256_loadu_ps((const float *)(x + i + 4 * v));
+                __m256 hv = _mm256_permutevar8x32_ps(
+                    _mm256_castps128_ps256(_mm_loadu_ps(h + i + 4 * v)), dup);
+                acc[v] = _mm256_add_ps(acc[v], _mm256_mul_ps(xv, hv));
+            }
+        }
+
+        float lanes[2 * DOT_LANES];
+        _mm256_storeu_ps(lanes, acc[0]);
+        _mm256_storeu_ps(lanes + 8, acc[1]);
+        dot_tail(x, h, i, n, lanes);
+        return dot_combine(lanes);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256 power8_avx2(const complex_float_t *in)
+    {
+        __m256 a = _mm256_loadu_ps((const float *)in);
+        __m256 b = _mm256_loadu_ps((const float *)(in + 4));
+        // Within each 128 bit lane; leaves the values in the order
+        // 0 1 4 5 2 3 6 7, put right by the permute.
+        __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 p = _mm256_add_ps(_mm256_mul_ps(re, re), _mm256_mul_ps(im, im));
+        return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p),
+                                                      _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    __attribute__((target("avx2")))
+    static void magnitude_squared_avx2(const complex_float_t *in, float *out,
+                                       size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(out + i, power8_avx2(in + i));
+        }
+
+        magnitude_squared_scalar(in + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void accumulate_power_avx2(const complex_float_t *in, float *acc,
+                                      size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 a = _mm256_loadu_ps(acc + i);
+            _mm256_storeu_ps(acc + i, _mm256_add_ps(a, power8_avx2(in + i)));
+        }
+
+        accumulate_power_scalar(in + i, acc + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void power_to_db_avx2(const float *in, float *out, size_t n,
+                                 float scale)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        const __m256 floor = _mm256_set1_ps(POWER_FLOOR);
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256i mant_mask = _mm256_set1_epi32(0x007fffff);
+        const __m256i one_bits = _mm256_set1_epi32(0x3f800000);
+        const __m256i bias = _mm256_set1_epi32(127);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 q = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i),
+                                                   vscale), floor);
+            __m256i bits = _mm256_castps_si256(q);
+            __m256 e = _mm256_cvtepi32_ps(
+                _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias));
+            __m256 m = _mm256_castsi256_ps(
+                _mm256_or_si256(_mm256_and_si256(bits, mant_mask), one_bits));
+            __m256 s = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+            __m256 s2 = _mm256_mul_ps(s, s);
+            __m256 p = _mm256_add_ps(_mm256_set1_ps(LN_C9),
+                                     _mm256_mul_ps(s2, _mm256_set1_ps(LN_C11)));
+            p = _mm256_add_ps(_mm256_set1_ps(LN_C7), _mm256_mul_ps(s2, p));
+            p = _mm256_add_ps(_mm256_set1_ps(LN_C5), _mm256_mul_ps(s2, p));
+            p = _mm256_add_ps(_mm256_set1_ps(LN_C3), _mm256_mul_ps(s2, p));
+            p = _mm256_add_ps(_mm256_set1_ps(LN_C1), _mm256_mul_ps(s2, p));
+            p = _mm256_mul_ps(s, p);
+            __m256 db = _mm256_add_ps(
+                _mm256_mul_ps(e, _mm256_set1_ps(DB_PER_OCTAVE)),
+                _mm256_mul_ps(p, _mm256_set1_ps(DB_PER_NEPER)));
+            _mm256_storeu_ps(out + i, db);
+        }
+
+        power_to_db_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx2")))
+    static float peak_magnitude_avx2(const float *in, size_t n)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256 m = _mm256_setzero_ps();
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            m = _mm256_max_ps(_mm256_andnot_ps(sign, _mm256_loadu_ps(in + i)), m);
+        }
+
+        float lanes[8];
+        _mm256_storeu_ps(lanes, m);
+        float m_lanes = peak_magnitude_scalar(lanes, 8);
+        float m_rest = peak_magnitude_scalar(in + i, n - i);
+        return m_rest > m_lanes ? m_rest : m_lanes;
+    }
+
+    __attribute__((target("avx2")))
+    static void float_to_int16_avx2(const float *in, int16_t *out, size_t n,
+                                    float scale)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i a = _mm256_cvtps_epi32(
+                _mm256_mul_ps(_mm256_loadu_ps(in + i), vscale));
+            __m256i b = _mm256_cvtps_epi32(
+                _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), vscale));
+            // Packs within 128 bit lanes; the permute puts them in order.
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                                 _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i *)(out + i), p);
+        }
+
+        float_to_int16_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx2")))
+    static void int16_to_float_avx2(const int16_t *in, float *out, size_t n,
+                                    float scale)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i x = _mm256_cvtepi16_epi32(
+                _mm_loadu_si128((const __m128i *)(in + i)));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x),
+                                                    vscale));
+        }
+
+        int16_to_float_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static void float_to_half_avx2(const float *in, uint16_t *out, size_t n,
+                                   float scale)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i h = _mm256_cvtps_ph(
+                _mm256_mul_ps(_mm256_loadu_ps(in + i), vscale),
+                _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128((__m128i *)(out + i), h);
+        }
+
+        float_to_half_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static void half_to_float_avx2(const uint16_t *in, float *out, size_t n,
+                                   float scale)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 f = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i)));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(f, vscale));
+        }
+
+        half_to_float_scalar(in + i, out + i, n - i, scale);
+    }
+
+    /********************************************************************
+     * AVX-512: 8 complex or 16 real values at a time.
+     ********************************************************************/
+
+    __attribute__((target("avx512f")))
+    static void apply_window_avx512(const complex_float_t *in, const float *w,
+                                    complex_float_t *out, size_t n)
+    {
+        const __m512i dup = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3,
+                                              4, 4, 5, 5, 6, 6, 7, 7);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m512 x = _mm512_loadu_ps((const float *)(in + i));
+            __m512 wv = _mm512_permutexvar_ps(
+                dup, _mm512_castps256_ps512(_mm256_loadu_ps(w + i)));
+            _mm512_storeu_ps((float *)(out + i), _mm512_mul_ps(x, wv));
+        }
+
+        apply_window_scalar(in + i, w + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static void multiply_accumulate_avx512(const complex_float_t *in,
+                                           const float *h,
+                                           complex_float_t *acc, size_t n)
+    {
+        const __m512i dup = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3,
+                                              4, 4, 5, 5, 6, 6, 7, 7);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m512 x = _mm512_loadu_ps((const float *)(in + i));
+            __m512 hv = _mm512_permutexvar_ps(
+                dup, _mm512_castps256_ps512(_mm256_loadu_ps(h + i)));
+            __m512 a = _mm512_loadu_ps((const float *)(acc + i));
+            _mm512_storeu_ps((float *)(acc + i),
+                             _mm512_add_ps(a, _mm512_mul_ps(x, hv)));
+        }
+
+        multiply_accumulate_scalar(in + i, h + i, acc + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static void complex_multiply_avx512(const complex_float_t *a,
+                                        const complex_float_t *b,
+                                        complex_float_t *out, size_t n)
+    {
+        const __m512i neg_re = _mm512_setr_epi32(
+            0x80000000, 0, 0x80000000, 0, 0x80000000, 0, 0x80000000, 0,
+            0x80000000, 0, 0x80000000, 0, 0x80000000, 0, 0x80000000, 0);
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m512 av = _mm512_loadu_ps((const float *)(a + i));
+            __m512 bv = _mm512_loadu_ps((const float *)(b + i));
+            __m512 b_re = _mm512_shuffle_ps(bv, bv, _MM_SHUFFLE(2, 2, 0, 0));
+            __m512 b_im = _mm512_shuffle_ps(bv, bv, _MM_SHUFFLE(3, 3, 1, 1));
+            __m512 a_sw = _mm512_shuffle_ps(av, av, _MM_SHUFFLE(2, 3, 0, 1));
+            // AVX-512F has no float xor; flip the signs as integers.
+            __m512 t = _mm512_castsi512_ps(_mm512_xor_si512(
+                _mm512_castps_si512(_mm512_mul_ps(a_sw, b_im)), neg_re));
+            _mm512_storeu_ps((float *)(out + i),
+                             _mm512_add_ps(_mm512_mul_ps(av, b_re), t));
+        }
+
+        complex_multiply_scalar(a + i, b + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static complex_float_t dot_product_avx512(const complex_float_t *x,
+                                              const float *h, size_t n)
+    {
+        const __m512i dup = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3,
+                                              4, 4, 5, 5, 6, 6, 7, 7);
+        __m512 acc = _mm512_setzero_ps();
+        size_t i = 0;
+
+        for (; i + DOT_LANES <= n; i += DOT_LANES)
+        {
+            __m512 xv = _mm512_loadu_ps((const float *)(x + i));
+            __m512 hv = _mm512_permutexvar_ps(
+                dup, _mm512_castps256_ps512(_mm256_loadu_ps(h + i)));
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(xv, hv));
+        }
+
+        float lanes[2 * DOT_LANES];
+        _mm512_storeu_ps(lanes, acc);
+        dot_tail(x, h, i, n, lanes);
+        return dot_combine(lanes);
+    }
+
+    __attribute__((target("avx512f")))
+    static inline __m512 power16_avx512(const complex_float_t *in)
+    {
+        const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                               16, 18, 20, 22, 24, 26, 28, 30);
+        const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15,
+                                              17, 19, 21, 23, 25, 27, 29, 31);
+        __m512 a = _mm512_loadu_ps((const float *)in);
+        __m512 b = _mm512_loadu_ps((const float *)(in + 8));
+        __m512 re = _mm512_permutex2var_ps(a, even, b);
+        __m512 im = _mm512_permutex2var_ps(a, odd, b);
+        return _mm512_add_ps(_mm512_mul_ps(re, re), _mm512_mul_ps(im, im));
+    }
+
+    __attribute__((target("avx512f")))
+    static void magnitude_squared_avx512(const complex_float_t *in, float *out,
+                                         size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            _mm512_storeu_ps(out + i, power16_avx512(in + i));
+        }
+
+        magnitude_squared_scalar(in + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static void accumulate_power_avx512(const complex_float_t *in, float *acc,
+                                        size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512 a = _mm512_loadu_ps(acc + i);
+            _mm512_storeu_ps(acc + i, _mm512_add_ps(a, power16_avx512(in + i)));
+        }
+
+        accumulate_power_scalar(in + i, acc + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static void power_to_db_avx512(const float *in, float *out, size_t n,
+                                   float scale)
+    {
+        const __m512 vscale = _mm512_set1_ps(scale);
+        const __m512 floor = _mm512_set1_ps(POWER_FLOOR);
+        const __m512 one = _mm512_set1_ps(1.0f);
+        const __m512i mant_mask = _mm512_set1_epi32(0x007fffff);
+        const __m512i one_bits = _mm512_set1_epi32(0x3f800000);
+        const __m512i bias = _mm512_set1_epi32(127);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512 q = _mm512_max_ps(_mm512_mul_ps(_mm512_loadu_ps(in + i),
+                                                   vscale), floor);
+            __m512i bits = _mm512_castps_si512(q);
+            __m512 e = _mm512_cvtepi32_ps(
+                _mm512_sub_epi32(_mm512_srli_epi32(bits, 23), bias));
+            __m512 m = _mm512_castsi512_ps(
+                _mm512_or_si512(_mm512_and_si512(bits, mant_mask), one_bits));
+            __m512 s = _mm512_div_ps(_mm512_sub_ps(m, one), _mm512_add_ps(m, one));
+            __m512 s2 = _mm512_mul_ps(s, s);
+            __m512 p = _mm512_add_ps(_mm512_set1_ps(LN_C9),
+                                     _mm512_mul_ps(s2, _mm512_set1_ps(LN_C11)));
+            p = _mm512_add_ps(_mm512_set1_ps(LN_C7), _mm512_mul_ps(s2, p));
+            p = _mm512_add_ps(_mm512_set1_ps(LN_C5), _mm512_mul_ps(s2, p));
+            p = _mm512_add_ps(_mm512_set1_ps(LN_C3), _mm512_mul_ps(s2, p));
+            p = _mm512_add_ps(_mm512_set1_ps(LN_C1), _mm512_mul_ps(s2, p));
+            p = _mm512_mul_ps(s, p);
+            __m512 db = _mm512_add_ps(
+                _mm512_mul_ps(e, _mm512_set1_ps(DB_PER_OCTAVE)),
+                _mm512_mul_ps(p, _mm512_set1_ps(DB_PER_NEPER)));
+            _mm512_storeu_ps(out + i, db);
+        }
+
+        power_to_db_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx512f")))
+    static float peak_magnitude_avx512(const float *in, size_t n)
+    {
+        __m512 m = _mm512_setzero_ps();
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            m = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(in + i)), m);
+        }
+
+        float lanes[16];
+        _mm512_storeu_ps(lanes, m);
+        float m_lanes = peak_magnitude_scalar(lanes, 16);
+        float m_rest = peak_magnitude_scalar(in + i, n - i);
+        return m_rest > m_lanes ? m_rest : m_lanes;
+    }
+
+    __attribute__((target("avx512f")))
+    static void float_to_int16_avx512(const float *in, int16_t *out, size_t n,
+                                      float scale)
+    {
+        const __m512 vscale = _mm512_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i a = _mm512_cvtps_epi32(
+                _mm512_mul_ps(_mm512_loadu_ps(in + i), vscale));
+            _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtsepi32_epi16(a));
+        }
+
+        float_to_int16_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx512f")))
+    static void int16_to_float_avx512(const int16_t *in, float *out, size_t n,
+                                      float scale)
+    {
+        const __m512 vscale = _mm512_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i x = _mm512_cvtepi16_epi32(
+                _mm256_loadu_si256((const __m256i *)(in + i)));
+            _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(x),
+                                                    vscale));
+        }
+
+        int16_to_float_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx512f")))
+    static void float_to_half_avx512(const float *in, uint16_t *out, size_t n,
+                                     float scale)
+    {
+        const __m512 vscale = _mm512_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i h = _mm512_cvtps_ph(
+                _mm512_mul_ps(_mm512_loadu_ps(in + i), vscale),
+                _MM_FROUND_TO_NEAREST_INT);
+            _mm256_storeu_si256((__m256i *)(out + i), h);
+        }
+
+        float_to_half_scalar(in + i, out + i, n - i, scale);
+    }
+
+    __attribute__((target("avx512f")))
+    static void half_to_float_avx512(const uint16_t *in, float *out, size_t n,
+                                     float scale)
+    {
+        const __m512 vscale = _mm512_set1_ps(scale);
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512 f = _mm512_cvtph_ps(
+                _mm256_loadu_si256((const __m256i *)(in + i)));
+            _mm512_storeu_ps(out + i, _mm512_mul_ps(f, vscale));
+        }
+
+        half_to_float_scalar(in + i, out + i, n - i, scale);
+    }
+
+#endif // SDRM_X86_KERNELS
+
+    /********************************************************************
+     * Dispatch
+     ********************************************************************/
+
+    struct simd_kernels_t
+    {
+        const char *name;
+        bool (*supported)();
+        void (*apply_window)(const complex_float_t *, const float *,
+                             complex_float_t *, size_t);
+        void (*multiply_accumulate)(const complex_float_t *, const float *,
+                                    complex_float_t *, size_t);
+        void (*complex_multiply)(const complex_float_t *,
+                                 const complex_float_t *,
+                                 complex_float_t *, size_t);
+        complex_float_t (*dot_product)(const complex_float_t *, const float *,
+                                       size_t);
+        void (*magnitude_squared)(const complex_float_t *, float *, size_t);
+        void (*accumulate_power)(const complex_float_t *, float *, size_t);
+        void (*power_to_db)(const float *, float *, size_t, float);
+        float (*peak_magnitude)(const float *, size_t);
+        void (*float_to_int16)(const float *, int16_t *, size_t, float);
+        void (*int16_to_float)(const int16_t *, float *, size_t, float);
+        void (*float_to_half)(const float *, uint16_t *, size_t, float);
+        void (*half_to_float)(const uint16_t *, float *, size_t, float);
+    };
+
+    static bool always() {return true;}
+
+#if defined(SDRM_X86_KERNELS)
+    static bool has_sse2() {return __builtin_cpu_supports("sse2");}
+    // F16C came with AVX2 in every x86 CPU; the AVX2 set uses both.
+    static bool has_avx2()
+    {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+    }
+    static bool has_avx512() {return __builtin_cpu_supports("avx512f");}
+#endif
+
+    // Best first.
+    static const simd_kernels_t kernel_sets[] =
+    {
+#if defined(SDRM_X86_KERNELS)
+        {"avx512", has_avx512, apply_window_avx512,
+         multiply_accumulate_avx512, complex_multiply_avx512,
+         dot_product_avx512, magnitude_squared_avx512,
+         accumulate_power_avx512, power_to_db_avx512,
+         peak_magnitude_avx512, float_to_int16_avx512, int16_to_float_avx512,
+         float_to_half_avx512, half_to_float_avx512},
+        {"avx2", has_avx2, apply_window_avx2,
+         multiply_accumulate_avx2, complex_multiply_avx2,
+         dot_product_avx2, magnitude_squared_avx2,
+         accumulate_power_avx2, power_to_db_avx2,
+         peak_magnitude_avx2, float_to_int16_avx2, int16_to_float_avx2,
+         float_to_half_avx2, half_to_float_avx2},
+        {"sse2", has_sse2, apply_window_sse2,
+         multiply_accumulate_sse2, complex_multiply_sse2,
+         dot_product_sse2, magnitude_squared_sse2,
+         accumulate_power_sse2, power_to_db_sse2,
+         peak_magnitude_sse2, float_to_int16_sse2, int16_to_float_sse2,
+         float_to_half_scalar, half_to_float_scalar},
+#endif
+        {"scalar", always, apply_window_scalar,
+         multiply_accumulate_scalar, complex_multiply_scalar,
+         dot_product_scalar, magnitude_squared_scalar,
+         accumulate_power_scalar, power_to_db_scalar,
+         peak_magnitude_scalar, float_to_int16_scalar, int16_to_float_scalar,
+         float_to_half_scalar, half_to_float_scalar}
+    };
+
+    static const size_t num_kernel_sets =
+        sizeof(kernel_sets) / sizeof(kernel_sets[0]);
+    static const simd_kernels_t &scalar_kernels = kernel_sets[num_kernel_sets - 1];
+
+    static const simd_kernels_t *best_kernels()
+    {
+        for (auto &k : kernel_sets)
+        {
+            if (k.supported())
+            {
+                return &k;
+            }
+        }
+
+        return &scalar_kernels;
+    }
+
+    static atomic<const simd_kernels_t *> active_kernels{best_kernels()};
+
+    /**
+     * Multiplies complex samples by a real window.
+     *
+     * @param in: The `n` samples.
+     *
+     * @param window: The `n` window coefficients.
+     *
+     * @param out: Receives the windowed samples. May be `in`.
+     *
+     * @param n: The number of samples.
+     *
+     */
+
+    void apply_window(const complex_float_t *in, const float *window,
+                      complex_float_t *out, size_t n)
+    {
+        active_kernels.load(memory_order_relaxed)->apply_window(in, window, out, n);
+    }
+
+    /**
+     * Multiplies complex samples by real coefficients and adds the
+     * products to `acc`: the inner loop of an FIR filter.
+     *
+     * @param in: The `n` samples.
+     *
+     * @param coeffs: The `n` coefficients.
+     *
+     * @param acc: The `n` sums to add to.
+     *
+     * @param n: The number of samples.
+     *
+     */
+
+    void multiply_accumulate(const complex_float_t *in, const float *coeffs,
+                             complex_float_t *acc, size_t n)
+    {
+        active_kernels.load(memory_order_relaxed)->multiply_accumulate(
+            in, coeffs, acc, n);
+    }
+
+    /**
+     * Multiplies complex values: out = a * b, element by element.
+     *
+     * @param a: The `n` first factors.
+     *
+     * @param b: The `n` second factors.
+     *
+     * @param out: Receives the products. May be `a` or `b`.
+     *
+     * @param n: The number of values.
+     *
+     */
+
+    void complex_multiply(const complex_float_t *a, const complex_float_t *b,
+                          complex_float_t *out, size_t n)
+    {
+        active_kernels.load(memory_order_relaxed)->complex_multiply(a, b, out, n);
+    }
+
+    /**
+     * The sum of complex samples times real coefficients: one output
+     * of an FIR filter.
+     *
+     * @param in: The `n` samples.
+     *
+     * @param coeffs: The `n` coefficients.
+     *
+     * @param n: The number of samples.
+     *
+     * @return The sum.
+     *
+     */
+
+    complex_float_t dot_product(const complex_float_t *in, const float *coeffs,
+                                size_t n)
+    {
+        return active_kernels.load(memory_order_relaxed)->dot_product(
+            in, coeffs, n);
+    }
+
+    /**
+     * Computes re^2 + im^2 of each of `n` complex values into `out`.
+     *
+     */
+
+    void magnitude_squared(const complex_float_t *in, float *out, size_t n)
+    {
+        active_kernels.load(memory_order_relaxed)->magnitude_squared(in, out, n);
+    }
+
+    /**
+     * Adds re^2 + im^2 of each of `n` complex values to `acc`.
+     *
+     */
+
+    void accumulate_power(const complex_float_t *in, float *acc, size_t n)
+    {
+        active_kernels.load(memory_order_relaxed)->accumulate_power(in, acc, n);
+    }
+
+    /**
+     * Converts power to dB: out = 10 log10(max(in * scale,
+     * POWER_FLOOR)). Good to about 1e-5 dB.
+     *
+     * @param in: The `n` power values.
+     *
+     * @param out: Receives the dB values. May be `in`.
+     *
+     * @param n: The number of values.
+     *
+     * @param scale: Applied to the power before conversion; saves a
+     * separate pass for normalization.
+     *
+     */
+
+    void power_to_db(const float *in, float *out, size_t n, float scale)
+    {
+        active_kernels.load(memory_order_relaxed)->power_to_db(in, out, n, scale);
+    }
+
+    /**
+     * The largest absolute value of `n` values; NaNs are ignored.
+     *
+     */
+
+    float peak_magnitude(const float *in, size_t n)
+    {
+        return active_kernels.load(memory_order_relaxed)->peak_magnitude(in, n);
+    }
+
+    /**
+     * Converts to int16: out = in * scale, rounded to nearest (even),
+     * saturated to [-32768, 32767]. NaN gives -32768.
+     *
+     * @param in: The `n` values.
+     *
+     * @param out: Receives the `n` integers.
+     *
+     * @param n: The number of values.
+     *
+     * @param scale: Applied before rounding.
+     *
+     */
+
+    void float_to_int16(const float *in, int16_t *out, size_t n, float scale)
+    {
+        active_kernels.load(memory_order_relaxed)->float_to_int16(
+            in, out, n, scale);
+    }
+
+    /**
+     * Converts from int16: out = in * scale.
+     *
+     */
+
+    void int16_to_float(const int16_t *in, float *out, size_t n, float scale)
+    {
+        active_kernels.load(memory_order_relaxed)->int16_to_float(
+            in, out, n, scale);
+    }
+
+    /**
+     * Converts to IEEE half precision: out = in * scale, rounded to
+     * nearest (even). Beyond +/-65504 gives infinity; below about
+     * 6e-8, zero.
+     *
+     * @param in: The `n` values.
+     *
+     * @param out: Receives the `n` binary16 values.
+     *
+     * @param n: The number of values.
+     *
+     * @param scale: Applied before conversion.
+     *
+     */
+
+    void float_to_half(const float *in, uint16_t *out, size_t n, float scale)
+    {
+        active_kernels.load(memory_order_relaxed)->float_to_half(
+            in, out, n, scale);
+    }
+
+    /**
+     * Converts from IEEE half precision: out = in * scale.
+     *
+     */
+
+    void half_to_float(const uint16_t *in, float *out, size_t n, float scale)
+    {
+        active_kernels.load(memory_order_relaxed)->half_to_float(
+            in, out, n, scale);
+    }
+
+    /**
+     * The name of the implementation in use: one of "avx512", "avx2",
+     * "sse2" or "scalar".
+     *
+     */
+
+    string simd_level()
+    {
+        return active_kernels.load()->name;
+    }
+
+    /**
+     * Selects an implementation, e.g. to compare performance or rule
+     * out a problem with one. The best the CPU supports is used by
+     * default.
+     *
+     * @param level: One of the names given by simd_levels_supported().
+     *
+     * @return false if `level` is unknown or unsupported by this CPU,
+     * in which case the implementation is unchanged.
+     *
+     */
+
+    bool set_simd_level(string level)
+    {
+        for (auto &k : kernel_sets)
+        {
+            if (level == k.name && k.supported())
+            {
+                active_kernels = &k;
+                return true;
+            }
+        }
+
+        logger.error(__PRETTY_FUNCTION__, "SIMD level", level,
+                     "unknown or unsupported on this CPU");
+        return false;
+    }
+
+    vector<string> simd_levels_supported()
+    {
+        vector<string> levels;
+
+        for (auto &k : kernel_sets)
+        {
+            if (k.supported())
+            {
+                levels.push_back(k.name);
+            }
+        }
+
+        return levels;
+    }
+
+    /**
+     * Checks every implementation the CPU supports against the scalar
+     * one, which must agree to the last bit, on random data of many
+     * lengths (to exercise the tail handling) and on awkward values:
+     * zeros, denormals, infinities, NaNs. Also checks the accuracy of
+     * the scalar power_to_db() against log10f().
+     *
+     * @return true if all checks passed. Failures are logged.
+     *
+     */
+
+    bool verify_simd_kernels()
+    {
+        mt19937 rng(12345);
+        uniform_real_distribution<float> value(-100.0f, 100.0f);
+        exponential_distribution<float> power(1.0f);
+        bool ok = true;
+
+        auto same = [](const float *a, const float *b, size_t n) -> bool
+            {
+                return memcmp(a, b, n * sizeof(float)) == 0;
+            };
+
+        for (size_t n = 0; n < 300; n = n < 40 ? n + 1 : n * 3 / 2)
+        {
+            vector<complex_float_t> x(n);
+            vector<float> w(n), p(n);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                x[i].re = value(rng);
+                x[i].im = value(rng);
+                w[i] = value(rng) / 100.0f;
+                p[i] = power(rng) * powf(10.0f, value(rng) / 5.0f);
+            }
+
+            // Awkward values, placed where they land in vector bodies
+            // and tails alike.
+            const float specials[] =
+                {0.0f, -0.0f, 1e-40f, -1.0f, INFINITY, NAN, 1e-30f, 3e38f};
+
+            for (size_t i = 0; i < n; i += 7)
+            {
+                p[i] = specials[(i / 7) % 8];
+            }
+
+            // Values to convert to int16 and half: the samples, at
+            // scales that both fit and overflow, with the specials.
+            vector<float> v((float *)x.data(), (float *)x.data() + 2 * n);
+            vector<int16_t> i16(2 * n), ref_i16(2 * n);
+            vector<uint16_t> f16(2 * n), ref_f16(2 * n);
+            vector<float> ref_conv(2 * n), conv(2 * n);
+
+            for (size_t i = 0; i < 2 * n; i += 5)
+            {
+                v[i] = specials[(i / 5) % 8];
+            }
+
+            for (size_t i = 0; i < 2 * n; ++i)
+            {
+                f16[i] = rng();
+            }
+
+            float ref_peak = peak_magnitude_scalar(v.data(), 2 * n);
+            float_to_int16_scalar(v.data(), ref_i16.data(), 2 * n, 400.0f);
+            int16_to_float_scalar(ref_i16.data(), ref_conv.data(), 2 * n, 0.25f);
+            float_to_half_scalar(v.data(), ref_f16.data(), 2 * n, 700.0f);
+            vector<float> ref_half(2 * n);
+            half_to_float_scalar(f16.data(), ref_half.data(), 2 * n, 0.5f);
+            // Halves and half ties, subnormals included.
+            vector<uint16_t> ref_f16_ties(2 * n);
+            float_to_half_scalar(ref_half.data(), ref_f16_ties.data(), 2 * n,
+                                 1.0f);
+
+            vector<complex_float_t> ref_cx(n), cx(n), ref_mac(x), mac(x);
+            vector<float> ref(n), out(n), ref_acc(p), acc(p);
+
+            apply_window_scalar(x.data(), w.data(), ref_cx.data(), n);
+            multiply_accumulate_scalar(x.data(), w.data(), ref_mac.data(), n);
+            vector<complex_float_t> ref_cmul(n);
+            complex_multiply_scalar(x.data(), ref_cx.data(), ref_cmul.data(), n);
+            complex_float_t ref_dot = dot_product_scalar(x.data(), w.data(), n);
+            magnitude_squared_scalar(x.data(), ref.data(), n);
+            accumulate_power_scalar(x.data(), ref_acc.data(), n);
+            vector<float> ref_db(n);
+            power_to_db_scalar(p.data(), ref_db.data(), n, 0.5f);
+
+            for (auto &k : kernel_sets)
+            {
+                if (not k.supported() or &k == &scalar_kernels)
+                {
+                    continue;
+                }
+
+                const char *failed = NULL;
+
+                k.apply_window(x.data(), w.data(), cx.data(), n);
+
+                if (not same((float *)cx.data(), (float *)ref_cx.data(), 2 * n))
+                {
+                    failed = "apply_window";
+                }
+
+                mac = x;
+                k.multiply_accumulate(x.data(), w.data(), mac.data(), n);
+
+                if (not same((float *)mac.data(), (float *)ref_mac.data(), 2 * n))
+                {
+                    failed = "multiply_accumulate";
+                }
+
+                k.complex_multiply(x.data(), ref_cx.data(), cx.data(), n);
+
+                if (not same((float *)cx.data(), (float *)ref_cmul.data(), 2 * n))
+                {
+                    failed = "complex_multiply";
+                }
+
+                complex_float_t dot = k.dot_product(x.data(), w.data(), n);
+
+                if (not same((float *)&dot, (float *)&ref_dot, 2))
+                {
+                    failed = "dot_product";
+                }
+
+                k.magnitude_squared(x.data(), out.data(), n);
+
+                if (not same(out.data(), ref.data(), n))
+                {
+                    failed = "magnitude_squared";
+                }
+
+                acc = p;
+                k.accumulate_power(x.data(), acc.data(), n);
+
+                if (not same(acc.data(), ref_acc.data(), n))
+                {
+                    failed = "accumulate_power";
+                }
+
+                k.power_to_db(p.data(), out.data(), n, 0.5f);
+
+                if (not same(out.data(), ref_db.data(), n))
+                {
+                    failed = "power_to_db";
+                }
+
+                float peak = k.peak_magnitude(v.data(), 2 * n);
+
+                if (not same(&peak, &ref_peak, 1))
+                {
+                    failed = "peak_magnitude";
+                }
+
+                k.float_to_int16(v.data(), i16.data(), 2 * n, 400.0f);
+
+                if (i16 != ref_i16)
+                {
+                    failed = "float_to_int16";
+                }
+
+                k.int16_to_float(ref_i16.data(), conv.data(), 2 * n, 0.25f);
+
+                if (not same(conv.data(), ref_conv.data(), 2 * n))
+                {
+                    failed = "int16_to_float";
+                }
+
+                vector<uint16_t> h(2 * n);
+                k.float_to_half(v.data(), h.data(), 2 * n, 700.0f);
+
+                if (h != ref_f16)
+                {
+                    failed = "float_to_half";
+                }
+
+                k.float_to_half(ref_half.data(), h.data(), 2 * n, 1.0f);
+
+                if (h != ref_f16_ties)
+                {
+                    failed = "float_to_half";
+                }
+
+                k.half_to_float(f16.data(), conv.data(), 2 * n, 0.5f);
+
+                if (not same(conv.data(), ref_half.data(), 2 * n))
+                {
+                    failed = "half_to_float";
+                }
+
+                if (failed)
+                {
+                    logger.error(__PRETTY_FUNCTION__, k.name, failed,
+                                 "differs from scalar for n =", n);
+                    ok = false;
+                }
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                float q = p[i] * 0.5f;
+
+                if (std::isfinite(q) && q >= POWER_FLOOR
+                    && fabs(ref_db[i] - 10.0f * log10f(q)) > 1e-4f)
+                {
+                    logger.error(__PRETTY_FUNCTION__, "power_to_db(", q, ") =",
+                                 ref_db[i], "; should be", 10.0f * log10f(q));
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        // Every half converts to float and back unchanged, but for
+        // signaling NaNs, which come back quieted.
+        for (uint32_t h = 0; h < 0x10000; ++h)
+        {
+            uint16_t back = half_scalar(float_from_half_scalar(h));
+            bool nan = (h & 0x7c00) == 0x7c00 && (h & 0x03ff);
+
+            if (back != (nan ? (h | 0x0200) : h))
+            {
+                logger.error(__PRETTY_FUNCTION__, "half", h, "converts back as",
+                             back);
+                ok = false;
+                break;
+            }
+        }
+
+        return ok;
+    }
+}
@@ -0,0 +1,65 @@
+/*******************************************************************
+ *  simd_kernels.h - Vectorized loops for the spectral processing:
+ *  windowing, |X|^2 and dB conversion, with the implementation chosen
+ *  at run time for the CPU.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_SIMD_KERNELS_H_)
+#define _SIMD_KERNELS_H_
+
+#include "sdrm_types.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    // The smallest power power_to_db() converts; anything less
+    // (including 0) gives the dB value of this.
+    const float POWER_FLOOR = 1e-30f;
+
+    // Every implementation gives results identical to the last bit to
+    // those of the scalar one. See verify_simd_kernels().
+
+    void apply_window(const complex_float_t *in, const float *window,
+                      complex_float_t *out, size_t n);
+    void multiply_accumulate(const complex_float_t *in, const float *coeffs,
+                             complex_float_t *acc, size_t n);
+    void complex_multiply(const complex_float_t *a, const complex_float_t *b,
+                          complex_float_t *out, size_t n);
+    complex_float_t dot_product(const complex_float_t *in, const float *coeffs,
+                                size_t n);
+    void magnitude_squared(const complex_float_t *in, float *out, size_t n);
+    void accumulate_power(const complex_float_t *in, float *acc, size_t n);
+    void power_to_db(const float *in, float *out, size_t n, float scale = 1.0f);
+    float peak_magnitude(const float *in, size_t n);
+    void float_to_int16(const float *in, int16_t *out, size_t n, float scale);
+    void int16_to_float(const int16_t *in, float *out, size_t n, float scale);
+    void float_to_half(const float *in, uint16_t *out, size_t n, float scale);
+    void half_to_float(const uint16_t *in, float *out, size_t n, float scale);
+
+    std::string simd_level();
+    bool set_simd_level(std::string level);
+    std::vector<std::string> simd_levels_supported();
+    bool verify_simd_kernels();
+}
+
+#endif
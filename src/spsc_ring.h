@@ -0,0 +1,140 @@
+/*******************************************************************
+ *  spsc_ring.h - A lock-free, bounded, single-producer
+ *  single-consumer ring buffer.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_SPSC_RING_H_)
+#define _SPSC_RING_H_
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace sdrm
+{
+    /**
+     * \class spsc_ring
+     *
+     * A fixed capacity FIFO that may be used without locks by exactly
+     * one producer thread (push()) and one consumer thread
+     * (pop()). Neither side ever blocks: push() fails if the ring is
+     * full, pop() fails if it is empty. The capacity is rounded up to
+     * a power of 2. Elements are assigned, not constructed, so T
+     * should be cheap to copy; in practice it is a pointer.
+     *
+     */
+
+    template <typename T>
+    class spsc_ring
+    {
+    public:
+        spsc_ring(size_t capacity)
+            : _head(0),
+              _tail(0)
+        {
+            size_t n = 1;
+
+            while (n < capacity)
+            {
+                n <<= 1;
+            }
+
+            _slots.resize(n);
+            _mask = n - 1;
+        }
+
+        /**
+         * Adds an element to the ring. Producer side only.
+         *
+         * @param v: The element to add.
+         *
+         * @return true if added, false if the ring was full.
+         *
+         */
+
+        bool push(const T &v)
+        {
+            size_t head = _head.load(std::memory_order_relaxed);
+
+            if (head - _tail.load(std::memory_order_acquire) > _mask)
+            {
+                return false;
+            }
+
+            _slots[head & _mask] = v;
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Removes the oldest element from the ring. Consumer side only.
+         *
+         * @param v: Receives the element.
+         *
+         * @return true if an element was removed, false if the ring
+         * was empty.
+         *
+         */
+
+        bool pop(T &v)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+
+            if (tail == _head.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+
+            v = _slots[tail & _mask];
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * The number of elements in the ring. May be called from any
+         * thread, but is only a snapshot.
+         *
+         */
+
+        size_t occupancy() const
+        {
+            size_t tail = _tail.load(std::memory_order_acquire);
+            return _head.load(std::memory_order_acquire) - tail;
+        }
+
+        size_t capacity() const
+        {
+            return _mask + 1;
+        }
+
+    private:
+        std::vector<T> _slots;
+        size_t _mask;
+        // Keep the two indices on separate cache lines so the
+        // producer and consumer don't bounce a line between them. This
+        // is padding rather than alignas() because we build as C++14,
+        // where operator new ignores over-alignment.
+        std::atomic<size_t> _head;
+        char _pad[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> _tail;
+    };
+}
+
+#endif
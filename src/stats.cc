@@ -0,0 +1,234 @@
+/*******************************************************************
+ *  stats.cc - Lock-free counters and latency histograms for streaming
+ *  telemetry.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "stats.h"
+
+using namespace std;
+
+namespace sdrm
+{
+    stats_histogram::stats_histogram()
+        : _count(0),
+          _sum(0),
+          _max(0),
+          _last_count(0),
+          _last_sum(0)
+    {
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            _buckets[i] = 0;
+            _last[i] = 0;
+        }
+    }
+
+    /**
+     * The upper limit of a bucket: the smallest value above it.
+     *
+     * @param b: The bucket, as returned by bucket().
+     *
+     * @return The limit, in ns.
+     *
+     */
+
+    uint64_t stats_histogram::bucket_limit(size_t b)
+    {
+        if (b < 4)
+        {
+            return b + 1;
+        }
+
+        size_t e = b / 4 + 1;
+        uint64_t width = 1ULL << (e - 2);
+        return (4 + b % 4) * width + width;
+    }
+
+    stats_group::stats_group()
+        : _last_report(stats_now())
+    {
+    }
+
+    stats_counter &stats_group::counter(string name)
+    {
+        auto &c = _counters[name];
+
+        if (not c)
+        {
+            c.reset(new stats_counter());
+        }
+
+        return *c;
+    }
+
+    stats_gauge &stats_group::gauge(string name)
+    {
+        auto &g = _gauges[name];
+
+        if (not g)
+        {
+            g.reset(new stats_gauge());
+        }
+
+        return *g;
+    }
+
+    stats_histogram &stats_group::histogram(string name)
+    {
+        auto &h = _histograms[name];
+
+        if (not h)
+        {
+            h.reset(new stats_histogram());
+        }
+
+        return *h;
+    }
+
+    /**
+     * Sets `name` in `node`, where each '.' in `name` descends into a
+     * nested map.
+     *
+     */
+
+    static void set_nested(YAML::Node node, const string &name, YAML::Node value)
+    {
+        size_t dot = name.find('.');
+
+        if (dot == string::npos)
+        {
+            node[name] = value;
+            return;
+        }
+
+        set_nested(node[name.substr(0, dot)], name.substr(dot + 1), value);
+    }
+
+    /**
+     * Adds the group's statistics to `node`. Counters give their total
+     * and their rate since the last report; gauges their value;
+     * histograms their total count, and the rate, mean, 50th, 90th and
+     * 99th percentiles and maximum of the values recorded since the
+     * last report, in microseconds.
+     *
+     * @param node: The map to add to.
+     *
+     */
+
+    void stats_group::report(YAML::Node &node)
+    {
+        // A copy of an empty node is a new node, not a handle to it.
+        if (node.IsNull())
+        {
+            node = YAML::Node(YAML::NodeType::Map);
+        }
+
+        uint64_t now = stats_now();
+        double seconds = (now - _last_report) / 1e9;
+        _last_report = now;
+
+        if (seconds <= 0.0)
+        {
+            seconds = 1e-9;
+        }
+
+        for (auto &c : _counters)
+        {
+            uint64_t v = c.second->value();
+            YAML::Node n;
+            n["total"] = v;
+            n["per_s"] = (v - c.second->_last) / seconds;
+            c.second->_last = v;
+            set_nested(node, c.first, n);
+        }
+
+        for (auto &g : _gauges)
+        {
+            set_nested(node, g.first, YAML::Node(g.second->value()));
+        }
+
+        for (auto &h : _histograms)
+        {
+            stats_histogram &s = *h.second;
+            uint64_t counts[stats_histogram::BUCKETS];
+            uint64_t interval = 0;
+
+            // The buckets are read one by one while they may still be
+            // counting, so the interval is taken as their sum rather
+            // than from _count.
+            for (size_t i = 0; i < stats_histogram::BUCKETS; ++i)
+            {
+                uint64_t v = s._buckets[i].load(memory_order_relaxed);
+                counts[i] = v - s._last[i];
+                s._last[i] = v;
+                interval += counts[i];
+            }
+
+            uint64_t count = s._count.load(memory_order_relaxed);
+            uint64_t sum = s._sum.load(memory_order_relaxed);
+            uint64_t max = s._max.exchange(0, memory_order_relaxed);
+            YAML::Node n;
+            n["count"] = count;
+            n["per_s"] = (count - s._last_count) / seconds;
+
+            if (count > s._last_count)
+            {
+                n["mean_us"] =
+                    (sum - s._last_sum) / (count - s._last_count) / 1e3;
+            }
+
+            s._last_count = count;
+            s._last_sum = sum;
+
+            const double pct[] = {0.5, 0.9, 0.99};
+            const char *names[] = {"p50_us", "p90_us", "p99_us"};
+            size_t b = 0;
+            uint64_t seen = 0;
+
+            for (size_t p = 0; p < 3 && interval > 0; ++p)
+            {
+                uint64_t rank = (uint64_t)(pct[p] * interval + 0.5);
+
+                if (rank == 0)
+                {
+                    rank = 1;
+                }
+
+                while (b < stats_histogram::BUCKETS - 1
+                       && seen + counts[b] < rank)
+                {
+                    seen += counts[b++];
+                }
+
+                // The bucket's limit, but no more than the largest
+                // value seen.
+                uint64_t v = stats_histogram::bucket_limit(b);
+                n[names[p]] = (max > 0 && max < v ? max : v) / 1e3;
+            }
+
+            if (interval > 0)
+            {
+                n["max_us"] = max / 1e3;
+            }
+
+            set_nested(node, h.first, n);
+        }
+    }
+}
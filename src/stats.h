@@ -0,0 +1,264 @@
+/*******************************************************************
+ *  stats.h - Lock-free counters and latency histograms for streaming
+ *  telemetry.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_STATS_H_)
+#define _STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <time.h>
+#include <yaml-cpp/yaml.h>
+
+namespace sdrm
+{
+    /**
+     * A monotonic clock for timing the hot path, in ns. Unlike
+     * Time::getUTC() it never steps when the host clock is adjusted.
+     *
+     */
+
+    inline uint64_t stats_now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /**
+     * \class stats_counter
+     *
+     * An event count, reported as a total and a rate. add() is one
+     * relaxed atomic add, so any number of threads may count.
+     *
+     */
+
+    class stats_counter
+    {
+    public:
+        stats_counter() : _value(0), _last(0) {}
+
+        void add(uint64_t n = 1)
+        {
+            _value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // For totals kept elsewhere, e.g. by a library.
+        void set(uint64_t v)
+        {
+            _value.store(v, std::memory_order_relaxed);
+        }
+
+        uint64_t value() const
+        {
+            return _value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        friend class stats_group;
+        std::atomic<uint64_t> _value;
+        // value at the last report; the reporter's only.
+        uint64_t _last;
+    };
+
+    /**
+     * \class stats_sequence
+     *
+     * Counts the messages missing from a sequence-numbered stream, in
+     * a counter. A sequence number lower than expected is taken as the
+     * source restarting.
+     *
+     */
+
+    class stats_sequence
+    {
+    public:
+        stats_sequence(stats_counter &lost)
+            : _lost(lost), _next(0), _valid(false) {}
+
+        // A message numbered `sequence`, holding `count` numbers.
+        void received(uint64_t sequence, uint64_t count = 1)
+        {
+            if (_valid && sequence > _next)
+            {
+                _lost.add(sequence - _next);
+            }
+
+            _next = sequence + count;
+            _valid = true;
+        }
+
+        void reset()
+        {
+            _valid = false;
+        }
+
+    private:
+        stats_counter &_lost;
+        uint64_t _next;
+        bool _valid;
+    };
+
+    /**
+     * \class stats_gauge
+     *
+     * A level, such as a queue's occupancy, reported as it is.
+     *
+     */
+
+    class stats_gauge
+    {
+    public:
+        stats_gauge() : _value(0) {}
+
+        void set(uint64_t v)
+        {
+            _value.store(v, std::memory_order_relaxed);
+        }
+
+        // Raises the gauge to `v`, for high water marks. Single writer.
+        void raise(uint64_t v)
+        {
+            if (v > _value.load(std::memory_order_relaxed))
+            {
+                _value.store(v, std::memory_order_relaxed);
+            }
+        }
+
+        uint64_t value() const
+        {
+            return _value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint64_t> _value;
+    };
+
+    /**
+     * \class stats_histogram
+     *
+     * A distribution of durations in ns, in log-linear buckets: four
+     * per power of 2, so that a percentile read from it is within 25%
+     * of the true one. record() is a few relaxed atomic adds and takes
+     * no lock, so any number of threads may record.
+     *
+     * Reports give the count and rate, and the mean, percentiles and
+     * maximum of the values recorded since the previous report.
+     *
+     */
+
+    class stats_histogram
+    {
+    public:
+        // up to 2^41 ns, about 37 minutes.
+        static const size_t BUCKETS = 160;
+
+        stats_histogram();
+
+        void record(uint64_t ns)
+        {
+            _buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+            _count.fetch_add(1, std::memory_order_relaxed);
+            _sum.fetch_add(ns, std::memory_order_relaxed);
+
+            uint64_t m = _max.load(std::memory_order_relaxed);
+
+            while (ns > m && !_max.compare_exchange_weak(
+                       m, ns, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        uint64_t count() const
+        {
+            return _count.load(std::memory_order_relaxed);
+        }
+
+        static size_t bucket(uint64_t ns)
+        {
+            if (ns < 4)
+            {
+                return ns;
+            }
+
+            size_t e = 63 - __builtin_clzll(ns);
+            size_t b = 4 * (e - 1) + ((ns >> (e - 2)) & 3);
+            return b < BUCKETS ? b : BUCKETS - 1;
+        }
+
+        static uint64_t bucket_limit(size_t b);
+
+    private:
+        friend class stats_group;
+        std::atomic<uint64_t> _buckets[BUCKETS];
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _sum;
+        std::atomic<uint64_t> _max;
+        // the counts at the last report; the reporter's only.
+        uint64_t _last[BUCKETS];
+        uint64_t _last_count;
+        uint64_t _last_sum;
+    };
+
+    /**
+     * \class stats_group
+     *
+     * A named set of counters, gauges and histograms, reported
+     * together as one YAML map. Statistics are created by name before
+     * streaming starts, and the hot path keeps references to them;
+     * they live as long as the group. Names may contain '.', which
+     * nests them in the report.
+     *
+     * Creating statistics and reporting are not thread safe, and
+     * should be done by one thread, or under the owner's lock.
+     *
+     */
+
+    class stats_group
+    {
+    public:
+        stats_group();
+
+        stats_counter &counter(std::string name);
+        stats_gauge &gauge(std::string name);
+        stats_histogram &histogram(std::string name);
+
+        void report(YAML::Node &node);
+
+        // true if `interval` ns (0: never) have passed since the last
+        // report.
+        bool due(uint64_t interval) const
+        {
+            return interval > 0 && stats_now() - _last_report >= interval;
+        }
+
+    private:
+        uint64_t _last_report;
+        std::map<std::string, std::unique_ptr<stats_counter>> _counters;
+        std::map<std::string, std::unique_ptr<stats_gauge>> _gauges;
+        std::map<std::string, std::unique_ptr<stats_histogram>> _histograms;
+    };
+}
+
+#endif
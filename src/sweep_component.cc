@@ -0,0 +1,638 @@
+/*******************************************************************
+ *  sweep_component.cc - Sweeps a radio across a band, and stitches
+ *  the spectra into one.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "sweep_component.h"
+#include "sdrm_config.h"
+#include "simd_kernels.h"
+#include "trace.h"
+#include "matrix/log_t.h"
+
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+using namespace matrix;
+
+static matrix::log_t logger("SweepComponent");
+
+Component *SweepComponent::factory(std::string name, std::string km_url)
+{
+    return new SweepComponent(name, km_url);
+}
+
+SweepComponent::SweepComponent(std::string name, std::string keymaster_url) :
+    Component(name, keymaster_url),
+    _run(false),
+    _run_thread_started(false),
+    _run_thread(this, &SweepComponent::receiving_task),
+    sweep_source(keymaster_url, name, "sweep_data"),
+    _state(WAITING),
+    _hop(0),
+    _epoch(0),
+    _settle_left(0),
+    _dropped(0),
+    _tune_sent(0),
+    _tune_sent_utc(0),
+    _requests(0),
+    _hop_done(false),
+    _sweep_sequence(0),
+    _sweep_start(0),
+    _sweep_index(0),
+    _sweep_timestamp(0),
+    _stat_received(_stats.counter("received")),
+    _stat_hops(_stats.counter("hops")),
+    _stat_sweeps(_stats.counter("sweeps")),
+    _stat_stale(_stats.counter("stale_samples")),
+    _stat_settle(_stats.counter("settle_samples")),
+    _stat_timeouts(_stats.counter("tune_timeouts")),
+    _stat_restarts(_stats.counter("restarts")),
+    _stat_retune_gap(_stats.histogram("retune_gap")),
+    _stat_hop_time(_stats.histogram("hop_time")),
+    _stat_sweep_time(_stats.histogram("sweep_time"))
+{
+}
+
+SweepComponent::~SweepComponent()
+{
+}
+
+bool SweepComponent::_do_start()
+{
+    if (not setup())
+    {
+        return false;
+    }
+
+    connect();
+    _run = true;
+
+    if (!_run_thread.running())
+    {
+        logger.info(__PRETTY_FUNCTION__, "starting thread.");
+        _run_thread.start("Sweep _run_thread");
+    }
+
+    bool rval = _run_thread_started.wait(true, 5000000);
+
+    if (!rval)
+    {
+        logger.error(__PRETTY_FUNCTION__, "_run_thread failed to start!");
+        _run = false;
+        _run_thread.join();
+        _run_thread_started.set_value(false);
+        disconnect();
+    }
+
+    return rval;
+}
+
+bool SweepComponent::_do_stop()
+{
+    _run = false;
+    _run_thread.join();
+    _run_thread_started.set_value(false);
+    disconnect();
+    return true;
+}
+
+bool SweepComponent::connect()
+{
+    input_signal_sink.reset(
+        new matrix::DataSink<std::string,
+                            matrix::select_only>(keymaster_url, 10));
+    connect_sink(*input_signal_sink, "input_data");
+    return true;
+}
+
+bool SweepComponent::disconnect()
+{
+    input_signal_sink->disconnect();
+    input_signal_sink.reset();
+    return true;
+}
+
+/**
+ * Reads the configuration (see the class description), and works out
+ * the hops and the stitched spectrum's grid at the configured
+ * samplerate; see make_grid().
+ *
+ * @return false if the configuration is unusable.
+ *
+ */
+
+bool SweepComponent::setup()
+{
+    string base = my_full_instance_name + ".";
+
+    _device = sdrm::get_config<uint64_t>(keymaster, base + "device", 0);
+    _sample_rate = sdrm::get_config<double>(keymaster, base + "sample_rate",
+                                            768000.0);
+    _fft_size = sdrm::get_config<size_t>(keymaster, base + "fft_size", 1024);
+    string window = sdrm::get_config<string>(keymaster, base + "window", "hann");
+    double overlap = sdrm::get_config<double>(keymaster, base + "overlap", 0.5);
+    size_t integrations =
+        sdrm::get_config<size_t>(keymaster, base + "integrations", 8);
+    double edge_trim = sdrm::get_config<double>(keymaster, base + "edge_trim",
+                                                0.1);
+    _settle_time = sdrm::get_config<double>(keymaster, base + "settle_ms",
+                                            1.0) * 1e-3;
+    _tune_timeout = sdrm::get_config<double>(
+        keymaster, base + "tune_timeout_ms", 500.0) * 1000000;
+    string units = sdrm::get_config<string>(keymaster, base + "psd_units", "dB");
+    _wire_format = sdrm::wire_format_from_string(
+        sdrm::get_config<string>(keymaster, base + "wire_format", "msgpack"));
+    _stats_interval = sdrm::get_config<double>(
+        keymaster, base + "stats_interval_ms", 1000.0) * 1000000;
+    _hop_list = sdrm::get_config<vector<uint64_t>>(keymaster, base + "hops",
+                                                   vector<uint64_t>());
+    _start_hz = sdrm::get_config<double>(keymaster, base + "start_hz", 0.0);
+    _stop_hz = sdrm::get_config<double>(keymaster, base + "stop_hz", 0.0);
+
+    if (_device == 0)
+    {
+        logger.error(__PRETTY_FUNCTION__, "need device, the serial number",
+                     "of the radio to tune");
+        return false;
+    }
+
+    if (_fft_size < 2 or edge_trim < 0.0 or edge_trim >= 0.5
+        or _sample_rate <= 0.0)
+    {
+        logger.error(__PRETTY_FUNCTION__, "need fft_size >= 2,",
+                     "0 <= edge_trim < 0.5 and sample_rate > 0");
+        return false;
+    }
+
+    if (boost::iequals(units, "dB"))
+    {
+        _db = true;
+    }
+    else if (boost::iequals(units, "linear"))
+    {
+        _db = false;
+    }
+    else
+    {
+        logger.error(__PRETTY_FUNCTION__, "psd_units must be dB or linear,",
+                     "not", units);
+        return false;
+    }
+
+    _trim = edge_trim * _fft_size + 0.5;
+
+    if (not make_grid(_sample_rate))
+    {
+        return false;
+    }
+
+    try
+    {
+        _psd.reset(new sdrm::welch_psd(_fft_size, window, overlap,
+                                       integrations, false,
+                                       [this](const float *b, size_t n)
+                                       {
+                                           add_hop(b, n);
+                                       }));
+    }
+    catch (invalid_argument &e)
+    {
+        logger.error(__PRETTY_FUNCTION__, e.what());
+        return false;
+    }
+
+    _state = WAITING;
+    return true;
+}
+
+/**
+ * Works out the hops and where each goes in the stitched spectrum,
+ * for a radio sampling at `sample_rate`, which sets the bin width and
+ * so, unless `hops` are given, the hops' spacing. Puts the spectrum's
+ * frequency axis to "SWEEP.<name>", and clears the sweep in progress.
+ *
+ * @param sample_rate: The radio's samplerate, Hz.
+ *
+ * @return false if there are no hops.
+ *
+ */
+
+bool SweepComponent::make_grid(double sample_rate)
+{
+    size_t kept = _fft_size - 2 * _trim;
+    double bin_hz = sample_rate / _fft_size;
+
+    _hops = _hop_list;
+
+    if (_hops.empty())
+    {
+        // Hops a trimmed spectrum's width apart, from the first whose
+        // lower edge is start_hz to the first that reaches stop_hz.
+        double width = kept * bin_hz;
+
+        for (double c = _start_hz + width / 2; c - width / 2 < _stop_hz;
+             c += width)
+        {
+            _hops.push_back(llround(c));
+        }
+    }
+
+    if (_hops.empty() or kept == 0)
+    {
+        logger.error(__PRETTY_FUNCTION__, "no hops: set `hops`, or",
+                     "start_hz < stop_hz, and edge_trim < 0.5");
+        return false;
+    }
+
+    // Each hop's lowest kept bin is at hop + (trim - fft_size / 2)
+    // bins; the hops are placed on the grid of the lowest of these.
+    double low_edge = ((double)_trim - (double)(_fft_size / 2)) * bin_hz;
+    double lowest = *min_element(_hops.begin(), _hops.end()) + low_edge;
+    size_t bins = 0;
+
+    _offsets.clear();
+
+    for (auto hop : _hops)
+    {
+        _offsets.push_back(llround((hop + low_edge - lowest) / bin_hz));
+        bins = max(bins, _offsets.back() + kept);
+    }
+
+    _sum.assign(bins, 0.0);
+    _count.assign(bins, 0.0);
+    _spectrum.resize(bins);
+    _grid_rate = sample_rate;
+
+    YAML::Node axis;
+    axis["start_hz"] = lowest;
+    axis["bin_hz"] = bin_hz;
+    axis["bins"] = bins;
+    axis["hops"] = _hops;
+    keymaster->put_nb("SWEEP." + my_instance_name, axis, true);
+
+    logger.info(__PRETTY_FUNCTION__, _hops.size(), "hops, from", _hops.front(),
+                "to", _hops.back(), "Hz;", bins, "bins of", bin_hz, "Hz");
+    return true;
+}
+
+/**
+ * Sends the retune for hop `hop`, and waits for it to show up in the
+ * stream. The request carries an id, so the reply can be told from
+ * other clients'; it isn't waited for.
+ *
+ * @param hop: The hop's index.
+ *
+ */
+
+void SweepComponent::tune(size_t hop)
+{
+    YAML::Node request;
+
+    request["id"] = my_instance_name + "." + to_string(_requests++);
+    request["params"].push_back(_device);
+    request["params"].push_back(_hops[hop]);
+
+    _hop = hop;
+    _state = TUNING;
+    _tune_sent = sdrm::stats_now();
+    _tune_sent_utc = Time::getUTC();
+
+    if (hop == 0)
+    {
+        _sweep_start = _tune_sent;
+    }
+
+    keymaster->put_nb("AIRSPYCMDS.set_freq.request", request, true);
+}
+
+/**
+ * The PSD engine's output: adds the hop's spectrum, less its trimmed
+ * edges, to the stitched spectrum. Only the first spectrum of a hop
+ * counts; any more finished by the same buffer are ignored.
+ *
+ * @param bins: The spectrum, in FFT order, linear power.
+ *
+ * @param n: fft_size.
+ *
+ */
+
+void SweepComponent::add_hop(const float *bins, size_t n)
+{
+    if (_hop_done)
+    {
+        return;
+    }
+
+    size_t kept = n - 2 * _trim;
+    size_t offset = _offsets[_hop];
+    // FFT order puts DC at 0 and the lowest frequency at n - n / 2;
+    // the first kept bin is _trim above that.
+    size_t k = n - n / 2 + _trim;
+
+    for (size_t i = 0; i < kept; ++i, ++k)
+    {
+        _sum[offset + i] += bins[k % n];
+        _count[offset + i] += 1.0f;
+    }
+
+    _hop_done = true;
+}
+
+/**
+ * Publishes the stitched spectrum and clears it for the next sweep.
+ * It carries the sample index and time of the first hop's first
+ * sample.
+ *
+ */
+
+void SweepComponent::finish_sweep()
+{
+    size_t bins = _spectrum.size();
+
+    for (size_t i = 0; i < bins; ++i)
+    {
+        _spectrum[i] = _count[i] > 0.0f ? _sum[i] / _count[i] : 0.0f;
+    }
+
+    if (_db)
+    {
+        sdrm::power_to_db(_spectrum.data(), _spectrum.data(), bins);
+    }
+
+    for (size_t i = 0; i < bins; ++i)
+    {
+        if (_count[i] == 0.0f)
+        {
+            _spectrum[i] = numeric_limits<float>::quiet_NaN();
+        }
+    }
+
+    sdrm::pack_power_frame(_outbuf, _wire_format, _sweep_sequence++, 0,
+                           _spectrum.data(), bins, 1, _sweep_index,
+                           _sweep_timestamp);
+    sweep_source.publish(_outbuf);
+
+    fill(_sum.begin(), _sum.end(), 0.0f);
+    fill(_count.begin(), _count.end(), 0.0f);
+    _stat_sweeps.add();
+    _stat_sweep_time.record(sdrm::stats_now() - _sweep_start);
+}
+
+/**
+ * Takes one received buffer through the hop's states: buffers of the
+ * old tuning are dropped; the first of a new tune epoch, tuned to the
+ * hop's frequency, begins the settling samples; after them, samples
+ * go to the PSD engine until the hop's spectrum is done, and then the
+ * next hop is tuned at once. Should the radio be retuned, or drop
+ * samples, while a hop is being measured, the hop starts over; and
+ * should it have been tuned away from the hop, by another client, it
+ * is tuned back.
+ *
+ * @param reader: The received buffer.
+ *
+ */
+
+void SweepComponent::process(const sdrm::iq_frame_reader &reader)
+{
+    const sdrm::complex_float_t *samples = reader.samples();
+    size_t n = reader.sample_count();
+    const sdrm::tuning_t &tuning = reader.tuning();
+    // A stream that doesn't say its samplerate is taken to be as
+    // configured.
+    uint32_t rate = tuning.samplerate ? tuning.samplerate
+        : (uint32_t)_sample_rate;
+
+    if (rate != _grid_rate)
+    {
+        // The bins, and perhaps the hops, are no longer where they
+        // were; the sweep starts over on the new grid.
+        if (not make_grid(rate))
+        {
+            _stat_stale.add(n);
+            return;
+        }
+
+        if (_state != WAITING)
+        {
+            _stat_restarts.add();
+            _epoch = tuning.epoch;
+            _stat_stale.add(n);
+            tune(0);
+            return;
+        }
+    }
+
+    // The frequency is 0 while the radio is being retuned, so such
+    // buffers are never on the hop.
+    bool on_hop = _state != WAITING and tuning.frequency == _hops[_hop];
+
+    if (_state == WAITING)
+    {
+        // Anything that came before is old, whether or not the first
+        // retune happens to go to the current frequency.
+        _epoch = tuning.epoch;
+        _stat_stale.add(n);
+        tune(0);
+        return;
+    }
+
+    if (_state == TUNING)
+    {
+        // A new epoch may yet be some other setting's, applied before
+        // the retune.
+        if (tuning.epoch == _epoch or not on_hop)
+        {
+            _epoch = tuning.epoch;
+            _stat_stale.add(n);
+            return;
+        }
+
+        _epoch = tuning.epoch;
+        _dropped = reader.dropped_samples();
+        _settle_left = _settle_time * rate;
+        _state = SETTLING;
+    }
+    else if (tuning.epoch != _epoch
+             or reader.dropped_samples() != _dropped)
+    {
+        _stat_restarts.add();
+
+        if (tuning.frequency == 0)
+        {
+            // Some change is being made; wait for it to finish, as
+            // for a retune of our own.
+            _epoch = tuning.epoch;
+            _stat_stale.add(n);
+            _state = TUNING;
+            _tune_sent = sdrm::stats_now();
+            return;
+        }
+
+        if (not on_hop)
+        {
+            _stat_stale.add(n);
+            tune(_hop);
+            return;
+        }
+
+        _epoch = tuning.epoch;
+        _dropped = reader.dropped_samples();
+        _settle_left = _settle_time * rate;
+        _state = SETTLING;
+    }
+
+    if (_state == SETTLING)
+    {
+        size_t skip = min((uint64_t)n, _settle_left);
+
+        _settle_left -= skip;
+        _stat_settle.add(skip);
+
+        if (_settle_left > 0 or skip == n)
+        {
+            return;
+        }
+
+        // The first valid sample. The gap runs from the retune
+        // command to its capture.
+        uint64_t captured = reader.timestamp()
+            ? sdrm::sample_timestamp(reader.timestamp(), skip, rate)
+            : Time::getUTC();
+
+        _stat_retune_gap.record(captured > _tune_sent_utc
+                                ? captured - _tune_sent_utc : 0);
+
+        if (_hop == 0)
+        {
+            _sweep_index = reader.sample_index() + skip;
+            _sweep_timestamp = captured;
+        }
+
+        samples += skip;
+        n -= skip;
+        _psd->reset();
+        _hop_done = false;
+        _state = MEASURING;
+    }
+
+    _psd->add(samples, n);
+
+    if (_hop_done)
+    {
+        _stat_hops.add();
+        _stat_hop_time.record(sdrm::stats_now() - _tune_sent);
+
+        if (_hop + 1 == _hops.size())
+        {
+            finish_sweep();
+            tune(0);
+        }
+        else
+        {
+            tune(_hop + 1);
+        }
+    }
+}
+
+/**
+ * Writes the component's statistics to "STATS.<name>":
+ *
+ *   received:        messages received
+ *   hops, sweeps:    hops and sweeps done; their rates are hops/s and
+ *                    sweeps/s
+ *   stale_samples:   samples dropped unread, from before a retune
+ *   settle_samples:  samples discarded while the radio settled
+ *   tune_timeouts:   retunes sent again, not having shown up in the
+ *                    stream within tune_timeout_ms
+ *   restarts:        hops begun again, the radio having been retuned
+ *                    or having dropped samples during the hop
+ *   retune_gap:      retune command to the capture of the first valid
+ *                    sample; the sweep's dead time per hop
+ *   hop_time:        retune command to the hop's spectrum being done
+ *   sweep_time:      time per sweep
+ *
+ * Counters have a total and a rate, histograms percentiles; see
+ * sdrm::stats_group::report(). How often is set by
+ *
+ *   stats_interval_ms: 1000   # 0 turns reporting off
+ *
+ */
+
+void SweepComponent::report_stats()
+{
+    YAML::Node stats;
+    _stats.report(stats);
+    keymaster->put_nb("STATS." + my_instance_name, stats, true);
+}
+
+void SweepComponent::receiving_task()
+{
+    // Wake up often enough to notice a lost retune.
+    Time::Time_t timeout = min((uint64_t)Time::TM_ONE_SEC, _tune_timeout);
+    sdrm::iq_frame_reader reader;
+
+    logger.info(__PRETTY_FUNCTION__, "running");
+    _run_thread_started.signal(true);
+
+    while (_run.load())
+    {
+        if (_stats.due(_stats_interval))
+        {
+            report_stats();
+        }
+
+        if (_state == TUNING
+            and sdrm::stats_now() - _tune_sent > _tune_timeout)
+        {
+            _stat_timeouts.add();
+            tune(_hop);
+        }
+
+        string inbuf;
+
+        if (not input_signal_sink->timed_get(inbuf, timeout))
+        {
+            continue;
+        }
+
+        sdrm::trace_span span("sweep.process");
+
+        if (not reader.parse(inbuf))
+        {
+            logger.warning(__PRETTY_FUNCTION__, "Malformed IQ message.");
+            continue;
+        }
+
+        span.set_id(reader.sequence());
+        _stat_received.add();
+
+        if (reader.sample_format() != sdrm::SAMPLE_CF32)
+        {
+            logger.warning(__PRETTY_FUNCTION__, "Input is not IQ data.");
+            continue;
+        }
+
+        process(reader);
+    }
+}
@@ -0,0 +1,186 @@
+/*******************************************************************
+ *  sweep_component.h - Sweeps a radio across a band, and stitches
+ *  the spectra into one.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined _SWEEP_COMPONENT_H_
+#define _SWEEP_COMPONENT_H_
+
+#include "sdrm_types.h"
+#include "iq_frame.h"
+#include "welch_psd.h"
+#include "stats.h"
+
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
+#include "matrix/DataSource.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * \class SweepComponent
+ *
+ * Covers a band wider than the radio's by stepping it through a list
+ * of center frequencies ("hops"), estimating an averaged power
+ * spectrum at each, and stitching the spectra into one. Each finished
+ * sweep is published on "sweep_data" as a power frame, and the sweep
+ * starts over.
+ *
+ * The component retunes the radio itself, with AIRSPYCMDS.set_freq,
+ * and reads its samples on "input_data". It doesn't wait for the
+ * command's reply: the radio tags each buffer with its tuning, whose
+ * epoch changes with every retune, so the first buffer of a new
+ * epoch at the hop's frequency marks the retune in the stream. From
+ * there `settle_ms` of samples are discarded, while the radio's
+ * synthesizer and filters settle, and the rest go into the hop's
+ * spectrum. Once it is done
+ * the next retune is sent at once, and buffers still arriving from
+ * the old tuning are dropped unread.
+ *
+ * Each hop's spectrum loses `edge_trim` of its bins at either edge,
+ * where the radio's anti-aliasing filter rolls off; the hops are
+ * placed on one frequency grid, and where they overlap their bins
+ * are averaged. Configuration:
+ *
+ *   device: 3914166012436147519  # serial number of the radio to
+ *                                # tune; required
+ *   hops: [7100000, 7700000]     # center frequencies, Hz; or else
+ *   start_hz: 500000             # cover start_hz to stop_hz with
+ *   stop_hz: 30000000            # hops spaced by the trimmed width
+ *   sample_rate: 768000          # the radio's samplerate, if its
+ *                                # samples don't say
+ *   fft_size: 1024
+ *   window: hann                 # see sdrm::make_window()
+ *   overlap: 0.5
+ *   integrations: 8              # spectra averaged per hop
+ *   edge_trim: 0.1               # fraction of bins dropped at each edge
+ *   settle_ms: 1.0               # samples discarded after a retune
+ *   tune_timeout_ms: 500         # resend a retune not seen by then
+ *   psd_units: dB                # or "linear"
+ *   wire_format: msgpack         # or raw
+ *   stats_interval_ms: 1000      # telemetry to STATS.<name>; 0: off
+ *
+ * The stitched spectrum's frequency axis is put to "SWEEP.<name>":
+ * start_hz (of bin 0), bin_hz, bins, and the hops. Bins that no hop
+ * covers are NaN. The bins' width, and the hops' spacing if worked
+ * out from start_hz and stop_hz, follow the samplerate the radio's
+ * samples are tagged with; should it change, the axis is put again
+ * and the sweep starts over.
+ *
+ */
+
+class SweepComponent : public matrix::Component
+{
+public:
+
+    virtual ~SweepComponent();
+    static Component *factory(std::string myname,std::string k);
+
+protected:
+    SweepComponent(std::string name, std::string keymaster_url);
+
+    // override various base class methods
+    virtual bool _do_start() override;
+    virtual bool _do_stop()  override;
+
+    bool connect();
+    bool disconnect();
+    bool setup();
+    bool make_grid(double sample_rate);
+
+    enum state_t
+    {
+        WAITING,    // for the first buffer, to learn the tune epoch
+        TUNING,     // retune sent; waiting for a buffer of a new epoch,
+                    // at the hop's frequency
+        SETTLING,   // discarding settle samples
+        MEASURING   // adding samples to the hop's spectrum
+    };
+
+    std::atomic<bool> _run;
+    matrix::TCondition<bool> _run_thread_started;
+    matrix::Thread<SweepComponent> _run_thread;
+    std::unique_ptr<matrix::DataSink<std::string,
+                                     matrix::select_only>> input_signal_sink;
+    matrix::DataSource<msgpack::sbuffer> sweep_source;
+
+    // Configuration; see the class description.
+    uint64_t _device;
+    std::vector<uint64_t> _hop_list;
+    double _start_hz;
+    double _stop_hz;
+    double _sample_rate;
+    size_t _fft_size;
+    size_t _trim;
+    double _settle_time;
+    uint64_t _tune_timeout;
+    bool _db;
+    sdrm::wire_format_t _wire_format;
+    uint64_t _stats_interval;
+
+    // The hop in progress.
+    state_t _state;
+    size_t _hop;
+    uint32_t _epoch;
+    uint64_t _settle_left;
+    uint64_t _dropped;
+    uint64_t _tune_sent;
+    uint64_t _tune_sent_utc;
+    uint64_t _requests;
+    std::unique_ptr<sdrm::welch_psd> _psd;
+    bool _hop_done;
+
+    // The stitched spectrum, for a radio sampling at _grid_rate: each
+    // of _hops has its kept bins summed into _sum from _offsets[hop],
+    // and _count says how many hops cover each bin.
+    double _grid_rate;
+    std::vector<uint64_t> _hops;
+    std::vector<size_t> _offsets;
+    std::vector<float> _sum;
+    std::vector<float> _count;
+    std::vector<float> _spectrum;
+    uint64_t _sweep_sequence;
+    uint64_t _sweep_start;
+    uint64_t _sweep_index;
+    uint64_t _sweep_timestamp;
+    msgpack::sbuffer _outbuf;
+
+    sdrm::stats_group _stats;
+    sdrm::stats_counter &_stat_received;
+    sdrm::stats_counter &_stat_hops;
+    sdrm::stats_counter &_stat_sweeps;
+    sdrm::stats_counter &_stat_stale;
+    sdrm::stats_counter &_stat_settle;
+    sdrm::stats_counter &_stat_timeouts;
+    sdrm::stats_counter &_stat_restarts;
+    sdrm::stats_histogram &_stat_retune_gap;
+    sdrm::stats_histogram &_stat_hop_time;
+    sdrm::stats_histogram &_stat_sweep_time;
+
+    void tune(size_t hop);
+    void add_hop(const float *bins, size_t n);
+    void finish_sweep();
+    void process(const sdrm::iq_frame_reader &reader);
+    void report_stats();
+    void receiving_task();
+};
+
+#endif
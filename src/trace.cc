@@ -0,0 +1,406 @@
+/*******************************************************************
+ *  trace.cc - Per-buffer pipeline tracing, written as Chrome trace
+ *  JSON.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "trace.h"
+#include "matrix/log_t.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static matrix::log_t logger("trace");
+
+namespace sdrm
+{
+    /**
+     * A thread's claim on its ring, given back when the thread exits.
+     *
+     */
+
+    struct trace_ring_owner
+    {
+        trace_recorder::ring_t *ring = NULL;
+
+        ~trace_ring_owner()
+        {
+            if (ring)
+            {
+                trace_recorder::instance().release(ring);
+            }
+        }
+    };
+
+    trace_recorder &trace_recorder::instance()
+    {
+        static trace_recorder recorder;
+        return recorder;
+    }
+
+    trace_recorder::trace_recorder()
+        : _enabled(false),
+          _threshold(0),
+          _triggered(0),
+          _capacity(32768),
+          _window(2 * 1000000000ULL),
+          _directory("/tmp")
+    {
+    }
+
+    trace_recorder::ring_t::ring_t(size_t capacity)
+        : head(0),
+          claimed(0),
+          first(0),
+          tid(0),
+          in_use(true)
+    {
+        size_t n = 1;
+
+        while (n < capacity)
+        {
+            n <<= 1;
+        }
+
+        spans.reset(new span_t[n]);
+        mask = n - 1;
+    }
+
+    /**
+     * Gives the calling thread a ring: one left by a thread that has
+     * exited if there is one, so that restarting components doesn't
+     * grow the recorder, or else a new one.
+     *
+     */
+
+    trace_recorder::ring_t *trace_recorder::claim()
+    {
+        lock_guard<mutex> l(_mutex);
+        ring_t *r = NULL;
+
+        for (auto &p : _rings)
+        {
+            if (not p->in_use)
+            {
+                r = p.get();
+                r->in_use = true;
+                r->first = r->head.load(memory_order_relaxed);
+                break;
+            }
+        }
+
+        if (r == NULL)
+        {
+            _rings.emplace_back(new ring_t(_capacity.load()));
+            r = _rings.back().get();
+        }
+
+        char name[64] = "";
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        r->tid = syscall(SYS_gettid);
+        r->thread_name = name;
+        return r;
+    }
+
+    void trace_recorder::release(ring_t *r)
+    {
+        lock_guard<mutex> l(_mutex);
+        r->in_use = false;
+    }
+
+    /**
+     * Records a span in the calling thread's ring. Called by
+     * trace_span, only while tracing is enabled.
+     *
+     * @param name: The stage.
+     *
+     * @param id: The buffer's id.
+     *
+     * @param begin: The start time, from stats_now().
+     *
+     * @param end: The end time.
+     *
+     */
+
+    void trace_recorder::record(const char *name, uint64_t id, uint64_t begin,
+                                uint64_t end)
+    {
+        static thread_local trace_ring_owner owner;
+
+        if (owner.ring == NULL)
+        {
+            owner.ring = claim();
+        }
+
+        ring_t *r = owner.ring;
+        uint64_t h = r->head.load(memory_order_relaxed);
+        span_t &s = r->spans[h & r->mask];
+
+        r->claimed.store(h + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s.name.store(name, memory_order_relaxed);
+        s.id.store(id, memory_order_relaxed);
+        s.begin.store(begin, memory_order_relaxed);
+        s.end.store(end, memory_order_relaxed);
+        r->head.store(h + 1, memory_order_release);
+
+        uint64_t threshold = _threshold.load(memory_order_relaxed);
+
+        if (threshold > 0 && end - begin > threshold)
+        {
+            uint64_t none = 0;
+            _triggered.compare_exchange_strong(none, end,
+                                               memory_order_relaxed);
+        }
+    }
+
+    void trace_recorder::enable(bool on)
+    {
+        _enabled.store(on, memory_order_relaxed);
+    }
+
+    /**
+     * Sets the span length that triggers a dump. See poll().
+     *
+     * @param ns: The threshold; 0 for none.
+     *
+     */
+
+    void trace_recorder::set_threshold(uint64_t ns)
+    {
+        _threshold.store(ns, memory_order_relaxed);
+    }
+
+    /**
+     * Sets the size of the rings given to threads from now on.
+     *
+     * @param spans: The number of spans each holds; rounded up to a
+     * power of 2.
+     *
+     */
+
+    void trace_recorder::set_capacity(size_t spans)
+    {
+        _capacity.store(max(spans, (size_t)1), memory_order_relaxed);
+    }
+
+    /**
+     * Writes the spans in the rings as Chrome trace JSON: one
+     * complete ("X") event per span, with the buffer id as an
+     * argument, and a name for each thread. Times are microseconds of
+     * CLOCK_MONOTONIC; the offset to UTC is given in otherData.
+     *
+     * @param path: The file to write.
+     *
+     * @param since: Only spans ending at or after this time (from
+     * stats_now()) are written.
+     *
+     * @return The number of spans written.
+     *
+     */
+
+    size_t trace_recorder::dump(string path, uint64_t since)
+    {
+        FILE *f = fopen(path.c_str(), "w");
+
+        if (f == NULL)
+        {
+            logger.error(__PRETTY_FUNCTION__, "can't write", path);
+            return 0;
+        }
+
+        timespec utc;
+        clock_gettime(CLOCK_REALTIME, &utc);
+        uint64_t now = stats_now();
+        int64_t offset = (int64_t)((uint64_t)utc.tv_sec * 1000000000ULL
+                                   + utc.tv_nsec - now);
+        int pid = getpid();
+        size_t written = 0;
+        const char *sep = "";
+
+        fprintf(f, "{\"displayTimeUnit\": \"ns\",\n"
+                "\"otherData\": {\"clock\": \"CLOCK_MONOTONIC\", "
+                "\"utc_minus_monotonic_ns\": %lld},\n"
+                "\"traceEvents\": [\n", (long long)offset);
+
+        lock_guard<mutex> l(_mutex);
+
+        for (auto &p : _rings)
+        {
+            ring_t &r = *p;
+            uint64_t capacity = r.mask + 1;
+            uint64_t head = r.head.load(memory_order_acquire);
+            uint64_t lo = head > capacity ? head - capacity : 0;
+            lo = max(lo, r.first);
+
+            struct copy_t
+            {
+                const char *name;
+                uint64_t id;
+                uint64_t begin;
+                uint64_t end;
+            };
+
+            vector<copy_t> spans;
+            spans.reserve(head - lo);
+
+            for (uint64_t i = lo; i < head; ++i)
+            {
+                span_t &s = r.spans[i & r.mask];
+                spans.push_back({s.name.load(memory_order_relaxed),
+                                 s.id.load(memory_order_relaxed),
+                                 s.begin.load(memory_order_relaxed),
+                                 s.end.load(memory_order_relaxed)});
+            }
+
+            // Spans the writer may have overwritten while they were
+            // copied are dropped.
+            atomic_thread_fence(memory_order_acquire);
+            uint64_t claimed = r.claimed.load(memory_order_relaxed);
+            uint64_t valid = claimed > capacity ? claimed - capacity : 0;
+
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": %d, \"tid\": %ld, \"args\": {\"name\": \"%s\"}}",
+                    sep, pid, r.tid, r.thread_name.c_str());
+            sep = ",\n";
+
+            for (uint64_t i = max(lo, valid); i < head; ++i)
+            {
+                const copy_t &s = spans[i - lo];
+
+                if (s.end < since)
+                {
+                    continue;
+                }
+
+                uint64_t dur = s.end - s.begin;
+                fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"sdrm\", "
+                        "\"ph\": \"X\", \"ts\": %llu.%03llu, "
+                        "\"dur\": %llu.%03llu, \"pid\": %d, \"tid\": %ld, "
+                        "\"args\": {\"id\": %llu}}",
+                        sep, s.name,
+                        (unsigned long long)(s.begin / 1000),
+                        (unsigned long long)(s.begin % 1000),
+                        (unsigned long long)(dur / 1000),
+                        (unsigned long long)(dur % 1000),
+                        pid, r.tid, (unsigned long long)s.id);
+                ++written;
+            }
+        }
+
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        logger.info(__PRETTY_FUNCTION__, "wrote", written, "spans to", path);
+        return written;
+    }
+
+    /**
+     * A new dump file's name: the directory, and the UTC time.
+     *
+     */
+
+    static string dump_file_name(string directory)
+    {
+        time_t t = time(NULL);
+        tm utc;
+        char buf[64];
+
+        gmtime_r(&t, &utc);
+        strftime(buf, sizeof(buf), "sdrm_trace_%Y%m%d_%H%M%S.json", &utc);
+        return directory + "/" + buf;
+    }
+
+    /**
+     * Applies the Keymaster's TRACE settings, and writes any dump that
+     * is due. Meant to be called about once a second by the
+     * process's main loop:
+     *
+     *   TRACE:
+     *     enabled: false      # record spans
+     *     buffer_spans: 32768 # per thread; for threads starting later
+     *     threshold_ms: 0     # dump when a span is longer; 0: never
+     *     window_ms: 2000     # history in a threshold dump
+     *     directory: /tmp     # where dumps are written
+     *     dump: false         # set true to dump everything now
+     *
+     * A threshold dump covers the `window_ms` before the slow span and
+     * whatever followed it until this call. Each dump's file name is
+     * put in TRACE.last_dump, and `dump` is reset to false.
+     *
+     * @param km: The Keymaster client to use.
+     *
+     */
+
+    void trace_recorder::poll(matrix::Keymaster &km)
+    {
+        YAML::Node cfg;
+
+        try
+        {
+            cfg = km.get("TRACE");
+        }
+        catch (matrix::KeymasterException &e)
+        {
+            return;
+        }
+
+        if (not cfg.IsMap())
+        {
+            return;
+        }
+
+        try
+        {
+            enable(cfg["enabled"].as<bool>(false));
+            set_capacity(cfg["buffer_spans"].as<size_t>(32768));
+            set_threshold(cfg["threshold_ms"].as<double>(0.0) * 1000000);
+            _window = cfg["window_ms"].as<double>(2000.0) * 1000000;
+            _directory = cfg["directory"].as<string>("/tmp");
+
+            if (cfg["dump"].as<bool>(false))
+            {
+                string path = dump_file_name(_directory);
+                dump(path);
+                km.put("TRACE.dump", false);
+                km.put("TRACE.last_dump", path);
+            }
+        }
+        catch (YAML::Exception &e)
+        {
+            logger.error(__PRETTY_FUNCTION__, "bad TRACE settings:", e.what());
+            return;
+        }
+
+        uint64_t triggered = _triggered.load(memory_order_relaxed);
+
+        if (triggered > 0)
+        {
+            string path = dump_file_name(_directory);
+            dump(path, triggered > _window ? triggered - _window : 0);
+            km.put("TRACE.last_dump", path);
+            _triggered.store(0, memory_order_relaxed);
+        }
+    }
+}
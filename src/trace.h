@@ -0,0 +1,171 @@
+/*******************************************************************
+ *  trace.h - Per-buffer pipeline tracing, written as Chrome trace
+ *  JSON.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_TRACE_H_)
+#define _TRACE_H_
+
+#include "stats.h"
+#include "matrix/Keymaster.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sdrm
+{
+    /**
+     * \class trace_recorder
+     *
+     * Records what each pipeline stage does with each buffer, as
+     * spans: a stage name, the buffer's id (its sequence number), and
+     * begin and end times. Each thread records into its own ring of
+     * the most recent spans, which only it writes, so recording takes
+     * no lock; when the ring is full the oldest spans are overwritten.
+     *
+     * Recording is off until enabled, and while off a trace_span costs
+     * one relaxed load. The rings may be dumped at any time, from any
+     * thread, as Chrome trace JSON, which chrome://tracing and
+     * Perfetto display as a timeline per thread. A dump may also be
+     * triggered by any span longer than a threshold, so that a latency
+     * spike leaves a record of the pipeline around it.
+     *
+     * There is one recorder per process; see instance(). Its control
+     * from the Keymaster is described at poll().
+     *
+     */
+
+    class trace_recorder
+    {
+    public:
+        static trace_recorder &instance();
+
+        bool enabled() const
+        {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        void record(const char *name, uint64_t id, uint64_t begin,
+                    uint64_t end);
+
+        void enable(bool on);
+        void set_threshold(uint64_t ns);
+        void set_capacity(size_t spans);
+        size_t dump(std::string path, uint64_t since = 0);
+        void poll(matrix::Keymaster &km);
+
+    private:
+        struct span_t
+        {
+            std::atomic<const char *> name;
+            std::atomic<uint64_t> id;
+            std::atomic<uint64_t> begin;
+            std::atomic<uint64_t> end;
+        };
+
+        struct ring_t
+        {
+            ring_t(size_t capacity);
+
+            std::unique_ptr<span_t[]> spans;
+            size_t mask;
+            // spans written, and spans written or being written. A
+            // reader copies up to `head`, then discards whatever
+            // `claimed` says may have been overwritten meanwhile.
+            std::atomic<uint64_t> head;
+            std::atomic<uint64_t> claimed;
+            // spans before this are a previous thread's; see claim().
+            uint64_t first;
+            long tid;
+            std::string thread_name;
+            // false once the owning thread has exited, when the ring
+            // may be given to a new one.
+            bool in_use;
+        };
+
+        friend struct trace_ring_owner;
+
+        trace_recorder();
+        ring_t *claim();
+        void release(ring_t *r);
+
+        std::atomic<bool> _enabled;
+        std::atomic<uint64_t> _threshold;
+        // end time of the first span over the threshold since the last
+        // threshold dump; 0 if none.
+        std::atomic<uint64_t> _triggered;
+        std::atomic<size_t> _capacity;
+
+        // The rings, guarded by _mutex. Rings are never freed, so a
+        // thread may keep using its own without the lock.
+        std::mutex _mutex;
+        std::vector<std::unique_ptr<ring_t>> _rings;
+
+        // poll()'s settings; the polling thread's only.
+        uint64_t _window;
+        std::string _directory;
+    };
+
+    /**
+     * \class trace_span
+     *
+     * Records a span from its construction to its destruction, if
+     * tracing is enabled when it is constructed. `name` must be a
+     * string literal, or otherwise outlive the recorder.
+     *
+     */
+
+    class trace_span
+    {
+    public:
+        trace_span(const char *name, uint64_t id = 0)
+            : _name(trace_recorder::instance().enabled() ? name : NULL),
+              _id(id),
+              _begin(_name ? stats_now() : 0)
+        {
+        }
+
+        ~trace_span()
+        {
+            if (_name)
+            {
+                trace_recorder::instance().record(_name, _id, _begin,
+                                                  stats_now());
+            }
+        }
+
+        // For spans whose buffer is only known part way through.
+        void set_id(uint64_t id)
+        {
+            _id = id;
+        }
+
+    private:
+        const char *_name;
+        uint64_t _id;
+        uint64_t _begin;
+    };
+}
+
+#endif
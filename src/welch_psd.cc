@@ -0,0 +1,235 @@
+/*******************************************************************
+ *  welch_psd.cc - Welch averaged power spectrum estimation.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#include "welch_psd.h"
+#include "fftwp.h"
+#include "simd_kernels.h"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+namespace sdrm
+{
+    /**
+     * Computes a window function.
+     *
+     * @param name: One of "rectangular", "hann", "hamming",
+     * "blackman", "blackman-harris".
+     *
+     * @param n: The window length.
+     *
+     * @return The `n` window coefficients. Throws
+     * std::invalid_argument if `name` is not recognized.
+     *
+     */
+
+    vector<float> make_window(string name, size_t n)
+    {
+        // Generalized cosine windows: w[i] = sum_k (-1)^k a_k cos(2 pi k i / n).
+        // Periodic (DFT-even) forms, as is usual for spectral analysis.
+        vector<double> a;
+
+        if (name == "rectangular")
+        {
+            a = {1.0};
+        }
+        else if (name == "hann")
+        {
+            a = {0.5, 0.5};
+        }
+        else if (name == "hamming")
+        {
+            a = {0.54, 0.46};
+        }
+        else if (name == "blackman")
+        {
+            a = {0.42, 0.5, 0.08};
+        }
+        else if (name == "blackman-harris")
+        {
+            a = {0.35875, 0.48829, 0.14128, 0.01168};
+        }
+        else
+        {
+            throw invalid_argument("Unknown window '" + name + "'");
+        }
+
+        vector<float> w(n);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            double v = 0.0;
+
+            for (size_t k = 0; k < a.size(); ++k)
+            {
+                v += (k & 1 ? -a[k] : a[k]) * cos(2.0 * M_PI * k * i / n);
+            }
+
+            w[i] = v;
+        }
+
+        return w;
+    }
+
+    // The hop between segments of `fft_size` samples that overlap by
+    // the fraction `overlap`.
+    static size_t overlap_hop(size_t fft_size, double overlap)
+    {
+        if (overlap < 0.0 || overlap >= 1.0)
+        {
+            throw invalid_argument("welch_psd: overlap must be in [0, 1)");
+        }
+
+        return max((size_t)1, fft_size - (size_t)lround(fft_size * overlap));
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param fft_size: The segment (and FFT) length.
+     *
+     * @param window: The window name; see make_window().
+     *
+     * @param overlap: The fraction, 0 to < 1, by which successive
+     * segments overlap. 0.5 is usual for Hann; 0.75 for the
+     * Blackman family.
+     *
+     * @param integrations: The number of segments averaged into each
+     * output spectrum.
+     *
+     * @param db: Output 10 log10(power) rather than power.
+     *
+     * @param output: Called with each finished spectrum. The bins are
+     * only valid during the call.
+     *
+     */
+
+    welch_psd::welch_psd(size_t fft_size, string window, double overlap,
+                         size_t integrations, bool db, output_t output)
+        : _fft_size(fft_size),
+          _integrations(max(integrations, (size_t)1)),
+          _db(db),
+          _output(output),
+          _window(make_window(window, fft_size)),
+          _framer(fft_size, overlap_hop(fft_size, overlap)),
+          _accumulator(fft_size, 0.0),
+          _result(fft_size),
+          _count(0),
+          _sample_index(0),
+          _timestamp(0)
+    {
+        double power = 0.0;
+
+        for (auto w : _window)
+        {
+            power += w * w;
+        }
+
+        // Dividing the sum of |X|^2 by this gives the average power
+        // spectrum, normalized as described in the class comment.
+        _scale = 1.0 / (power * _integrations);
+    }
+
+    /**
+     * Discards any partial segment and partial integration, e.g.
+     * after a gap in the input.
+     *
+     */
+
+    void welch_psd::reset()
+    {
+        _framer.reset();
+        _count = 0;
+        fill(_accumulator.begin(), _accumulator.end(), 0.0);
+    }
+
+    /**
+     * Adds samples to the estimate. Any spectra finished as a result
+     * are passed to the output callback before add() returns.
+     *
+     * @param samples: The next `n` samples of the stream.
+     *
+     * @param n: The number of samples.
+     *
+     */
+
+    void welch_psd::add(const complex_float_t *samples, size_t n)
+    {
+        size_t used = 0;
+
+        while (used < n)
+        {
+            used += _framer.add(samples + used, n - used);
+
+            for (auto f = _framer.front(); f; f = _framer.front())
+            {
+                process_segment(*f);
+                _framer.pop();
+            }
+        }
+    }
+
+    /**
+     * Windows and transforms one segment and accumulates its power.
+     *
+     */
+
+    void welch_psd::process_segment(const iq_framer_frame_t &segment)
+    {
+        complex_float_t *x = fft_thread_buffer(_fft_size, 0);
+
+        if (_count == 0)
+        {
+            _sample_index = segment.sample_index;
+            _timestamp = segment.timestamp;
+        }
+
+        apply_window(segment.samples, _window.data(), x, _fft_size);
+        one_dimensional_dfft(x, x, _fft_size);
+        accumulate_power(x, _accumulator.data(), _fft_size);
+
+        if (++_count == _integrations)
+        {
+            finish_integration();
+        }
+    }
+
+    void welch_psd::finish_integration()
+    {
+        if (_db)
+        {
+            power_to_db(_accumulator.data(), _result.data(), _fft_size, _scale);
+        }
+        else
+        {
+            for (size_t i = 0; i < _fft_size; ++i)
+            {
+                _result[i] = _accumulator[i] * _scale;
+            }
+        }
+
+        fill(_accumulator.begin(), _accumulator.end(), 0.0);
+        _count = 0;
+        _output(_result.data(), _fft_size);
+    }
+}
@@ -0,0 +1,103 @@
+/*******************************************************************
+ *  welch_psd.h - Welch averaged power spectrum estimation.
+ *
+ *  Copyright (C) 2019 Ramon Creager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *******************************************************************/
+
+#if !defined(_WELCH_PSD_H_)
+#define _WELCH_PSD_H_
+
+#include "sdrm_types.h"
+#include "iq_framer.h"
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace sdrm
+{
+    std::vector<float> make_window(std::string name, size_t n);
+
+    /**
+     * \class welch_psd
+     *
+     * Estimates the power spectrum of a continuous IQ stream by
+     * Welch's method: the stream is cut into segments of `fft_size`
+     * samples, successive segments overlapping by `overlap` (a
+     * fraction of the segment), each segment is windowed and
+     * transformed, and |X|^2 is averaged over `integrations`
+     * segments. The segments are cut by an iq_framer, so the input may
+     * be delivered in buffers of any size.
+     *
+     * Each finished spectrum is handed to the `output` callback as
+     * `fft_size` floats in FFT bin order (DC first). The bins are
+     * normalized by the window's power, so that for white noise each
+     * bin's expected value is the noise variance per sample (i.e.
+     * power per bin of width samplerate / fft_size), whatever the
+     * window. With `db` they are 10 log10 of that.
+     *
+     * If the input's clock is given with set_clock(), then during the
+     * callback sample_index() and timestamp() place the spectrum's
+     * first sample in the source's stream.
+     *
+     */
+
+    class welch_psd
+    {
+    public:
+        typedef std::function<void (const float *bins, size_t n)> output_t;
+
+        welch_psd(size_t fft_size, std::string window, double overlap,
+                  size_t integrations, bool db, output_t output);
+
+        void add(const complex_float_t *samples, size_t n);
+        void reset();
+        void set_clock(uint64_t sample_index, uint64_t timestamp)
+        {
+            _framer.set_clock(sample_index, timestamp);
+        }
+
+        size_t fft_size() const {return _fft_size;}
+        size_t hop() const {return _framer.hop();}
+        uint64_t sample_index() const {return _sample_index;}
+        uint64_t timestamp() const {return _timestamp;}
+
+    private:
+        void process_segment(const iq_framer_frame_t &segment);
+        void finish_integration();
+
+        size_t _fft_size;
+        size_t _integrations;
+        bool _db;
+        output_t _output;
+
+        std::vector<float> _window;
+        float _scale;
+
+        iq_framer _framer;
+
+        std::vector<float> _accumulator;
+        std::vector<float> _result;
+        size_t _count;
+        // Of the first segment of the integration in progress.
+        uint64_t _sample_index;
+        uint64_t _timestamp;
+    };
+}
+
+#endif